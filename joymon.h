@@ -0,0 +1,245 @@
+/*
+ * Copyright 2002-2011 Giles Malet.
+ *
+ * This file is part of JoyMon.
+ *
+ * JoyMon is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * JoyMon is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with JoyMon.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//----------------------------------------------------------------------------
+// File: joymon.h
+//
+// Records and shared structures that JoyMon makes available to other programs.
+// Include this (it needs <windows.h> first) to read the live sample feed:
+//
+//		JOYMON_READER r;
+//		JOYREC rec;
+//		if ( JoyMonOpen( &r ) ) {
+//			JoyMonLatest( &r, &rec );					// where the stick is now
+//			while ( JoyMonRead( &r, &rec, 1 ) > 0 )		// or everything, in order
+//				...
+//			JoyMonClose( &r );
+//		}
+//-----------------------------------------------------------------------------
+#ifndef JOYMON_H
+#define JOYMON_H
+
+//-----------------------------------------------------------------------------
+// One sample, or other event. Used between JoyMon's threads, and in the feed.
+//-----------------------------------------------------------------------------
+typedef struct {
+	LONGLONG	time;		// microseconds since the session clock started (see qpcbase)
+	LONG		x, y;		// axis values as written, so Y is already flipped
+	WORD		type;		// JOYREC_SAMPLE, ...
+	WORD		button;		// samples: state of the monitored button; events: which button
+	DWORD		flags;		// JOYREC_PRESSED, ...
+} JOYREC;
+
+// Record types
+#define JOYREC_SAMPLE		0	// a position sample
+#define JOYREC_BUTTON		1	// a button changed state
+#define JOYREC_ENVELOPE		2	// min (or max) of the samples behind the next one; not in the feed
+#define JOYREC_RAW			3	// the next sample before conditioning; not in the feed
+#define JOYREC_GAP			4	// samples weren't taken from time on: x is how many, y the microsecs they'd cover
+#define JOYREC_DISCONNECT	5	// the joystick couldn't be read from time on: x is the DirectInput error
+#define JOYREC_RECONNECT	6	// it's back: y is the microsecs it was away, capped at MAXLONG
+
+// Record flags
+#define JOYREC_PRESSED		0x0001	// JOYREC_BUTTON: it went down, else up
+#define JOYREC_MAXIMUM		0x0002	// JOYREC_ENVELOPE: the max, else the min
+#define JOYREC_RAWUNITS		0x0004	// x and y are in the device's own units, and Y isn't flipped
+
+//-----------------------------------------------------------------------------
+// The live feed: a named shared memory block holding the latest sample, and
+// a ring of every sample, button event, gap, disconnect and reconnect. There's
+// one writer (JoyMon); any number of programs can read it without locking.
+//-----------------------------------------------------------------------------
+#define JOYMON_FEED_NAME	"Local\\JoyMonFeed"
+#define JOYMON_FEED_MAGIC	0x4446594AUL		// "JYFD"
+#define JOYMON_FEED_VERSION	2
+#define JOYMON_FEED_SIZE	4096				// records in the ring; a power of two
+
+typedef struct {
+	DWORD			magic, version, size, recsize;
+	volatile LONG	session;	// bumped every time recording starts and the clock is reset, or a
+								// new JoyMon takes the feed over, when head starts again from 0
+	volatile DWORD	tickbase;	// GetTickCount() when the session clock was zero, roughly
+	volatile LONGLONG qpcbase;	// QueryPerformanceCounter() when the session clock was zero
+	LONGLONG		qpcfreq;	// QueryPerformanceFrequency()
+	volatile LONG	latestseq;	// odd while `latest' is being changed
+	JOYREC			latest;		// the most recent position sample
+	volatile LONG	head;		// number of records ever put in the ring
+	JOYREC			ring[JOYMON_FEED_SIZE];	// record n is in ring[n % JOYMON_FEED_SIZE]
+} JOYMON_FEED;
+
+//-----------------------------------------------------------------------------
+// The sample stream: subscribers connect to JoyMon's loopback TCP port and get
+// a series of frames, each a header followed by `count' JOYRECs. A subscriber
+// that can't keep up has whole frames dropped, which shows as a gap in `seq'.
+// If JoyMon itself falls behind, records are lost before they're framed, which
+// shows as `lost' going up.
+//-----------------------------------------------------------------------------
+#define JOYMON_FRAME_MAGIC	0x4D52464AUL		// "JFRM"
+
+typedef struct {
+	DWORD		magic;
+	DWORD		seq;		// frame number, counting from zero when the stream starts
+	WORD		count;		// records following the header
+	WORD		recsize;	// sizeof(JOYREC)
+	DWORD		dropped;	// frames this subscriber has missed because it was too slow
+	DWORD		lost;		// records every subscriber has missed since the stream started
+} JOYMON_FRAME;
+
+//-----------------------------------------------------------------------------
+// Columnar files, as written by `joystick /convert'. They hold the same as a
+// recording, but with the samples in blocks, each column stored together:
+//
+//		JOYMON_COLHEADER
+//		JOYMON_COLBLOCK, then its payload		(repeated to the end)
+//
+// A sample block's payload is `rows' times, as LONGLONG microsecs, then
+// `rows' LONGs for each column in turn. A text block's payload is `rows'
+// comment lines (the banner, markers, anchors and such), each a DWORD giving
+// how many samples came before it in the file, then the line without its
+// newline, ending in a zero byte. Each block has the CRC32C of its payload.
+//-----------------------------------------------------------------------------
+#define JOYMON_COL_MAGIC	0x434D4A4AUL		// "JJMC"
+#define JOYMON_COL_VERSION	1
+#define JOYMON_BLOCK_MAGIC	0x4B4C424AUL		// "JBLK"
+
+// Header flags
+#define JOYMON_COL_BUTTON	0x0001	// the third column is the button state
+
+// Block types
+#define JOYMON_BLOCK_SAMPLES	0
+#define JOYMON_BLOCK_TEXT		1
+
+typedef struct {
+	DWORD		magic, version;
+	WORD		columns;	// after the time: x, y, then whatever followed them in the file
+	WORD		flags;		// JOYMON_COL_BUTTON, ...
+	DWORD		blockrows;	// most samples there'll be in a block
+} JOYMON_COLHEADER;
+
+typedef struct {
+	DWORD		magic;
+	WORD		type;		// JOYMON_BLOCK_SAMPLES, ...
+	WORD		reserved;
+	DWORD		rows;		// samples, or lines of text
+	DWORD		size;		// bytes of payload following
+	DWORD		crc;		// CRC32C of the payload
+} JOYMON_COLBLOCK;
+
+//-----------------------------------------------------------------------------
+// Feed reader
+//-----------------------------------------------------------------------------
+typedef struct {
+	HANDLE						hMap;
+	const volatile JOYMON_FEED *	feed;
+	LONG						cursor;		// next record to read from the ring
+	DWORD						lost;		// records overwritten before we read them
+} JOYMON_READER;
+
+//-----------------------------------------------------------------------------
+// Name: JoyMonOpen()
+// Desc: Attach to the feed. Fails if JoyMon isn't running with the feed on.
+//       Reading starts with the next record put in the ring.
+//-----------------------------------------------------------------------------
+static __inline BOOL JoyMonOpen( JOYMON_READER * r )
+{
+	r->lost = 0;
+	if ( (r->hMap = OpenFileMappingA( FILE_MAP_READ, FALSE, JOYMON_FEED_NAME )) == NULL )
+		return FALSE;
+
+	r->feed = (const volatile JOYMON_FEED *)MapViewOfFile( r->hMap, FILE_MAP_READ, 0, 0, sizeof(JOYMON_FEED) );
+	if ( r->feed == NULL || r->feed->magic != JOYMON_FEED_MAGIC ||
+		 r->feed->version != JOYMON_FEED_VERSION || r->feed->recsize != sizeof(JOYREC) ) {
+		if ( r->feed != NULL )
+			UnmapViewOfFile( (LPCVOID)r->feed );
+		CloseHandle( r->hMap );
+		return FALSE;
+	}
+
+	r->cursor = r->feed->head;
+	return TRUE;
+}
+
+//-----------------------------------------------------------------------------
+// Name: JoyMonLatest()
+// Desc: Get the most recent position sample. Returns FALSE if there isn't one yet.
+//-----------------------------------------------------------------------------
+static __inline BOOL JoyMonLatest( JOYMON_READER * r, JOYREC * rec )
+{
+	LONG before, after;
+
+	do {
+		while ( (before = r->feed->latestseq) & 1 )
+			YieldProcessor();		// the writer's in the middle of it
+		MemoryBarrier();
+		*rec = *(const JOYREC *)&r->feed->latest;
+		MemoryBarrier();
+		after = r->feed->latestseq;
+	} while ( before != after );
+
+	return before != 0;
+}
+
+//-----------------------------------------------------------------------------
+// Name: JoyMonRead()
+// Desc: Copy up to max records, oldest first, that have arrived since the last
+//       call. Returns how many. If we fell a ring or more behind, the records
+//       missed are added to r->lost, along with the oldest still in the ring,
+//       which the writer may be overwriting.
+//-----------------------------------------------------------------------------
+static __inline int JoyMonRead( JOYMON_READER * r, JOYREC * rec, int max )
+{
+	int n = 0;
+
+	while ( n < max ) {
+		LONG head = r->feed->head;
+		if ( head == r->cursor )
+			break;
+		if ( (ULONG)(head - r->cursor) >= JOYMON_FEED_SIZE ) {
+			r->lost += (ULONG)(head - r->cursor) - JOYMON_FEED_SIZE + 1;
+			r->cursor = head - JOYMON_FEED_SIZE + 1;
+		}
+
+		MemoryBarrier();
+		rec[n] = *(const JOYREC *)&r->feed->ring[r->cursor & (JOYMON_FEED_SIZE -1)];
+		MemoryBarrier();
+
+		// If the writer has lapped us while copying, the copy can't be trusted.
+		if ( (ULONG)(r->feed->head - r->cursor) >= JOYMON_FEED_SIZE )
+			continue;
+
+		r->cursor++;
+		n++;
+	}
+
+	return n;
+}
+
+//-----------------------------------------------------------------------------
+// Name: JoyMonClose()
+// Desc: Detach from the feed.
+//-----------------------------------------------------------------------------
+static __inline void JoyMonClose( JOYMON_READER * r )
+{
+	UnmapViewOfFile( (LPCVOID)r->feed );
+	CloseHandle( r->hMap );
+	r->feed = NULL;
+	r->hMap = NULL;
+}
+
+#endif // JOYMON_H
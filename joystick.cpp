@@ -27,22 +27,30 @@
 //-----------------------------------------------------------------------------
 #define STRICT
 #define DIRECTINPUT_VERSION 0x0800
-#define _WIN32_WINNT 0x0500
+#define _WIN32_WINNT 0x0501	// for AttachConsole()
 
 #pragma warning( disable : 4995 ) // disable deprecated warning 
 #pragma warning( disable : 4996 ) // disable deprecated warning 
 
+#include <winsock2.h>	// before windows.h, which drags in the old winsock
 #include <windows.h>
 #include <windowsx.h>
 #include <commctrl.h>
+#include <commdlg.h>
 #include <basetsd.h>
 #include <dinput.h>
+#include <dbt.h>
+#include <ctype.h>
 #include <errno.h>
 #include <io.h>
 #include <stdio.h>
 #include <time.h>
 #include <math.h>
+#include <emmintrin.h>	// SSE2, for scanning text
+#include <nmmintrin.h>	// SSE4.2, for checksums
+#include <intrin.h>
 #include "resource.h"
+#include "joymon.h"
 
 
 //-----------------------------------------------------------------------------
@@ -50,11 +58,18 @@
 //-----------------------------------------------------------------------------
 INT_PTR CALLBACK MainDlgProc( HWND hDlg, UINT msg, WPARAM wParam, LPARAM lParam );
 INT_PTR CALLBACK ConfigDlgProc( HWND hDlg, UINT msg, WPARAM wParam, LPARAM lParam );
+INT_PTR CALLBACK AdvancedDlgProc( HWND hDlg, UINT msg, WPARAM wParam, LPARAM lParam );
+INT_PTR CALLBACK CalibrateDlgProc( HWND hDlg, UINT msg, WPARAM wParam, LPARAM lParam );
+INT_PTR CALLBACK StatsDlgProc( HWND hDlg, UINT msg, WPARAM wParam, LPARAM lParam );
 BOOL CALLBACK    EnumObjectsCallback( const DIDEVICEOBJECTINSTANCE* pdidoi, VOID* pContext );
 BOOL CALLBACK    EnumJoysticksCallback( const DIDEVICEINSTANCE* pdidInstance, VOID* pContext );
 HRESULT InitDirectInput( HWND hDlg );
+DWORD   WINAPI DeviceThreadProc( LPVOID lpParameter );
+bool    DeviceRecall( GUID& guid );
+bool    DeviceRemember( const GUID& guid );
 VOID    FreeDirectInput();
 HRESULT UpdateInputState( HWND hDlg );
+HRESULT DrawInputState( HWND hDlg, const DIJOYSTATE& js );
 VOID    OnPaint( HWND hDlg );
 HRESULT PollJoystick( DIJOYSTATE& js );
 BOOL	CALLBACK EnumChildProc(HWND hwndChild, LPARAM lParam);
@@ -64,6 +79,68 @@ bool	WriteToFile( void );
 void	StopWriting( void );
 bool	LoadConfig( void );
 bool	SaveConfig( void );
+DWORD	WINAPI WriterThreadProc( LPVOID lpParameter );
+bool	WriteOutput( const char * buf, size_t len );
+bool	PutOutput( const char * buf, size_t len );
+bool	SyncOutput( void );
+void	CloseOutput( void );
+bool	WriteBanner( void );
+bool	ReserveOutput( void );
+void	SegmentReset( const char * name );
+bool	SegmentDue( LONGLONG time );
+bool	SegmentNext( LONGLONG time );
+bool	SegmentListed( void );
+const char * FileTitle( const char * path );
+bool	PreallocateOutput( HANDLE hFile, ULONGLONG size );
+ULONGLONG ExpectedFileSize( void );
+bool	MappedOpen( HANDLE hFile, ULONGLONG size );
+bool	MappedWrite( const char * buf, size_t len );
+bool	MappedSync( void );
+bool	MappedAhead( void );
+void	MappedClose( void );
+unsigned long Crc32c( unsigned long crc, const void * buf, size_t len );
+bool	Crc32cHardware( void );
+LONGLONG SessionClock( void );
+void	ResetSessionClock( void );
+bool	FeedOpen( void );
+void	FeedClose( void );
+void	FeedPublish( const JOYREC& rec );
+void	FeedPost( const JOYREC& rec );
+void	FeedDrain( void );
+bool	PublisherStart( void );
+void	PublisherStop( void );
+void	Publish( const JOYREC& rec );
+DWORD	WINAPI PublisherThreadProc( LPVOID lpParameter );
+bool	MarkerStart( void );
+void	MarkerStop( void );
+DWORD	WINAPI MarkerThreadProc( LPVOID lpParameter );
+void	TakeMarkers( void );
+bool	WriteMarkers( LONGLONG upto );
+void	QueueEvent( LONGLONG time, WORD type, LONG x, LONG y );
+void	ReadClocks( LONGLONG& session, LONGLONG& wall, LONGLONG& uncertainty );
+void	AddAnchor( void );
+int		TimeMap( const char * inname, const char * outname, const char * refname );
+bool	RawHeader( const char * line, LONG lo[2], LONG hi[2], bool& origin );
+LONG	RawToRange( LONG v, LONG lo, LONG hi, LONG range );
+void	RawProject( LONG& x, LONG& y, const LONG lo[2], const LONG hi[2], bool origin, LONG range );
+int		Octant( LONG x, LONG y );
+int		RescaleFile( const char * inname, const char * outname, LONG range );
+int		ConvertTree( const char * src, const char * dst, const char * match );
+int		VerifyTree( const char * src, const char * match );
+int		Aggregate( const char * src, const char * outname, const char * by );
+bool	ReplayOpen( HWND hDlg, const char * name );
+void	ReplayClose( HWND hDlg );
+void	ReplaySeek( LONGLONG t );
+void	ReplayTick( HWND hDlg );
+bool	VirtualStart( const char * script, int device );
+int		StressTest( const char * script, double rate, int secs, const char * pattern );
+int		TimerBench( int secs, UINT period );
+void	AttachToConsole( void );
+int		RunCommandLine( int argc, char ** argv );
+int		RecoverFile( const char * inname, const char * outname );
+int		SubscribeTest( int port, int secs );
+int		SendMarker( int port, const char * text );
+int		SegmentsFind( const char * manifest, double from, double to );
 
 //-----------------------------------------------------------------------------
 // Defines, constants, and global variables
@@ -73,13 +150,655 @@ bool	SaveConfig( void );
 
 LPDIRECTINPUT8       g_pDI              = NULL;         
 LPDIRECTINPUTDEVICE8 g_pJoystick        = NULL;     
+GUID g_DeviceGuid;					// which joystick it is
+char g_DeviceName[MAX_PATH];
+bool g_bHaveDevice = false;
+
+// Finding the joystick can take seconds with some USB hubs, so it's done on a
+// thread of its own while the window comes up, trying the one used last time
+// before looking through them all. The thread hands over what it's made, and
+// the window sets it up; until then there's no joystick.
+#define WM_DEVICE_FOUND (WM_APP + 2)
+static struct {
+	HANDLE		hThread;
+	HRESULT		hr;				// how it went
+	LPDIRECTINPUT8	pDI;		// made on the thread, until the window takes them
+	LPDIRECTINPUTDEVICE8 pDevice;
+	GUID		guid;
+	char		name[MAX_PATH];
+	bool		cached;			// it was the last one used
+	LONGLONG	begun;			// performance counter when the program started
+	double		shown, found;	// millisecs till the window showed, and the joystick was ready
+} g_Device;
+
+// Raw capture leaves the axes in the device's own units, at its full
+// resolution, with their range in the banner. They're scaled when the file's
+// read, so the sampler writes them just as they come.
+static const char RawBanner[] = "# Raw device units: ";
+bool g_bRawAxes = false;			// the device is set up that way
+LONG g_RawMin[2], g_RawMax[2];		// and its x and y go from/to these
+
+// A joystick can be calibrated: its centre, how far it wanders at rest, and
+// how far it goes each way on each axis. That's kept in the registry under its
+// GUID, and applied by looking every reading up in a table built from it, so
+// the cost while sampling is one load per axis.
+#define CAL_TIMER 44
+#define CAL_PERIOD 20			// millisecs between readings
+#define CAL_CENTRE_TIME 2000	// millisecs to find the centre
+#define CAL_MAX_RANGE (1 << 20)	// largest axis maximum there'll be a table for
+#define CAL_VALUES 9
+typedef struct {				// all LONGs, in the order of CalibrationValues[]
+	LONG	range;				// axis maximum when it was taken
+	LONG	centre[2], rest[2];
+	LONG	lowest[2], highest[2];
+} CALIBRATION;
+static const char * const CalibrationValues[CAL_VALUES] = {
+	"Range", "CentreX", "CentreY", "RestX", "RestY", "LowestX", "LowestY", "HighestX", "HighestY" };
+
+bool	CalibrationLoad( void );
+void	CalibrationTable( const CALIBRATION& cal, int axis, LONG * lut );
+bool	CalibrationSave( const CALIBRATION& cal );
+void	CalibrationForget( void );
+
+static struct {
+	CALIBRATION	cal;
+	LONG *		lut[2];			// x and y, indexed by reading + range; NULL if not calibrated
+} g_Calibration;
+static bool g_bCalibrating = false;		// leave the readings alone while it's being done
 
-bool g_bWriting = false, g_bWriteError = false;
+bool g_bWriting = false;
 HINSTANCE g_hInst;
 FILE * fp = NULL;
 DWORD g_timerstart;
+LONGLONG g_qpcstart, g_qpcfreq;		// the session clock runs on the performance counter
 char g_MsgText[512];
 
+// Single producer (the timer callback), single consumer (the writer thread) ring
+// of records. The sampler never blocks on this; if it fills, the disk can't keep up.
+#define QUEUE_SIZE 16384	// must be a power of two
+typedef struct {
+	JOYREC			rec[QUEUE_SIZE];
+	volatile LONG	head, tail;
+} RECQUEUE;
+
+bool	QueuePut( RECQUEUE& q, const JOYREC& rec );
+bool	QueueGet( RECQUEUE& q, JOYREC& rec );
+bool	WriteRecord( const JOYREC& rec );
+void	DecimatorReset( void );
+bool	Decimate( const JOYREC& in, JOYREC out[2], JOYREC env[2] );
+
+static RECQUEUE g_WriteQueue;
+static HANDLE g_hWriterThread = NULL, g_hWriterWake = NULL;
+static volatile bool g_bWriterStop = false;
+
+// The recorder's health, for the status line and for a .stats file kept beside
+// the output, so a station that's struggling is noticed before data is lost.
+// Each counter is changed by one thread only (noted), or else interlocked, and
+// is only ever read whole, so nothing needs a lock. Latency is how long lines
+// waited between being sampled and written, counted in buckets by the power
+// of two of its microsecs, which is enough to find the percentiles.
+#define HEALTH_PERIOD 10000		// millisecs between rewriting the .stats file
+#define LATENCY_BUCKETS 32
+static const char HealthExtension[] = ".stats";
+static struct {
+	volatile LONG	taken;			// samples the timer asked for (sampler)
+	volatile LONG	missed;			// timer ticks that never came (sampler)
+	volatile LONG	unread;			// samples lost as the joystick couldn't be read (sampler)
+	volatile LONG	lines;			// made from the samples, and queued (sampler)
+	volatile LONG	dropped;		// records lost as the queue was full (sampler)
+	volatile LONG	highwater;		// most records there's been in the queue (sampler)
+	volatile LONG	reacquires;		// times the joystick was acquired again (interlocked)
+	volatile LONG	disconnects;	// times it was lost, unplugged most likely (interlocked)
+	volatile LONG	feeddropped;	// events for the feed lost as its queue was full (interlocked)
+	volatile LONG	markersdropped;	// markers lost as their queue or the pending list was full (interlocked)
+	volatile LONG	streamdropped;	// records for the stream lost as its queue was full (interlocked)
+	volatile LONG	written;		// lines written to the file (writer)
+	volatile LONG	writeerrors;	// writes and flushes that failed (writer)
+	LONG		latency[LATENCY_BUCKETS];	// lines written under 2^i microsecs after they were sampled (writer)
+	LONG		late[LATENCY_BUCKETS];		// ticks that came under 2^i microsecs late (sampler)
+	double		busy;				// secs spent taking samples (sampler)
+	ULONGLONG	bytes;				// written to the file (writer)
+	DWORD		saved;				// GetTickCount() when the .stats file was last written (writer)
+	char		name[MAX_PATH];		// of the .stats file
+} g_Health;
+
+// The sampler's schedule: tick k is due k timer periods after the first. A
+// tick that comes after the next was due is taken as missed, and samples that
+// should have been taken but weren't, for whatever reason, are written as a
+// gap record, so the file says where its holes are.
+static struct {
+	LONGLONG	start;				// session clock at the first tick
+	LONGLONG	called;				// the tick after the last the timer called for
+	LONGLONG	read;				// the tick after the last the joystick was read for
+	bool		gone;				// a disconnect record's been written, and no reconnect
+	LONGLONG	gonetime;			// session clock when it was
+} g_Ticks;
+
+void	HealthCount( LONG * hist, LONGLONG micros );
+LONGLONG HealthPercentile( const LONG * hist, double p );
+void	HealthSummary( char * buf, size_t len );
+bool	HealthSave( void );
+
+// A JSON sidecar beside the output describes the session, so catalogues and
+// analysis tools can pick sessions out without opening their files: the
+// settings, device and timer it was recorded with, and at the end, how it
+// went. It's written when sampling starts and again when recording stops, so
+// one whose "finished" is still null is from a session that didn't finish.
+static const char InfoExtension[] = ".json";
+static struct {
+	char		name[MAX_PATH];		// of the sidecar
+	time_t		started;			// wall clock when recording started
+} g_SessionInfo;
+
+bool	SessionInfoSave( bool finished );
+
+// How the samples are timed. The timer queue calls back on a pool thread, but
+// can be late by a whole scheduler quantum. Instead a thread of our own can
+// sleep until shortly before each tick and then spin on the performance
+// counter, trading some of a core for accuracy. The margin left for spinning
+// follows how far Sleep() overshoots: it jumps to cover any bigger overshoot,
+// and creeps back down otherwise. Or our thread can just sleep, which costs
+// nothing but is only as good as its priority makes it.
+#define TIMING_QUEUE 0
+#define TIMING_SPIN 1
+#define TIMING_SLEEP 2
+#define SPIN_MIN_MARGIN 200		// microsecs
+#define SPIN_MAX_MARGIN 20000
+#define SPIN_START_MARGIN 2000
+static const char * const TimingStrategies[] = { "Timer queue", "Sleep, then spin", "Own thread, sleep" };
+typedef struct {
+	LONGLONG	margin;			// microsecs before the deadline to stop sleeping
+	double		spun;			// secs spent spinning
+	bool		sleeponly;		// don't spin at all
+} SPINWAIT;
+
+// Our own sampling thread can be given a higher priority than everything else
+// of the same priority class, pinned to a processor that's kept free for it,
+// and have what it works on locked into memory. None of it needs privileges
+// that a user doesn't normally have, but any of it can be refused, in which
+// case sampling goes on without it and the .stats file says so.
+static const char * const SamplerPriorities[] = { "Normal", "Above normal", "Highest", "Time critical" };
+static const int SamplerPriorityLevels[] = { THREAD_PRIORITY_NORMAL, THREAD_PRIORITY_ABOVE_NORMAL,
+											 THREAD_PRIORITY_HIGHEST, THREAD_PRIORITY_TIME_CRITICAL };
+static struct {
+	UINT		resolution;		// asked of timeBeginPeriod()
+	HANDLE		hTimer;			// the timer queue's
+	HANDLE		hThread;		// or our own thread
+	volatile bool	stop;
+	SPINWAIT	wait;
+	bool		locked;			// SamplerLockMemory() has its memory
+	char		tuning[160];	// what the thread and memory got
+} g_Sampler;
+
+bool	SamplerStart( void );
+void	SamplerStop( void );
+DWORD	WINAPI SamplerThreadProc( LPVOID lpParameter );
+void	SpinWaitInit( SPINWAIT& w );
+void	SpinWaitUntil( SPINWAIT& w, LONGLONG deadline );
+void	SamplerTune( HANDLE hThread, char * buf, size_t len );
+bool	SamplerLockMemory( bool lock );
+
+// The live feed for other programs; see joymon.h. It only ever has one writer,
+// so nothing locks it: the sampler while recording, otherwise the GUI. What the
+// GUI has for it while recording is queued for the sampler to put in, so the
+// sampler never waits on the GUI, however high its priority or wherever it's
+// pinned. Readers never lock either.
+// A feed left by a copy of us that's gone, and kept by a reader that's still
+// attached, is taken over; one that another copy of us is writing isn't. The
+// mutex is only ever used to tell which: whoever has it open owns the feed.
+static const char FeedOwnerName[] = "Local\\JoyMonFeedWriter";
+static HANDLE g_hFeedMap = NULL, g_hFeedOwner = NULL;
+static JOYMON_FEED * g_pFeed = NULL;
+static RECQUEUE g_FeedQueue;		// from the GUI to the sampler
+static DWORD g_dwGuiThread = 0;
+
+// Samples are also streamed to subscribers on a loopback TCP port. Whoever is
+// sampling queues records for the publisher thread, which frames them and keeps
+// a bounded buffer per subscriber, so a slow subscriber only loses frames and
+// never holds up the sampler or anyone else.
+#define MAX_SUBSCRIBERS 8
+#define SUBSCRIBER_BUFFER (64*1024)
+#define FRAME_RECORDS 256	// most records sent in one frame
+#define PUBLISH_PERIOD 10	// millisecs between looking for new records
+typedef struct {
+	SOCKET	s;
+	DWORD	dropped;		// frames that didn't fit in the buffer
+	int		start, end;		// the unsent part of buf
+	char	buf[SUBSCRIBER_BUFFER];
+} SUBSCRIBER;
+
+static RECQUEUE g_PublishQueue;
+static volatile LONG g_PublishLost = 0;		// records the queue had no room for, since the stream started (interlocked)
+static SUBSCRIBER g_Subscribers[MAX_SUBSCRIBERS];
+static SOCKET g_ListenSocket = INVALID_SOCKET;
+static HANDLE g_hPublisherThread = NULL;
+static volatile bool g_bPublishing = false, g_bPublisherStop = false;
+static long g_PublisherPort = 0;
+
+// Other programs can mark events in the log by sending datagrams to a loopback
+// UDP port. The listener thread stamps them with the session clock and queues
+// them (single producer, single consumer, like the sample queue) for the writer
+// thread, which merges them in among the samples by time. The sampler never
+// sees them. As a marker takes a moment to get from the socket to the queue,
+// the writer holds back samples newer than MARKER_LATENCY in case one is coming.
+#define MARKER_QUEUE_SIZE 256	// must be a power of two
+#define MARKER_TEXT 240			// longest marker text kept
+#define MARKER_LATENCY 50		// millisecs
+typedef struct {
+	LONGLONG	time;
+	const char * type;		// what sort of #! record it's written as
+	char		text[MARKER_TEXT];
+} MARKER;
+
+void	AddPending( const MARKER& m );
+
+static struct {
+	MARKER			marker[MARKER_QUEUE_SIZE];
+	volatile LONG	head, tail;
+} g_MarkerQueue;
+static MARKER g_PendingMarkers[MARKER_QUEUE_SIZE];	// taken off the queue but not yet written, in time order
+static int g_nPendingMarkers = 0;
+static LONGLONG g_MarkersAfter = 0;		// time of the last sample written; no marker goes in before it (writer)
+static SOCKET g_MarkerSocket = INVALID_SOCKET;
+static HANDLE g_hMarkerThread = NULL;
+static volatile bool g_bMarkerStop = false;
+static long g_MarkerPort = 0;
+static const char EventRecord[] = "#!";
+
+// Every so often the writer pairs the session clock with the wall clock in an
+// anchor record, so the samples can be put on absolute time afterwards (see
+// /timemap). The drift between the clocks is estimated as it goes, by a least
+// squares fit of their difference against the session clock.
+#define ANCHOR_PERIOD 10000		// millisecs
+static struct {
+	DWORD		Last;			// GetTickCount() at the last anchor
+	LONGLONG	FirstOffset;	// wall clock less session clock at the first anchor, microsecs
+	double		n, Sx, Sy, Sxx, Sxy;	// x is session secs, y the change in offset in microsecs
+} g_Anchor;
+static VOID (WINAPI * g_pGetSystemTimePrecise)( FILETIME * ) = NULL;
+
+// Running statistics of the session's lines, for the panel. The sampler keeps
+// them up to date as each line is made, in constant time, and the panel copies
+// them out whenever it's refreshed. Only the sampler changes them, and seq is
+// odd while it is, so a copy can be checked and neither side ever waits.
+#define STATS_TIMER 45
+#define STATS_PERIOD 250		// millisecs between refreshing the panel
+#define IDM_STATS 0x0010		// on the system menu, as that's there while recording
+typedef struct {
+	ULONGLONG	lines;
+	LONGLONG	first, last;		// times of the first and latest
+	double		mean[2], m2[2];		// m2 is the sum of squared differences from the mean
+	LONG		min[2], max[2];
+	LONG		x, y;				// the latest, in axis units even for a raw capture
+	double		distance;			// the stick has travelled, in axis units
+	ULONGLONG	presses, centre, octant[8];
+} RUNNINGSTATS;
+static struct {
+	volatile LONG	seq;
+	RUNNINGSTATS	s;
+} g_Running;
+static HWND g_hStatsDlg = NULL;
+
+void	StatsReset( void );
+void	StatsAdd( const JOYREC& line );
+void	StatsCopy( RUNNINGSTATS& s );
+
+// When it's not recording the monitor has nothing to do until the stick moves,
+// so rather than poll it on a timer it waits for DirectInput to say it's changed.
+// A thread waits on the device's event and posts the window a message, no more
+// than one at a time; the window is only redrawn when what it shows changes,
+// or when it's been painted over. While recording, or with a scripted device,
+// or if the device can't notify, the GUI timer keeps things up to date.
+#define GUI_TIMER 42
+#define GUI_PERIOD 100			// millisecs, while recording
+#define GUI_VIRTUAL_PERIOD 20	// with a scripted device, which sends nothing
+#define REDRAW_TIMER 46
+#define REDRAW_DELAY 50			// millisecs after painting, for the controls to finish
+#define IDLE_MIN_PERIOD 10		// millisecs between updates, however fast the stick changes
+#define WM_JOYSTICK_CHANGED (WM_APP + 1)
+static struct {
+	HANDLE		hEvent;			// DirectInput sets it when the device changes
+	HANDLE		hStop;
+	HANDLE		hThread;
+	HWND		hDlg;
+	volatile LONG	posted;		// a WM_JOYSTICK_CHANGED is waiting to be handled
+	bool		redraw;			// draw next time, changed or not
+	LONG		x, y;			// what was drawn last
+	bool		showaxes, lost;
+} g_Idle;
+
+bool	IdleStart( HWND hDlg );
+void	IdleStop( void );
+void	IdleMode( HWND hDlg );
+DWORD	WINAPI IdleThreadProc( LPVOID lpParameter );
+
+// When the joystick's unplugged, reading it fails until it's back. Rather than
+// everything that reads it retrying, the first to find it gone hands it to the
+// recovery thread, which tries to acquire it again after waits that double up
+// to a limit, or straight away when Windows says a device has come or gone.
+// Until then reads fail without touching it, and the sampler counts them as
+// unread, so the session carries on and its file says when it went and came
+// back.
+#define RECOVERY_FIRST_WAIT 50		// millisecs
+#define RECOVERY_MAX_WAIT 2000
+static struct {
+	HANDLE		hThread;
+	HANDLE		hWake;			// set when it's lost, or a device arrives
+	HANDLE		hStop;
+	HWND		hDlg;
+	HDEVNOTIFY	hNotify;		// for HID devices coming and going
+	volatile LONG	lost;		// reads are to fail until the recovery thread has it back
+} g_Recovery;
+
+bool	RecoveryStart( HWND hDlg );
+void	RecoveryStop( void );
+bool	RecoveryLost( void );
+DWORD	WINAPI RecoveryThreadProc( LPVOID lpParameter );
+
+// Replaying a recording. The file is mapped, and indexed by time when opened,
+// so the scrub bar can jump anywhere without reading through the file.
+#define REPLAY_TIMER 43
+#define REPLAY_PERIOD 20		// millisecs between frames
+#define REPLAY_STRIDE 256		// samples between index entries
+static const double ReplaySpeeds[] = { 0.0, 0.25, 0.5, 1.0, 2.0, 5.0, 10.0, 20.0, 50.0 };	// 0 is paused
+typedef struct {
+	LONGLONG	time;			// of the sample
+	size_t		offset;			// where its line starts
+} REPLAYINDEX;
+static struct {
+	HANDLE		hFile, hMap;
+	const char *	data;		// the mapped file
+	size_t		size;
+	REPLAYINDEX *	index;
+	int			entries;
+	LONGLONG	first, last;	// times of the first and last samples
+	LONGLONG	now;			// where the replay is up to
+	LONGLONG	ticked;			// session clock at the last frame
+	JOYREC		rec;			// the sample being shown
+	bool		raw, origin;	// it's a raw capture, to be scaled as it's read
+	LONG		rawlo[2], rawhi[2];
+	double		speed;
+	bool		dragging;		// the scrub bar is being dragged
+	char		name[MAX_PATH];
+} g_Replay;
+
+// Batch jobs over many files run on a pool of threads, each with its own
+// queue of items, that take work from each other when theirs runs out.
+#define MAX_POOL 64
+typedef void (*POOLWORK)( int item, int worker, void * context );
+typedef struct {
+	CRITICAL_SECTION	lock;
+	int			head, tail;		// items head..tail-1 are still to be done
+} POOLQUEUE;
+static struct {
+	POOLQUEUE	queue[MAX_POOL];
+	int			workers;
+	POOLWORK	work;
+	void *		context;
+} g_Pool;
+typedef struct {
+	char **		name;			// relative to the folder searched
+	int			n, allocated;
+	ULONGLONG	bytes;			// size of them all
+} FILELIST;
+
+// Converting recordings to the columnar format in joymon.h. Each worker keeps
+// its buffers for a block from one file to the next.
+#define CONVERT_BLOCK_ROWS 4096
+#define CONVERT_MAX_COLUMNS 9		// after the time
+#define CONVERT_REPORTS 10			// bad lines reported for each file
+typedef struct CONVERTJOB CONVERTJOB;
+typedef struct {
+	CONVERTJOB *	job;
+	const char *	name;			// as reported
+	FILE *		out;
+	bool		started;			// the header's been written
+	int			columns;			// set by the first sample
+	DWORD		rows, textrows;		// in the blocks being gathered
+	char *		text;
+	size_t		textlen, textsize;
+	ULONGLONG	samples, malformed, bytes;
+	LONGLONG	time[CONVERT_BLOCK_ROWS];
+	LONG		column[CONVERT_MAX_COLUMNS][CONVERT_BLOCK_ROWS];
+} CONVERTFILE;
+struct CONVERTJOB {
+	const char *	src, * dst;		// the folders files are relative to
+	FILELIST *	files;
+	CRITICAL_SECTION	print;		// so reports don't come out mixed up
+	CONVERTFILE *	file[MAX_POOL];
+	struct {
+		ULONGLONG	bytes, samples, malformed;
+		unsigned long	files, failed;
+	} stats[MAX_POOL];				// each worker's, added up at the end
+};
+
+// Checking files' blocks against their checksums: recordings' against their
+// trailers, columnar files' against their block headers. A file to a worker.
+typedef struct {
+	unsigned long	good, bad;		// blocks
+	unsigned long	unfinished;		// lines after the last trailer, or bytes after the last block
+	bool			lost;			// a columnar file's blocks couldn't be followed to the end
+} VERIFYFILE;
+struct VERIFYJOB {
+	const char *	top;			// the folder files are relative to
+	FILELIST *	files;
+	CRITICAL_SECTION	print;		// so reports don't come out mixed up
+	struct {
+		ULONGLONG	bytes, good, bad;
+		unsigned long	files, damaged, unchecked, failed;
+	} stats[MAX_POOL];				// each worker's, added up at the end
+};
+
+int		PoolRun( int items, POOLWORK work, void * context );
+DWORD	WINAPI PoolThreadProc( LPVOID lpParameter );
+bool	FindFiles( const char * top, const char * sub, const char * match, FILELIST& list );
+void	FreeFiles( FILELIST& list );
+
+// Files are read by mapping them whole.
+typedef struct {
+	HANDLE		hFile, hMap;
+	const char *	data;
+	size_t		size;
+} MAPPEDFILE;
+
+// Results for a group of recordings, or one of them, made so that any number
+// can be added together without keeping the samples.
+#define AGG_BINS 20					// histogram bins across each axis
+static const char * const OctantNames[8] = { "E", "NE", "N", "NW", "W", "SW", "S", "SE" };
+typedef struct {
+	unsigned long	files, failed;
+	ULONGLONG	samples, malformed;
+	double		mean[2], m2[2];		// m2 is the sum of squared differences from the mean
+	LONG		min[2], max[2];
+	LONG		range;				// axis maximum, or -1 if the files differ
+	ULONGLONG	centre, octant[8];	// samples at the centre, and in each octant
+	ULONGLONG	hist[2][AGG_BINS];
+	ULONGLONG	presses;			// of the monitored button
+	double		secs;				// covered by the samples
+} AGGREGATE;
+typedef struct {
+	char *		key;
+	int			file;
+} GROUPKEY;
+typedef struct {
+	const char *	top;			// the folder files are relative to
+	FILELIST *	files;
+	int *		group;				// each file's
+	AGGREGATE *	total;				// each group's
+	int			groups;
+	CRITICAL_SECTION	merge;
+} AGGREGATEJOB;
+
+bool	MapWhole( const char * name, MAPPEDFILE& m );
+void	UnmapWhole( MAPPEDFILE& m );
+
+// Scripted virtual devices, for testing without a joystick and for driving the
+// sampler and writer harder than any real one could. A device is worked out
+// from the time alone (or in fixed steps up to it), so a script always gives
+// the same samples. The GUI and the sampler each have their own view of it.
+#define MAX_VIRTUAL 16
+#define MAX_VIRTUAL_BUTTONS 8
+#define VIRTUAL_SINE 0
+#define VIRTUAL_WALK 1
+#define VIRTUAL_FILE 2
+typedef struct {
+	int			number;				// 1 up
+	LONGLONG	period, held, delay;	// microsecs
+} VIRTUALBUTTON;
+typedef struct {
+	LONGLONG	time;
+	LONG		x, y;
+} VIRTUALSAMPLE;
+typedef struct {
+	int			kind;
+	double		amp[2], freq[2], phase;		// sine: per axis, and Y's phase in degrees
+	unsigned long seed;						// walk
+	long		step;
+	VIRTUALSAMPLE * sample;					// file: the recording, from time zero
+	int			samples;
+	VIRTUALBUTTON button[MAX_VIRTUAL_BUTTONS];
+	int			buttons;
+} VIRTUALDEVICE;
+typedef struct {
+	LONGLONG	time;			// of the last poll
+	LONGLONG	steps;			// walk: milliseconds stepped through
+	LONG		x, y;			// walk: where it's got to
+	unsigned long rng;
+	int			cursor;			// file: the sample being played
+} VIRTUALSTATE;
+
+int		VirtualLoad( const char * name, VIRTUALDEVICE * devs, int max, char * err, size_t errlen );
+void	VirtualUnload( VIRTUALDEVICE * devs, int n );
+void	VirtualReset( const VIRTUALDEVICE& dev, VIRTUALSTATE& st );
+DWORD	VirtualPoll( const VIRTUALDEVICE& dev, VIRTUALSTATE& st, LONGLONG t, DIJOYSTATE& js );
+
+static VIRTUALDEVICE g_VirtualDevices[MAX_VIRTUAL];
+static VIRTUALDEVICE * g_pVirtual = NULL;		// used in place of the joystick, if set
+static VIRTUALSTATE g_VirtualGui, g_VirtualSampler;
+static unsigned long g_VirtualTicks = 0;		// samples taken this session
+
+// The stress test runs every device through the one writer, so each sample
+// carries the index of the device it's from in the top of its flags, and the
+// lines get a column saying which.
+#define JOYREC_DEVICESHIFT 24
+static bool g_bDeviceColumn = false;
+
+// How often the writer thread looks for work, in millisecs.
+#define WRITER_PERIOD 50
+
+// State of the block currently being written. Every so often the block is closed
+// with a trailer line holding a line count and checksum, and the file is flushed
+// to disk, so a crash loses at most one block and the damage can be found.
+static struct {
+	unsigned long Number, Lines, Crc;
+	DWORD Started;
+} g_Block;
+static const char BlockTrailer[] = "#~ block";
+
+// A long session can be split into segment files, a new one started every so
+// many minutes of samples or so many bytes. The writer switches between one
+// sample and the next, so nothing is lost or written twice, and each segment
+// has its own banner and blocks, so it can be read alone. As each is finished
+// it's added to a manifest beside the first, with the times of its first and
+// last samples, so a reader can open only the ones it needs:
+//
+//		#! segment,<first s>,<last s>,<lines>,<bytes>
+//		<file>,<session>
+//
+// which is also a manifest /aggregate can take, with the session as the group.
+static const char SegmentExtension[] = ".segments";
+static struct {
+	bool		on;					// this session is being split
+	int			n;					// the segment being written, from 0
+	char		base[MAX_PATH];		// the first segment's file; the rest add .001 and so on
+	char		name[MAX_PATH];		// the segment being written
+	LONGLONG	length;				// microsecs a segment covers, or zero
+	ULONGLONG	limit;				// bytes a segment can grow to, or zero
+	LONGLONG	due;				// session clock from which samples go in the next one
+	LONGLONG	first, last;		// its first and last samples' times, first < 0 if none yet
+	LONG		lines;				// samples written to it
+	ULONGLONG	bytes;				// g_Health.bytes when it was started
+} g_Segment;
+
+// With oversampling on, the sampler polls the joystick many times a tick and
+// reduces each tick's worth to one line with a decimation filter, rather than
+// taking whatever the stick happened to be doing at the tick. Each line is
+// stamped with the time at the middle of what the filter looked at. The last
+// few seconds of raw samples are kept, for the FIR filter and the envelope.
+#define DECIMATE_MEAN 0		// boxcar average of the tick's samples
+#define DECIMATE_CIC 1		// cascaded integrator-comb, CIC_STAGES deep
+#define DECIMATE_FIR 2		// windowed sinc, FIR_SPAN ticks long
+#define MAX_DECIMATION 1000	// most samples to a line
+#define CIC_STAGES 3
+#define FIR_SPAN 4
+#define DECIMATOR_RING 8192	// must be a power of two, and hold (FIR_SPAN + 1) * MAX_DECIMATION
+C_ASSERT( (DECIMATOR_RING & (DECIMATOR_RING - 1)) == 0 && DECIMATOR_RING >= (FIR_SPAN + 1) * MAX_DECIMATION );
+static const char * const DecimationFilters[] = { "Mean", "CIC", "Windowed sinc FIR" };
+static struct {
+	int			factor;			// samples to a line; 1 for no oversampling
+	UINT		period;			// millisecs between samples
+	double		rate;			// samples a second
+	int			filter;
+	int			half;			// delay through the filter, in half samples
+	bool		conditioning;	// the raw samples are in channels 2 and 3, and conditioned into 0 and 1
+	char		condition_error[128];	// why not, if it was asked for
+	int			channels;
+	ULONG		n;				// samples so far
+	LONGLONG	start;			// time of the first
+	LONG		v[4][DECIMATOR_RING];	// x and y, as written, then raw x and y
+	LONGLONG	time[DECIMATOR_RING];
+	ULONGLONG	integ[4][CIC_STAGES], comb[4][CIC_STAGES];	// CIC, wrapping as it's meant to
+	double		tap[FIR_SPAN * MAX_DECIMATION + 1];		// FIR
+	int			taps;
+} g_Decimator;
+
+// Each axis can be conditioned before it's filtered: a chain of stages, given
+// as text and compiled into fixed point coefficients and tables when recording
+// starts. A tick's samples go through together, a stage at a time. The raw
+// values are filtered and written too, so what was done can be checked.
+#define COND_DEADZONE 0
+#define COND_EMA 1
+#define COND_BIQUAD 2
+#define COND_CURVE 3
+#define COND_JITTER 4
+#define MAX_STAGES 8			// an axis
+#define MAX_CURVES 4
+#define CURVE_POINTS 1024
+#define BIQUAD_SHIFT 28			// fraction bits in the coefficients
+typedef struct {
+	int			kind;
+	LONG		n;				// dead zone or jitter width; which curve table
+	LONGLONG	k[5];			// coefficients, worked out at compile time
+	LONGLONG	s[4];			// state
+} CONDSTAGE;
+typedef struct {
+	CONDSTAGE	stage[MAX_STAGES];
+	int			stages;
+} CONDCHAIN;
+
+bool	ConditionCompile( const char * spec, double rate, LONG range, CONDCHAIN chain[2], char * err, size_t errlen );
+LONG	ConditionPrime( CONDCHAIN& chain, LONG v );
+void	Condition( CONDCHAIN& chain, LONG * v, int n, int first, int last );
+
+static CONDCHAIN g_Chain[2];		// x and y
+static LONG g_CurveTable[MAX_CURVES][CURVE_POINTS +1];
+
+// Used to guess how big a session's file will be, so it can be allocated up front.
+#define BYTES_PER_LINE 24
+#define ENVELOPE_BYTES 24
+#define TRAILER_BYTES 48
+
+// Optionally the file is written through a memory mapping instead of stdio. It's
+// mapped a chunk at a time, with the next chunk mapped before the cursor gets there.
+#define MAP_CHUNK (4*1024*1024)	// must be a multiple of the allocation granularity
+static struct {
+	HANDLE		hFile, hMap;
+	char *		view[2];		// the chunk being written, and the one after it
+	ULONGLONG	viewbase;		// file offset of view[0]
+	ULONGLONG	mapsize;		// size of the current file mapping
+	ULONGLONG	pos;			// the write cursor
+} g_Mapped;
+
 // The two buttons we monitor
 static bool g_JoystickButton = false, g_Button2 = false;
 
@@ -89,6 +808,23 @@ static const char Title[] = "Joystick Monitor";
 static struct {
 	bool ShowAxes, ShowFilename, OutputFileBanner, OriginLowerLeft, DrawOctants, RememberWindow, SoundFeedback, SuppressX, SuppressY;
 	long EllipseSize, XYMinMax, JoystickButton, Button2, WPosnX, WPosnY, WSizeX, WSizeY, GridCount, TickCount;
+	long FlushInterval;		// millisecs between forcing data to disk; zero for only at the end
+	long MaxSessionMins;	// expected longest session, to preallocate files; zero for none
+	long SegmentMins;		// start a new segment file after this many minutes; zero for never
+	long SegmentMB;			// or once a segment has this many megabytes; zero for no limit
+	bool MappedOutput;		// write via a memory mapping rather than stdio
+	bool SharedFeed;		// publish samples to other programs through shared memory
+	long StreamPort;		// loopback TCP port to stream samples on; zero for off
+	long MarkerPort;		// loopback UDP port to take event markers on; zero for off
+	long OversampleRate;	// samples a second taken internally and reduced to one per tick; zero for off
+	long DecimationFilter;	// how they're reduced: DECIMATE_MEAN, ...
+	long TimingStrategy;	// how the samples are timed: TIMING_QUEUE, ...
+	long SamplerPriority;	// our sampling thread's, an index into SamplerPriorities[]
+	long SamplerCore;		// processor to keep it on, or -1 for any
+	bool LockMemory;		// lock the sampler's memory in
+	bool EnvelopeColumns;	// add the min and max of each tick's samples to the line
+	bool RawAxes;			// record the axes in the device's units, for scaling later
+	char Conditioning[256];	// chain of stages each axis goes through; see ConditionCompile()
 	double TicksPerSec;
 	char FilePattern[MAX_PATH];	// Where to put output data. Will add 3 digit extension.
 	char BannerComment[1024], LabelPosX[128], LabelPosY[128], LabelNegX[128], LabelNegY[128],
@@ -102,8 +838,29 @@ static struct {
 //-----------------------------------------------------------------------------
 int APIENTRY WinMain( HINSTANCE hInst, HINSTANCE, LPSTR, int nCmdShow)
 {
+	LARGE_INTEGER freq, now;
+	QueryPerformanceFrequency( &freq );
+	QueryPerformanceCounter( &now );
+	g_qpcfreq = freq.QuadPart;
+	g_Device.begun = now.QuadPart;
+	g_dwGuiThread = GetCurrentThreadId();
+	ResetSessionClock();
+
+	// Any arguments mean we're being run as a command line utility, except
+	// for running the monitor on a scripted device instead of the joystick.
+	if ( __argc >= 3 && _stricmp( __argv[1], "/virtual" ) == 0 ) {
+		if ( !VirtualStart( __argv[2], __argc >= 4 ? atoi( __argv[3] ) : 0 ) )
+			return 1;
+	} else if ( __argc > 1 ) {
+		return RunCommandLine( __argc, __argv );
+	}
+
     InitCommonControls();
 
+	// Windows 8 and later have a system time good to the microsecond.
+	*(FARPROC *)&g_pGetSystemTimePrecise =
+		GetProcAddress( GetModuleHandle( "kernel32.dll" ), "GetSystemTimePreciseAsFileTime" );
+
     // Display the main dialog box.
 	g_hInst = hInst; // needed to create config dialog.
 	
@@ -152,6 +909,23 @@ bool LoadConfig( void )
 	g_Config.EllipseSize = 2;
 	g_Config.GridCount = 0;
 	g_Config.TickCount = 0;
+	g_Config.FlushInterval = 1000;
+	g_Config.MaxSessionMins = 60;
+	g_Config.SegmentMins = 0;
+	g_Config.SegmentMB = 0;
+	g_Config.MappedOutput = false;
+	g_Config.SharedFeed = false;
+	g_Config.StreamPort = 0;
+	g_Config.MarkerPort = 0;
+	g_Config.OversampleRate = 0;
+	g_Config.DecimationFilter = DECIMATE_MEAN;
+	g_Config.TimingStrategy = TIMING_QUEUE;
+	g_Config.SamplerPriority = 0;
+	g_Config.SamplerCore = -1;
+	g_Config.LockMemory = false;
+	g_Config.EnvelopeColumns = false;
+	g_Config.RawAxes = false;
+	g_Config.Conditioning[0] = 0;
 	g_Config.XYMinMax = 1000;
 	g_Config.TicksPerSec = 2.0;
 	g_Config.JoystickButton = 7;
@@ -309,6 +1083,182 @@ bool LoadConfig( void )
 			g_Config.TickCount = *((unsigned long*)regvalue);
 	}
 
+	reglen = sizeof regvalue;
+	if ( (lResult = RegQueryValueEx(
+		hRegKey,
+		"FlushInterval",
+		0,
+		&dwType,
+		regvalue,
+		&reglen)) == 0 ) {
+			g_Config.FlushInterval = *((unsigned long*)regvalue);
+	}
+
+	reglen = sizeof regvalue;
+	if ( (lResult = RegQueryValueEx(
+		hRegKey,
+		"MaxSessionMins",
+		0,
+		&dwType,
+		regvalue,
+		&reglen)) == 0 ) {
+			g_Config.MaxSessionMins = *((unsigned long*)regvalue);
+	}
+
+	reglen = sizeof regvalue;
+	if ( (lResult = RegQueryValueEx(
+		hRegKey,
+		"SegmentMins",
+		0,
+		&dwType,
+		regvalue,
+		&reglen)) == 0 ) {
+			g_Config.SegmentMins = *((long*)regvalue);
+	}
+
+	reglen = sizeof regvalue;
+	if ( (lResult = RegQueryValueEx(
+		hRegKey,
+		"SegmentMB",
+		0,
+		&dwType,
+		regvalue,
+		&reglen)) == 0 ) {
+			g_Config.SegmentMB = *((long*)regvalue);
+	}
+
+	reglen = sizeof regvalue;
+	if ( (lResult = RegQueryValueEx(
+		hRegKey,
+		"MappedOutput",
+		0,
+		&dwType,
+		regvalue,
+		&reglen)) == 0 ) {
+			g_Config.MappedOutput = *((bool*)regvalue);
+	}
+
+	reglen = sizeof regvalue;
+	if ( (lResult = RegQueryValueEx(
+		hRegKey,
+		"SharedFeed",
+		0,
+		&dwType,
+		regvalue,
+		&reglen)) == 0 ) {
+			g_Config.SharedFeed = *((bool*)regvalue);
+	}
+
+	reglen = sizeof regvalue;
+	if ( (lResult = RegQueryValueEx(
+		hRegKey,
+		"StreamPort",
+		0,
+		&dwType,
+		regvalue,
+		&reglen)) == 0 ) {
+			g_Config.StreamPort = *((long*)regvalue);
+	}
+
+	reglen = sizeof regvalue;
+	if ( (lResult = RegQueryValueEx(
+		hRegKey,
+		"MarkerPort",
+		0,
+		&dwType,
+		regvalue,
+		&reglen)) == 0 ) {
+			g_Config.MarkerPort = *((long*)regvalue);
+	}
+
+	reglen = sizeof regvalue;
+	if ( (lResult = RegQueryValueEx(
+		hRegKey,
+		"OversampleRate",
+		0,
+		&dwType,
+		regvalue,
+		&reglen)) == 0 ) {
+			g_Config.OversampleRate = *((long*)regvalue);
+	}
+
+	reglen = sizeof regvalue;
+	if ( (lResult = RegQueryValueEx(
+		hRegKey,
+		"DecimationFilter",
+		0,
+		&dwType,
+		regvalue,
+		&reglen)) == 0 ) {
+			g_Config.DecimationFilter = *((long*)regvalue);
+	}
+
+	reglen = sizeof regvalue;
+	if ( (lResult = RegQueryValueEx(
+		hRegKey,
+		"TimingStrategy",
+		0,
+		&dwType,
+		regvalue,
+		&reglen)) == 0 ) {
+			g_Config.TimingStrategy = *((long*)regvalue);
+	}
+
+	reglen = sizeof regvalue;
+	if ( (lResult = RegQueryValueEx(
+		hRegKey,
+		"SamplerPriority",
+		0,
+		&dwType,
+		regvalue,
+		&reglen)) == 0 ) {
+			g_Config.SamplerPriority = *((long*)regvalue);
+	}
+
+	reglen = sizeof regvalue;
+	if ( (lResult = RegQueryValueEx(
+		hRegKey,
+		"SamplerCore",
+		0,
+		&dwType,
+		regvalue,
+		&reglen)) == 0 ) {
+			g_Config.SamplerCore = *((long*)regvalue);
+	}
+
+	reglen = sizeof regvalue;
+	if ( (lResult = RegQueryValueEx(
+		hRegKey,
+		"LockMemory",
+		0,
+		&dwType,
+		regvalue,
+		&reglen)) == 0 ) {
+			g_Config.LockMemory = *((bool*)regvalue);
+	}
+
+	reglen = sizeof regvalue;
+	if ( (lResult = RegQueryValueEx(
+		hRegKey,
+		"EnvelopeColumns",
+		0,
+		&dwType,
+		regvalue,
+		&reglen)) == 0 ) {
+			g_Config.EnvelopeColumns = *((bool*)regvalue);
+	}
+
+	reglen = sizeof regvalue;
+	if ( (lResult = RegQueryValueEx(
+		hRegKey,
+		"RawAxes",
+		0,
+		&dwType,
+		regvalue,
+		&reglen)) == 0 ) {
+			g_Config.RawAxes = *((bool*)regvalue);
+	}
+
 	reglen = sizeof regvalue;
 	if ( (lResult = RegQueryValueEx(
 		hRegKey,
@@ -453,6 +1403,17 @@ bool LoadConfig( void )
 			g_Config.BannerComment[ min(reglen, sizeof g_Config.BannerComment -1) ] = 0;
 	}
 
+	reglen = sizeof g_Config.Conditioning;
+	if ( (lResult = RegQueryValueEx(
+		hRegKey,
+		"Conditioning",
+		0,
+		&dwType,
+		(unsigned char*)&g_Config.Conditioning,
+		&reglen)) == 0 ) {
+			g_Config.Conditioning[ min(reglen, sizeof g_Config.Conditioning -1) ] = 0;
+	}
+
 	reglen = sizeof g_Config.LabelPosX;
 	if ( (lResult = RegQueryValueEx(
 		hRegKey,
@@ -695,11 +1656,11 @@ bool SaveConfig( void )
 
 	if ( (lResult = RegSetValueEx(
 			hRegKey,
-			"TicksPerSec",
+			"FlushInterval",
 			0,
-			REG_QWORD, // note
-			(unsigned char*)&g_Config.TicksPerSec,
-			sizeof g_Config.TicksPerSec)) != 0 ) {
+			REG_DWORD,
+			(unsigned char*)&g_Config.FlushInterval,
+			sizeof g_Config.FlushInterval)) != 0 ) {
 				SetLastError( lResult );
 				RegCloseKey( hRegKey );
 				return false;
@@ -707,11 +1668,11 @@ bool SaveConfig( void )
 
 	if ( (lResult = RegSetValueEx(
 			hRegKey,
-			"JoystickButton",
+			"MaxSessionMins",
 			0,
 			REG_DWORD,
-			(unsigned char*)&g_Config.JoystickButton,
-			sizeof g_Config.JoystickButton)) != 0 ) {
+			(unsigned char*)&g_Config.MaxSessionMins,
+			sizeof g_Config.MaxSessionMins)) != 0 ) {
 				SetLastError( lResult );
 				RegCloseKey( hRegKey );
 				return false;
@@ -719,33 +1680,32 @@ bool SaveConfig( void )
 
 	if ( (lResult = RegSetValueEx(
 			hRegKey,
-			"Button2",
+			"SegmentMins",
 			0,
 			REG_DWORD,
-			(unsigned char*)&g_Config.Button2,
-			sizeof g_Config.Button2)) != 0 ) {
+			(unsigned char*)&g_Config.SegmentMins,
+			sizeof g_Config.SegmentMins)) != 0 ) {
 				SetLastError( lResult );
 				RegCloseKey( hRegKey );
 				return false;
 	};
 
-	regvalue = g_Config.SoundFeedback ? 1 : 0;
 	if ( (lResult = RegSetValueEx(
 			hRegKey,
-			"SoundFeedback",
+			"SegmentMB",
 			0,
 			REG_DWORD,
-			(unsigned char*)&regvalue,
-			sizeof regvalue)) != 0 ) {
+			(unsigned char*)&g_Config.SegmentMB,
+			sizeof g_Config.SegmentMB)) != 0 ) {
 				SetLastError( lResult );
 				RegCloseKey( hRegKey );
 				return false;
 	};
 
-	regvalue = g_Config.SuppressX ? 1 : 0;
+	regvalue = g_Config.MappedOutput ? 1 : 0;
 	if ( (lResult = RegSetValueEx(
 			hRegKey,
-			"SuppressX",
+			"MappedOutput",
 			0,
 			REG_DWORD,
 			(unsigned char*)&regvalue,
@@ -755,10 +1715,10 @@ bool SaveConfig( void )
 				return false;
 	};
 
-	regvalue = g_Config.SuppressY ? 1 : 0;
+	regvalue = g_Config.SharedFeed ? 1 : 0;
 	if ( (lResult = RegSetValueEx(
 			hRegKey,
-			"SuppressY",
+			"SharedFeed",
 			0,
 			REG_DWORD,
 			(unsigned char*)&regvalue,
@@ -770,11 +1730,11 @@ bool SaveConfig( void )
 
 	if ( (lResult = RegSetValueEx(
 			hRegKey,
-			"WindowPositionX",
+			"StreamPort",
 			0,
 			REG_DWORD,
-			(unsigned char*)&g_Config.WPosnX,
-			sizeof g_Config.WPosnX)) != 0 ) {
+			(unsigned char*)&g_Config.StreamPort,
+			sizeof g_Config.StreamPort)) != 0 ) {
 				SetLastError( lResult );
 				RegCloseKey( hRegKey );
 				return false;
@@ -782,11 +1742,11 @@ bool SaveConfig( void )
 
 	if ( (lResult = RegSetValueEx(
 			hRegKey,
-			"WindowPositionY",
+			"MarkerPort",
 			0,
 			REG_DWORD,
-			(unsigned char*)&g_Config.WPosnY,
-			sizeof g_Config.WPosnY)) != 0 ) {
+			(unsigned char*)&g_Config.MarkerPort,
+			sizeof g_Config.MarkerPort)) != 0 ) {
 				SetLastError( lResult );
 				RegCloseKey( hRegKey );
 				return false;
@@ -794,11 +1754,11 @@ bool SaveConfig( void )
 
 	if ( (lResult = RegSetValueEx(
 			hRegKey,
-			"WindowSizeX",
+			"OversampleRate",
 			0,
 			REG_DWORD,
-			(unsigned char*)&g_Config.WSizeX,
-			sizeof g_Config.WSizeX)) != 0 ) {
+			(unsigned char*)&g_Config.OversampleRate,
+			sizeof g_Config.OversampleRate)) != 0 ) {
 				SetLastError( lResult );
 				RegCloseKey( hRegKey );
 				return false;
@@ -806,11 +1766,11 @@ bool SaveConfig( void )
 
 	if ( (lResult = RegSetValueEx(
 			hRegKey,
-			"WindowSizeY",
+			"DecimationFilter",
 			0,
 			REG_DWORD,
-			(unsigned char*)&g_Config.WSizeY,
-			sizeof g_Config.WSizeY)) != 0 ) {
+			(unsigned char*)&g_Config.DecimationFilter,
+			sizeof g_Config.DecimationFilter)) != 0 ) {
 				SetLastError( lResult );
 				RegCloseKey( hRegKey );
 				return false;
@@ -818,11 +1778,11 @@ bool SaveConfig( void )
 
 	if ( (lResult = RegSetValueEx(
 			hRegKey,
-			"FilePattern",
+			"TimingStrategy",
 			0,
-			REG_SZ,
-			(unsigned char*)&g_Config.FilePattern,
-			strlen(g_Config.FilePattern)+1)) != 0 ) {
+			REG_DWORD,
+			(unsigned char*)&g_Config.TimingStrategy,
+			sizeof g_Config.TimingStrategy)) != 0 ) {
 				SetLastError( lResult );
 				RegCloseKey( hRegKey );
 				return false;
@@ -830,11 +1790,11 @@ bool SaveConfig( void )
 
 	if ( (lResult = RegSetValueEx(
 			hRegKey,
-			"BannerComment",
+			"SamplerPriority",
 			0,
-			REG_SZ,
-			(unsigned char*)&g_Config.BannerComment,
-			strlen(g_Config.BannerComment)+1) ) != 0 ) {
+			REG_DWORD,
+			(unsigned char*)&g_Config.SamplerPriority,
+			sizeof g_Config.SamplerPriority)) != 0 ) {
 				SetLastError( lResult );
 				RegCloseKey( hRegKey );
 				return false;
@@ -842,47 +1802,50 @@ bool SaveConfig( void )
 
 	if ( (lResult = RegSetValueEx(
 			hRegKey,
-			"LabelPosX",
+			"SamplerCore",
 			0,
-			REG_SZ,
-			(unsigned char*)&g_Config.LabelPosX,
-			strlen(g_Config.LabelPosX)+1) ) != 0 ) {
+			REG_DWORD,
+			(unsigned char*)&g_Config.SamplerCore,
+			sizeof g_Config.SamplerCore)) != 0 ) {
 				SetLastError( lResult );
 				RegCloseKey( hRegKey );
 				return false;
 	};
 
+	regvalue = g_Config.LockMemory ? 1 : 0;
 	if ( (lResult = RegSetValueEx(
 			hRegKey,
-			"LabelNegX",
+			"LockMemory",
 			0,
-			REG_SZ,
-			(unsigned char*)&g_Config.LabelNegX,
-			strlen(g_Config.LabelNegX)+1) ) != 0 ) {
+			REG_DWORD,
+			(unsigned char*)&regvalue,
+			sizeof regvalue)) != 0 ) {
 				SetLastError( lResult );
 				RegCloseKey( hRegKey );
 				return false;
 	};
 
+	regvalue = g_Config.EnvelopeColumns ? 1 : 0;
 	if ( (lResult = RegSetValueEx(
 			hRegKey,
-			"LabelPosY",
+			"EnvelopeColumns",
 			0,
-			REG_SZ,
-			(unsigned char*)&g_Config.LabelPosY,
-			strlen(g_Config.LabelPosY)+1) ) != 0 ) {
+			REG_DWORD,
+			(unsigned char*)&regvalue,
+			sizeof regvalue)) != 0 ) {
 				SetLastError( lResult );
 				RegCloseKey( hRegKey );
 				return false;
 	};
 
+	regvalue = g_Config.RawAxes ? 1 : 0;
 	if ( (lResult = RegSetValueEx(
 			hRegKey,
-			"LabelNegY",
+			"RawAxes",
 			0,
-			REG_SZ,
-			(unsigned char*)&g_Config.LabelNegY,
-			strlen(g_Config.LabelNegY)+1) ) != 0 ) {
+			REG_DWORD,
+			(unsigned char*)&regvalue,
+			sizeof regvalue)) != 0 ) {
 				SetLastError( lResult );
 				RegCloseKey( hRegKey );
 				return false;
@@ -890,11 +1853,11 @@ bool SaveConfig( void )
 
 	if ( (lResult = RegSetValueEx(
 			hRegKey,
-			"LabelTopLeft",
+			"TicksPerSec",
 			0,
-			REG_SZ,
-			(unsigned char*)&g_Config.LabelTopLeft,
-			strlen(g_Config.LabelTopLeft)+1) ) != 0 ) {
+			REG_QWORD, // note
+			(unsigned char*)&g_Config.TicksPerSec,
+			sizeof g_Config.TicksPerSec)) != 0 ) {
 				SetLastError( lResult );
 				RegCloseKey( hRegKey );
 				return false;
@@ -902,11 +1865,218 @@ bool SaveConfig( void )
 
 	if ( (lResult = RegSetValueEx(
 			hRegKey,
-			"LabelTopRight",
+			"JoystickButton",
 			0,
-			REG_SZ,
-			(unsigned char*)&g_Config.LabelTopRight,
-			strlen(g_Config.LabelTopRight)+1) ) != 0 ) {
+			REG_DWORD,
+			(unsigned char*)&g_Config.JoystickButton,
+			sizeof g_Config.JoystickButton)) != 0 ) {
+				SetLastError( lResult );
+				RegCloseKey( hRegKey );
+				return false;
+	};
+
+	if ( (lResult = RegSetValueEx(
+			hRegKey,
+			"Button2",
+			0,
+			REG_DWORD,
+			(unsigned char*)&g_Config.Button2,
+			sizeof g_Config.Button2)) != 0 ) {
+				SetLastError( lResult );
+				RegCloseKey( hRegKey );
+				return false;
+	};
+
+	regvalue = g_Config.SoundFeedback ? 1 : 0;
+	if ( (lResult = RegSetValueEx(
+			hRegKey,
+			"SoundFeedback",
+			0,
+			REG_DWORD,
+			(unsigned char*)&regvalue,
+			sizeof regvalue)) != 0 ) {
+				SetLastError( lResult );
+				RegCloseKey( hRegKey );
+				return false;
+	};
+
+	regvalue = g_Config.SuppressX ? 1 : 0;
+	if ( (lResult = RegSetValueEx(
+			hRegKey,
+			"SuppressX",
+			0,
+			REG_DWORD,
+			(unsigned char*)&regvalue,
+			sizeof regvalue)) != 0 ) {
+				SetLastError( lResult );
+				RegCloseKey( hRegKey );
+				return false;
+	};
+
+	regvalue = g_Config.SuppressY ? 1 : 0;
+	if ( (lResult = RegSetValueEx(
+			hRegKey,
+			"SuppressY",
+			0,
+			REG_DWORD,
+			(unsigned char*)&regvalue,
+			sizeof regvalue)) != 0 ) {
+				SetLastError( lResult );
+				RegCloseKey( hRegKey );
+				return false;
+	};
+
+	if ( (lResult = RegSetValueEx(
+			hRegKey,
+			"WindowPositionX",
+			0,
+			REG_DWORD,
+			(unsigned char*)&g_Config.WPosnX,
+			sizeof g_Config.WPosnX)) != 0 ) {
+				SetLastError( lResult );
+				RegCloseKey( hRegKey );
+				return false;
+	};
+
+	if ( (lResult = RegSetValueEx(
+			hRegKey,
+			"WindowPositionY",
+			0,
+			REG_DWORD,
+			(unsigned char*)&g_Config.WPosnY,
+			sizeof g_Config.WPosnY)) != 0 ) {
+				SetLastError( lResult );
+				RegCloseKey( hRegKey );
+				return false;
+	};
+
+	if ( (lResult = RegSetValueEx(
+			hRegKey,
+			"WindowSizeX",
+			0,
+			REG_DWORD,
+			(unsigned char*)&g_Config.WSizeX,
+			sizeof g_Config.WSizeX)) != 0 ) {
+				SetLastError( lResult );
+				RegCloseKey( hRegKey );
+				return false;
+	};
+
+	if ( (lResult = RegSetValueEx(
+			hRegKey,
+			"WindowSizeY",
+			0,
+			REG_DWORD,
+			(unsigned char*)&g_Config.WSizeY,
+			sizeof g_Config.WSizeY)) != 0 ) {
+				SetLastError( lResult );
+				RegCloseKey( hRegKey );
+				return false;
+	};
+
+	if ( (lResult = RegSetValueEx(
+			hRegKey,
+			"FilePattern",
+			0,
+			REG_SZ,
+			(unsigned char*)&g_Config.FilePattern,
+			strlen(g_Config.FilePattern)+1)) != 0 ) {
+				SetLastError( lResult );
+				RegCloseKey( hRegKey );
+				return false;
+	};
+
+	if ( (lResult = RegSetValueEx(
+			hRegKey,
+			"BannerComment",
+			0,
+			REG_SZ,
+			(unsigned char*)&g_Config.BannerComment,
+			strlen(g_Config.BannerComment)+1) ) != 0 ) {
+				SetLastError( lResult );
+				RegCloseKey( hRegKey );
+				return false;
+	};
+
+	if ( (lResult = RegSetValueEx(
+			hRegKey,
+			"Conditioning",
+			0,
+			REG_SZ,
+			(unsigned char*)&g_Config.Conditioning,
+			strlen(g_Config.Conditioning)+1) ) != 0 ) {
+				SetLastError( lResult );
+				RegCloseKey( hRegKey );
+				return false;
+	};
+
+	if ( (lResult = RegSetValueEx(
+			hRegKey,
+			"LabelPosX",
+			0,
+			REG_SZ,
+			(unsigned char*)&g_Config.LabelPosX,
+			strlen(g_Config.LabelPosX)+1) ) != 0 ) {
+				SetLastError( lResult );
+				RegCloseKey( hRegKey );
+				return false;
+	};
+
+	if ( (lResult = RegSetValueEx(
+			hRegKey,
+			"LabelNegX",
+			0,
+			REG_SZ,
+			(unsigned char*)&g_Config.LabelNegX,
+			strlen(g_Config.LabelNegX)+1) ) != 0 ) {
+				SetLastError( lResult );
+				RegCloseKey( hRegKey );
+				return false;
+	};
+
+	if ( (lResult = RegSetValueEx(
+			hRegKey,
+			"LabelPosY",
+			0,
+			REG_SZ,
+			(unsigned char*)&g_Config.LabelPosY,
+			strlen(g_Config.LabelPosY)+1) ) != 0 ) {
+				SetLastError( lResult );
+				RegCloseKey( hRegKey );
+				return false;
+	};
+
+	if ( (lResult = RegSetValueEx(
+			hRegKey,
+			"LabelNegY",
+			0,
+			REG_SZ,
+			(unsigned char*)&g_Config.LabelNegY,
+			strlen(g_Config.LabelNegY)+1) ) != 0 ) {
+				SetLastError( lResult );
+				RegCloseKey( hRegKey );
+				return false;
+	};
+
+	if ( (lResult = RegSetValueEx(
+			hRegKey,
+			"LabelTopLeft",
+			0,
+			REG_SZ,
+			(unsigned char*)&g_Config.LabelTopLeft,
+			strlen(g_Config.LabelTopLeft)+1) ) != 0 ) {
+				SetLastError( lResult );
+				RegCloseKey( hRegKey );
+				return false;
+	};
+
+	if ( (lResult = RegSetValueEx(
+			hRegKey,
+			"LabelTopRight",
+			0,
+			REG_SZ,
+			(unsigned char*)&g_Config.LabelTopRight,
+			strlen(g_Config.LabelTopRight)+1) ) != 0 ) {
 				SetLastError( lResult );
 				RegCloseKey( hRegKey );
 				return false;
@@ -957,6 +2127,65 @@ INT_PTR CALLBACK MainDlgProc( HWND hDlg, UINT msg, WPARAM wParam, LPARAM lParam
 				_snprintf( g_MsgText, sizeof g_MsgText, "Click button %u to start", g_Config.JoystickButton );
 			}
 
+			if ( g_Config.SharedFeed && !FeedOpen() ) {
+				MessageBox( NULL, TEXT("Couldn't create the shared memory feed; another copy of the monitor may be ")
+					TEXT("publishing it. Other programs won't see this joystick."),
+					Title, MB_ICONWARNING | MB_OK );
+			}
+
+			if ( g_Config.StreamPort != 0 && !PublisherStart() ) {
+				char text[128];
+				_snprintf( text, sizeof text, "Couldn't stream samples on port %ld; is another copy running?", g_Config.StreamPort );
+				MessageBox( NULL, text, Title, MB_ICONWARNING | MB_OK );
+			}
+
+			if ( g_Config.MarkerPort != 0 && !MarkerStart() ) {
+				char text[128];
+				_snprintf( text, sizeof text, "Couldn't take markers on port %ld; is another copy running?", g_Config.MarkerPort );
+				MessageBox( NULL, text, Title, MB_ICONWARNING | MB_OK );
+			}
+
+			if ( g_pVirtual != NULL ) {
+				// No joystick needed; the GUI timer does the updating.
+				SetWindowText( hDlg, "Joystick Monitor (scripted device)" );
+
+			} else if ( (g_Device.hThread = CreateThread( NULL, 0, DeviceThreadProc, (LPVOID)hDlg, 0, NULL )) != NULL ) {
+				// The window shows while the joystick's found; WM_DEVICE_FOUND says when.
+				_snprintf( g_MsgText, sizeof g_MsgText, "Looking for the joystick..." );
+
+			} else {
+				DeviceThreadProc( (LPVOID)hDlg );
+			}
+
+			if ( g_Config.RememberWindow &&
+					g_Config.WPosnX >= 0   && g_Config.WPosnY >= 0 &&
+					g_Config.WSizeX >= 200 && g_Config.WSizeY >= 200 ) {
+				MoveWindow( hDlg, g_Config.WPosnX, g_Config.WPosnY, g_Config.WSizeX, g_Config.WSizeY, TRUE );
+			}
+
+			// The buttons are hidden while recording, so the statistics panel
+			// is opened from the system menu.
+			{
+				HMENU hMenu = GetSystemMenu( hDlg, FALSE );
+				AppendMenu( hMenu, MF_SEPARATOR, 0, NULL );
+				AppendMenu( hMenu, MF_STRING, IDM_STATS, "Running &statistics" );
+			}
+
+			IdleMode( hDlg );
+			{
+				LARGE_INTEGER now;
+				QueryPerformanceCounter( &now );
+				g_Device.shown = (now.QuadPart - g_Device.begun) * 1000.0 / g_qpcfreq;
+			}
+			break;
+
+		case WM_DEVICE_FOUND:	// DeviceThreadProc() is done
+			if ( g_Device.hThread != NULL ) {
+				WaitForSingleObject( g_Device.hThread, INFINITE );
+				CloseHandle( g_Device.hThread );
+				g_Device.hThread = NULL;
+			}
+
 			if( FAILED( InitDirectInput( hDlg ) ) )
             {
                 MessageBox( NULL, TEXT("Error Initializing DirectInput"), Title, MB_ICONERROR | MB_OK );
@@ -964,9 +2193,7 @@ INT_PTR CALLBACK MainDlgProc( HWND hDlg, UINT msg, WPARAM wParam, LPARAM lParam
 				break;
 			}
 
-			// Make the joystick send us msgs
-			if ( joySetCapture(hDlg, JOYSTICKID1, 0, TRUE) != JOYERR_NOERROR || 
-				!g_pJoystick || g_pJoystick->Acquire() != S_OK )
+			else if ( !g_pJoystick || g_pJoystick->Acquire() != S_OK )
 			{ 
 				MessageBeep(MB_ICONEXCLAMATION); 
 				MessageBox(hDlg, "Couldn't initialize the joystick.", Title, MB_OK | MB_ICONEXCLAMATION);
@@ -974,28 +2201,44 @@ INT_PTR CALLBACK MainDlgProc( HWND hDlg, UINT msg, WPARAM wParam, LPARAM lParam
  				//PostMessage(hDlg,WM_CLOSE,0,0L); 
 		    } 
 
-			if ( g_Config.RememberWindow &&
-					g_Config.WPosnX >= 0   && g_Config.WPosnY >= 0 &&
-					g_Config.WSizeX >= 200 && g_Config.WSizeY >= 200 ) {
-				MoveWindow( hDlg, g_Config.WPosnX, g_Config.WPosnY, g_Config.WSizeX, g_Config.WSizeY, TRUE );
-			}
+			else if ( !g_Device.cached )
+				DeviceRemember( g_DeviceGuid );
 
-			// Make sure there is some activity so joystick buttons > 4 are noticed
-			SetTimer( hDlg, 42, 100, NULL );
-					
+			// Wait for the joystick to change, or failing that poll it, and
+			// get it back if it's unplugged.
+			if ( g_pJoystick ) {
+				IdleStart( hDlg );
+				RecoveryStart( hDlg );
+			}
+			IdleMode( hDlg );
+			_snprintf( g_MsgText, sizeof g_MsgText, "Click button %u to start", g_Config.JoystickButton );
+			{
+				LARGE_INTEGER now;
+				QueryPerformanceCounter( &now );
+				g_Device.found = (now.QuadPart - g_Device.begun) * 1000.0 / g_qpcfreq;
+			}
 			break;
 
-		case MM_JOY1BUTTONDOWN :               // button is down 
-			// Note that this only picks up buttons 1--4, so we poll using OnjoystickButton below.
-			if( (UINT)wParam & JOY_BUTTON2CHG) {
+		case WM_PAINT:
+			// Our drawing's been painted over; put it back once the controls
+			// have finished.
+			SetTimer( hDlg, REDRAW_TIMER, REDRAW_DELAY, NULL );
+			return FALSE;
 
-					// Toggle whether we show axis details
-					g_Config.ShowAxes = !g_Config.ShowAxes;
+		case WM_TIMER:		// the GUI timer keeps the display updated while recording
+			if ( wParam == REPLAY_TIMER ) {
+				ReplayTick( hDlg );
+				break;
 			}
-			break;
+			if ( wParam == REDRAW_TIMER ) {
+				KillTimer( hDlg, REDRAW_TIMER );
+				g_Idle.redraw = true;
+			}
+			// Fall through
+		case WM_JOYSTICK_CHANGED:
+			if ( msg == WM_JOYSTICK_CHANGED )
+				InterlockedExchange( &g_Idle.posted, 0 );
 
-		case WM_TIMER:		// Timer 42 allows us to keep the GUI updated
-		case MM_JOY1MOVE:	// changed position
             if( FAILED( UpdateInputState( hDlg ) ) )
             {
                 MessageBox( NULL, TEXT("Error Reading Input State. ") \
@@ -1004,27 +2247,108 @@ INT_PTR CALLBACK MainDlgProc( HWND hDlg, UINT msg, WPARAM wParam, LPARAM lParam
                 EndDialog( hDlg, TRUE ); 
             }
 
-			// Make sure all is well with writing.
-			if ( g_bWriting && g_bWriteError )
+			// Recording carries on through write errors, which show in the
+			// status line; sound the alarm when there's a new one.
 			{
-                MessageBox( NULL, TEXT("Error Writing Output File. ") \
-                            TEXT("The monitor will now exit."), Title, 
-                            MB_ICONERROR | MB_OK );
-                EndDialog( hDlg, TRUE ); 
-            }
+				static LONG errors = 0;
+				if ( g_bWriting && g_Health.writeerrors > errors )
+					MessageBeep( MB_ICONEXCLAMATION );
+				errors = g_bWriting ? g_Health.writeerrors : 0;
+			}
 
+			if ( g_pJoystick || g_pVirtual )
+				CheckJoystickButton( hDlg );
 			break; 
 
-		case WM_COMMAND:
-            switch( LOWORD(wParam) )
-            {
-                case IDCANCEL:
-				case ID_FILE_EXIT:
+		case WM_DEVICECHANGE:	// something's been plugged in or out
+			if ( wParam == DBT_DEVICEARRIVAL || wParam == DBT_DEVICEREMOVECOMPLETE || wParam == DBT_DEVNODES_CHANGED ) {
+				// If the joystick's lost, try for it now; if not, see if it still is there.
+				if ( g_Recovery.lost )
+					SetEvent( g_Recovery.hWake );
+				else if ( !g_bWriting && InterlockedExchange( &g_Idle.posted, 1 ) == 0 )
+					PostMessage( hDlg, WM_JOYSTICK_CHANGED, 0, 0 );
+			}
+			break;
+
+		case WM_HSCROLL:	// the replay scrub bar
+			if ( (HWND)lParam == GetDlgItem( hDlg, IDC_REPLAY_POS ) && g_Replay.data != NULL ) {
+				if ( LOWORD(wParam) == TB_THUMBTRACK )
+					g_Replay.dragging = true;
+				else if ( LOWORD(wParam) == TB_ENDTRACK )
+					g_Replay.dragging = false;
+				LRESULT pos = SendMessage( (HWND)lParam, TBM_GETPOS, 0, 0 );
+				ReplaySeek( g_Replay.first + (LONGLONG)pos * 100000 );
+				ReplayTick( hDlg );
+			}
+			break;
+
+		case WM_COMMAND:
+            switch( LOWORD(wParam) )
+            {
+                case IDCANCEL:
+				case ID_FILE_EXIT:
                     EndDialog( hDlg, 0 );
 					break;
 
+				case IDC_REPLAY:
+					if ( g_Replay.data != NULL ) {
+						ReplayClose( hDlg );
+					} else {
+						char name[MAX_PATH] = "";
+						OPENFILENAME ofn;
+						memset( &ofn, 0, sizeof ofn );
+						ofn.lStructSize = sizeof ofn;
+						ofn.hwndOwner = hDlg;
+						ofn.lpstrFilter = "All files\0*.*\0";
+						ofn.lpstrFile = name;
+						ofn.nMaxFile = sizeof name;
+						ofn.lpstrTitle = "Replay a recording";
+						ofn.Flags = OFN_FILEMUSTEXIST | OFN_HIDEREADONLY;
+						if ( GetOpenFileName( &ofn ) && !ReplayOpen( hDlg, name ) ) {
+							char text[MAX_PATH + 64];
+							_snprintf( text, sizeof text, "Couldn't replay %s; is it a recording?", name );
+							text[sizeof text -1] = 0;
+							MessageBox( hDlg, text, Title, MB_ICONERROR | MB_OK );
+						}
+					}
+					break;
+
+				case IDC_REPLAY_SPEED:
+					if ( HIWORD(wParam) == CBN_SELCHANGE ) {
+						LRESULT sel = SendMessage( (HWND)lParam, CB_GETCURSEL, 0, 0 );
+						if ( sel >= 0 && sel < sizeof ReplaySpeeds / sizeof ReplaySpeeds[0] )
+							g_Replay.speed = ReplaySpeeds[sel];
+					}
+					break;
+
 				case ID_EDIT_CONFIG:
 					DialogBox( g_hInst, MAKEINTRESOURCE(IDD_CONFIG), hDlg, ConfigDlgProc );
+
+					// Start or stop the feed if that changed.
+					if ( g_Config.SharedFeed && g_pFeed == NULL && !FeedOpen() )
+						MessageBox( NULL, TEXT("Couldn't create the shared memory feed; another copy of the monitor may be ")
+							TEXT("publishing it. Other programs won't see this joystick."),
+							Title, MB_ICONWARNING | MB_OK );
+					else if ( !g_Config.SharedFeed )
+						FeedClose();
+
+					// Likewise the stream, which has to restart to move port.
+					if ( g_Config.StreamPort != g_PublisherPort ) {
+						PublisherStop();
+						if ( g_Config.StreamPort != 0 && !PublisherStart() ) {
+							char text[128];
+							_snprintf( text, sizeof text, "Couldn't stream samples on port %ld", g_Config.StreamPort );
+							MessageBox( hDlg, text, Title, MB_ICONWARNING | MB_OK );
+						}
+					}
+					if ( g_Config.MarkerPort != g_MarkerPort ) {
+						MarkerStop();
+						if ( g_Config.MarkerPort != 0 && !MarkerStart() ) {
+							char text[128];
+							_snprintf( text, sizeof text, "Couldn't take markers on port %ld", g_Config.MarkerPort );
+							MessageBox( hDlg, text, Title, MB_ICONWARNING | MB_OK );
+						}
+					}
 					break;
 
 				default:
@@ -1040,6 +2364,7 @@ INT_PTR CALLBACK MainDlgProc( HWND hDlg, UINT msg, WPARAM wParam, LPARAM lParam
 				// dimensions to the child windows during enumeration. 
 	            GetClientRect(hDlg, &rcClient); 
 		        EnumChildWindows(hDlg, EnumChildProc, (LPARAM) &rcClient); 
+				g_Idle.redraw = true;
 				break;
 			}
 
@@ -1055,38 +2380,288 @@ INT_PTR CALLBACK MainDlgProc( HWND hDlg, UINT msg, WPARAM wParam, LPARAM lParam
 
 		case WM_DESTROY:
             // Cleanup everything
-			if ( fp ) { fclose(fp); fp = 0; }
-			joyReleaseCapture(JOYSTICKID1);
-            KillTimer( hDlg, 0 );    
+			if ( g_bWriting ) {
+				SamplerStop();
+				StopWriting();
+			}
+			IdleStop();
+			RecoveryStop();
+            KillTimer( hDlg, GUI_TIMER );    
+			if ( g_Device.hThread != NULL ) {
+				WaitForSingleObject( g_Device.hThread, INFINITE );
+				CloseHandle( g_Device.hThread );
+				g_Device.hThread = NULL;
+			}
             FreeDirectInput();    
+			FeedClose();
+			PublisherStop();
+			MarkerStop();
+			ReplayClose( hDlg );
+			if ( g_hStatsDlg != NULL )
+				DestroyWindow( g_hStatsDlg );
             break;
 
-		default:
-			// We don't get notified for button events for buttons > 4,
-			// so poll here instead.
-			if ( g_pJoystick )
-				CheckJoystickButton( hDlg );
+		case WM_SYSCOMMAND:
+			if ( (wParam & 0xFFF0) == IDM_STATS ) {
+				if ( g_hStatsDlg != NULL ) {
+					DestroyWindow( g_hStatsDlg );
+				} else if ( (g_hStatsDlg = CreateDialog( g_hInst, MAKEINTRESOURCE(IDD_STATS), hDlg, StatsDlgProc )) != NULL ) {
+					CheckMenuItem( GetSystemMenu( hDlg, FALSE ), IDM_STATS, MF_CHECKED );
+				}
+				break;
+			}
+			// Fall through
 
+		default:
 			return FALSE; // Message not handled 
     }
 
-	if ( g_pJoystick )
-		CheckJoystickButton( hDlg );
-
 	return TRUE;
 }
 
 //-----------------------------------------------------------------------------
 // Name: WaitOrTimerCallback
-// Desc: Catch MM timer ticks
+// Desc: Catch MM timer ticks, or our own. Anything lost is counted in g_Health.
 //-----------------------------------------------------------------------------
 VOID CALLBACK WaitOrTimerCallback(PVOID lpParameter, BOOLEAN TimerOrWaitFired)
 {
-	if (g_bWriting && !WriteToFile())
-	{
-		// Pass a clue back to the gui thread.
-		g_bWriteError = true;
+	if (g_bWriting) {
+		LONGLONG started = SessionClock();
+		WriteToFile();
+		g_Health.busy += (SessionClock() - started) / 1000000.0;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Name: SamplerStart()
+// Desc: Start taking samples, timed whichever way is configured.
+//-----------------------------------------------------------------------------
+bool SamplerStart( void )
+{
+	// Try set a 1ms timer resolution, so we get better timing intervals. Then request
+	// a tick at the required interval. Note that the clock usually ticks at 64 Hz, so
+	// there is a max 15.6ms (1000/64) error. Using SetTimer() results in an accumulating
+	// error, but CreateTimerQueuetimer() does better, with the system adjusting calls here
+	// to compensate, with zero accumulating error, which is more desirable.
+	TIMECAPS tc;
+	if ( timeGetDevCaps(&tc, sizeof(TIMECAPS)) != TIMERR_NOERROR ||
+		(g_Sampler.resolution = min(max(tc.wPeriodMin, 1), tc.wPeriodMax)) < 1 ||
+		 timeBeginPeriod(g_Sampler.resolution) != TIMERR_NOERROR )
+		return false;
+
+	g_Sampler.stop = false;
+	SpinWaitInit( g_Sampler.wait );
+	g_Sampler.wait.sleeponly = g_Config.TimingStrategy == TIMING_SLEEP;
+	g_Sampler.tuning[0] = 0;
+	if ( g_Config.TimingStrategy != TIMING_QUEUE ) {
+		// Tune the thread before it takes its first sample.
+		if ( (g_Sampler.hThread = CreateThread( NULL, 0, SamplerThreadProc, NULL, CREATE_SUSPENDED, NULL )) != NULL ) {
+			SamplerTune( g_Sampler.hThread, g_Sampler.tuning, sizeof g_Sampler.tuning );
+			ResumeThread( g_Sampler.hThread );
+		}
+	} else if ( CreateTimerQueueTimer(&g_Sampler.hTimer, NULL, WaitOrTimerCallback, (PVOID)69,
+					0, g_Decimator.period, WT_EXECUTEDEFAULT) ) {
+		strcpy( g_Sampler.tuning, "pool thread" );
+	}
+
+	if ( g_Sampler.hTimer != NULL || g_Sampler.hThread != NULL ) {
+		if ( g_Config.LockMemory ) {
+			bool locked = SamplerLockMemory( true );
+			size_t n = strlen( g_Sampler.tuning );
+			_snprintf( g_Sampler.tuning + n, sizeof g_Sampler.tuning - n,
+				locked ? ", memory locked" : ", memory not locked (error %lu)", GetLastError() );
+			g_Sampler.tuning[sizeof g_Sampler.tuning -1] = 0;
+		}
+		return true;
+	}
+
+	g_Sampler.hTimer = g_Sampler.hThread = NULL;
+	timeEndPeriod( g_Sampler.resolution );
+	return false;
+}
+
+//-----------------------------------------------------------------------------
+// Name: SamplerStop()
+// Desc: Stop taking samples. Any that's being taken is finished first, so
+//       nothing is queued once this returns.
+//-----------------------------------------------------------------------------
+void SamplerStop( void )
+{
+	if ( g_Sampler.hThread != NULL ) {
+		g_Sampler.stop = true;
+		WaitForSingleObject( g_Sampler.hThread, INFINITE );
+		CloseHandle( g_Sampler.hThread );
+		g_Sampler.hThread = NULL;
+	}
+	if ( g_Sampler.hTimer != NULL ) {
+		DeleteTimerQueueTimer( NULL, g_Sampler.hTimer, INVALID_HANDLE_VALUE );
+		g_Sampler.hTimer = NULL;
+	}
+	SamplerLockMemory( false );
+	timeEndPeriod( g_Sampler.resolution );
+}
+
+//-----------------------------------------------------------------------------
+// Name: SamplerThreadProc()
+// Desc: Take a sample at every tick, sleeping (then spinning) till it's due.
+//-----------------------------------------------------------------------------
+DWORD WINAPI SamplerThreadProc( LPVOID lpParameter )
+{
+	LONGLONG period = g_Decimator.period * 1000, next = SessionClock();
+
+	while ( !g_Sampler.stop ) {
+		SpinWaitUntil( g_Sampler.wait, next );
+		WaitOrTimerCallback( NULL, TRUE );
+
+		// After a long stall, carry on from now rather than racing to catch
+		// up. The ticks in between are gone, and there'll be a gap for them.
+		next += period;
+		LONGLONG behind = SessionClock() - next;
+		if ( behind >= period )
+			next += behind / period * period;
+	}
+
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// Name: SpinWaitInit()
+// Desc: Get ready to wait for a series of deadlines.
+//-----------------------------------------------------------------------------
+void SpinWaitInit( SPINWAIT& w )
+{
+	w.margin = SPIN_START_MARGIN;
+	w.spun = 0;
+	w.sleeponly = false;
+}
+
+//-----------------------------------------------------------------------------
+// Name: SpinWaitUntil()
+// Desc: Wait until the session clock reaches the deadline, sleeping for as
+//       much of the time as is safe and spinning for the rest. If it's only
+//       to sleep, it sleeps till the deadline and is as late as it wakes.
+//-----------------------------------------------------------------------------
+void SpinWaitUntil( SPINWAIT& w, LONGLONG deadline )
+{
+	LONGLONG now = SessionClock(), ms = (deadline - w.margin - now) / 1000;
+
+	if ( w.sleeponly ) {
+		if ( deadline > now )
+			Sleep( (DWORD)((deadline - now + 999) / 1000) );
+		return;
+	}
+
+	if ( ms > 0 ) {
+		LONGLONG intended = now + ms * 1000;
+		Sleep( (DWORD)ms );
+
+		// How far past it woke, with a little to spare, is the margin wanted.
+		LONGLONG want = SessionClock() - intended + SPIN_MIN_MARGIN;
+		if ( want > w.margin )
+			w.margin = min( want, (LONGLONG)SPIN_MAX_MARGIN );
+		else
+			w.margin = max( w.margin - (w.margin - want) / 64, (LONGLONG)SPIN_MIN_MARGIN );
+	}
+
+	LONGLONG spinning = SessionClock();
+	while ( (now = SessionClock()) < deadline )
+		YieldProcessor();
+	w.spun += (now - spinning) / 1000000.0;
+}
+
+//-----------------------------------------------------------------------------
+// Name: SamplerTune()
+// Desc: Give a sampling thread the configured priority, and pin it to the
+//       configured processor. Either can be refused, which is put up with;
+//       what it got is described in buf.
+//-----------------------------------------------------------------------------
+void SamplerTune( HANDLE hThread, char * buf, size_t len )
+{
+	const long levels = sizeof SamplerPriorities / sizeof SamplerPriorities[0];
+	long p = max( 0L, min( g_Config.SamplerPriority, levels -1 ) );
+	size_t n;
+
+	_snprintf( buf, len, SetThreadPriority( hThread, SamplerPriorityLevels[p] ) ?
+		"priority %s" : "priority %s refused", SamplerPriorities[p] );
+	buf[len -1] = 0;
+
+	if ( g_Config.SamplerCore >= 0 ) {
+		DWORD_PTR process, system, mask = (DWORD_PTR)1 << g_Config.SamplerCore;
+		bool pinned = g_Config.SamplerCore < (long)(8 * sizeof(DWORD_PTR)) &&
+			GetProcessAffinityMask( GetCurrentProcess(), &process, &system ) &&
+			(process & mask) != 0 && SetThreadAffinityMask( hThread, mask ) != 0;
+		n = strlen( buf );
+		_snprintf( buf + n, len - n, pinned ? ", on processor %ld" : ", processor %ld not available",
+			g_Config.SamplerCore );
+		buf[len -1] = 0;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Name: SamplerLockMemory()
+// Desc: Lock (or unlock) what the sampler works on into memory, so a tick is
+//       never held up by a page fault. The working set has to be let grow by
+//       as much first, which may not be allowed; if any of it can't be done,
+//       things are left as they were and it returns false.
+//-----------------------------------------------------------------------------
+bool SamplerLockMemory( bool lock )
+{
+	static SIZE_T minws, maxws;
+	SIZE_T lutsize = (2 * g_Calibration.cal.range + 1) * sizeof(LONG);
+	struct { void * base; SIZE_T size; } region[] = {
+		{ &g_WriteQueue, sizeof g_WriteQueue },
+		{ &g_PublishQueue, sizeof g_PublishQueue },
+		{ &g_FeedQueue, sizeof g_FeedQueue },
+		{ &g_Decimator, sizeof g_Decimator },
+		{ g_Chain, sizeof g_Chain },
+		{ g_CurveTable, sizeof g_CurveTable },
+		{ &g_Running, sizeof g_Running },
+		{ &g_Health, sizeof g_Health },
+		{ g_pFeed, g_pFeed != NULL ? sizeof(JOYMON_FEED) : 0 },
+		{ g_Calibration.lut[0], g_Calibration.lut[0] != NULL ? lutsize : 0 },
+		{ g_Calibration.lut[1], g_Calibration.lut[1] != NULL ? lutsize : 0 },
+	};
+	const int regions = sizeof region / sizeof region[0];
+	int i;
+
+	if ( !lock ) {
+		if ( !g_Sampler.locked )
+			return true;
+		for ( i = 0; i < regions; i++ )
+			if ( region[i].size > 0 )
+				VirtualUnlock( region[i].base, region[i].size );
+		SetProcessWorkingSetSize( GetCurrentProcess(), minws, maxws );
+		g_Sampler.locked = false;
+		return true;
+	}
+
+	// Each region can take up to a page more than its size, where it's not aligned.
+	SYSTEM_INFO si;
+	SIZE_T need = 0;
+	GetSystemInfo( &si );
+	for ( i = 0; i < regions; i++ )
+		need += region[i].size + si.dwPageSize;
+
+	if ( !GetProcessWorkingSetSize( GetCurrentProcess(), &minws, &maxws ) ||
+		 !SetProcessWorkingSetSize( GetCurrentProcess(), minws + need, maxws + need ) )
+		return false;
+
+	for ( i = 0; i < regions; i++ ) {
+		if ( region[i].size > 0 && !VirtualLock( region[i].base, region[i].size ) )
+			break;
+	}
+	if ( i < regions ) {
+		DWORD err = GetLastError();
+		while ( --i >= 0 )
+			if ( region[i].size > 0 )
+				VirtualUnlock( region[i].base, region[i].size );
+		SetProcessWorkingSetSize( GetCurrentProcess(), minws, maxws );
+		SetLastError( err );
+		return false;
 	}
+
+	g_Sampler.locked = true;
+	return true;
 }
 
 //-----------------------------------------------------------------------------
@@ -1102,8 +2677,6 @@ void CheckJoystickButton( HWND hDlg )
 	static time_t lastclick = 0;
 	static time_t started = 0;
 	time_t timenow = time(0);
-	static HANDLE MMtimer;
-	static UINT period;
 
 	if ( PollJoystick( js ) == S_OK ) {
 		
@@ -1114,7 +2687,7 @@ void CheckJoystickButton( HWND hDlg )
 			g_JoystickButton = false;
 
 			// avoid a triple-click reopening the file by requiring 3 secs to pass
-			if ( !g_bWriting && timenow - lastclick >= 3 ) {
+			if ( !g_bWriting && g_Replay.data == NULL && timenow - lastclick >= 3 ) {
 
 				started = timenow;
 
@@ -1131,8 +2704,6 @@ void CheckJoystickButton( HWND hDlg )
 
 				} else {
 
-					g_bWriteError = false;	// all good so far.
-
 					if ( !g_Config.ShowFilename )
 						g_MsgText[0] = 0;
 
@@ -1141,41 +2712,37 @@ void CheckJoystickButton( HWND hDlg )
 					ShowWindow( GetDlgItem( hDlg, ID_EDIT_CONFIG ), SW_HIDE );
 				    EnableWindow( GetDlgItem( hDlg, IDCANCEL ), FALSE );
 					ShowWindow( GetDlgItem( hDlg, IDCANCEL ), SW_HIDE );
+				    EnableWindow( GetDlgItem( hDlg, IDC_REPLAY ), FALSE );
+					ShowWindow( GetDlgItem( hDlg, IDC_REPLAY ), SW_HIDE );
 
 					// Make a noise
 					MessageBeep(MB_ICONASTERISK); 
 
-					// Try set a 1ms timer resolution, so we get better timing intervals. Then request
-					// a tick at the required interval. Note that the clock usually ticks at 64 Hz, so
-					// there is a max 15.6ms (1000/64) error. Using SetTimer() results in an accumulating
-					// error, but CreateTimerQueuetimer() does better, with the system adjusting calls here
-					// to compensate, with zero accumulating error, which is more desirable.
-					TIMECAPS tc;
-					if (timeGetDevCaps(&tc, sizeof(TIMECAPS)) != TIMERR_NOERROR ||
-						(period=(min(max(tc.wPeriodMin, 1), tc.wPeriodMax))) < 1 ||
-						 timeBeginPeriod(period) != TIMERR_NOERROR ||
-						 CreateTimerQueueTimer(&MMtimer, NULL, WaitOrTimerCallback, (PVOID)69,
-							0, (unsigned int)(1000.0 / g_Config.TicksPerSec), WT_EXECUTEDEFAULT) == FALSE) {
+					if ( !SamplerStart() ) {
 			                MessageBox( NULL, TEXT("Timer initialisation failed; cannot continue."),
 		                    TEXT("The monitor will now exit."), MB_ICONERROR | MB_OK );
 				        EndDialog( hDlg, 0 );
+					} else {
+						SessionInfoSave( false );	// now the timer's known
 					}
-
-					g_timerstart = GetTickCount();
+					IdleMode( hDlg );
 				}
 
 			} else if ( g_bWriting && timenow - started > 2 ) {
 				if ( timenow - lastclick <= 1 ) {
 					// two clicks in a second means we stop writing, but must write for a couple of secs.
-					timeEndPeriod(period);
-					DeleteTimerQueueTimer(NULL, MMtimer, NULL);
+					// Wait for any running callback, so nothing is queued once the writer stops.
+					SamplerStop();
 					StopWriting();
 					MessageBeep(MB_OK);
 					EnableWindow( GetDlgItem( hDlg, ID_EDIT_CONFIG ), TRUE );
 					ShowWindow( GetDlgItem( hDlg, ID_EDIT_CONFIG ), SW_SHOW );
 					EnableWindow( GetDlgItem( hDlg, IDCANCEL ), TRUE );
 					ShowWindow( GetDlgItem( hDlg, IDCANCEL ), SW_SHOW );
+					EnableWindow( GetDlgItem( hDlg, IDC_REPLAY ), TRUE );
+					ShowWindow( GetDlgItem( hDlg, IDC_REPLAY ), SW_SHOW );
 					_snprintf( g_MsgText, sizeof g_MsgText, "Click button %u to start", g_Config.JoystickButton );
+					IdleMode( hDlg );
 				}
 			}
 
@@ -1188,6 +2755,185 @@ void CheckJoystickButton( HWND hDlg )
 	}
 }
 
+//-----------------------------------------------------------------------------
+// Name: IdleStart()
+// Desc: Start waiting for the joystick to change. Needs the device's event,
+//       which InitDirectInput() sets up if it can.
+//-----------------------------------------------------------------------------
+bool IdleStart( HWND hDlg )
+{
+	if ( g_Idle.hEvent == NULL )
+		return false;
+
+	g_Idle.hDlg = hDlg;
+	g_Idle.posted = 0;
+	if ( (g_Idle.hStop = CreateEvent( NULL, TRUE, FALSE, NULL )) == NULL )
+		return false;
+	if ( (g_Idle.hThread = CreateThread( NULL, 0, IdleThreadProc, NULL, 0, NULL )) == NULL ) {
+		CloseHandle( g_Idle.hStop );
+		g_Idle.hStop = NULL;
+		return false;
+	}
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Name: IdleStop()
+// Desc: Stop waiting for the joystick.
+//-----------------------------------------------------------------------------
+void IdleStop( void )
+{
+	if ( g_Idle.hThread != NULL ) {
+		SetEvent( g_Idle.hStop );
+		WaitForSingleObject( g_Idle.hThread, INFINITE );
+		CloseHandle( g_Idle.hThread );
+		CloseHandle( g_Idle.hStop );
+		g_Idle.hThread = g_Idle.hStop = NULL;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Name: IdleMode()
+// Desc: Keep the display up to date the cheapest way that works for now: on
+//       the GUI timer while recording or with a scripted device, otherwise on
+//       the joystick's say-so if it can give it. Call when recording starts
+//       or stops.
+//-----------------------------------------------------------------------------
+void IdleMode( HWND hDlg )
+{
+	if ( g_bWriting || g_pVirtual != NULL || g_Idle.hThread == NULL )
+		SetTimer( hDlg, GUI_TIMER, g_pVirtual != NULL ? GUI_VIRTUAL_PERIOD : GUI_PERIOD, NULL );
+	else
+		KillTimer( hDlg, GUI_TIMER );
+	g_Idle.redraw = true;
+}
+
+//-----------------------------------------------------------------------------
+// Name: IdleThreadProc()
+// Desc: Tell the window when the joystick changes, if it's not recording.
+//-----------------------------------------------------------------------------
+DWORD WINAPI IdleThreadProc( LPVOID lpParameter )
+{
+	HANDLE events[2] = { g_Idle.hStop, g_Idle.hEvent };
+
+	while ( WaitForMultipleObjects( 2, events, FALSE, INFINITE ) == WAIT_OBJECT_0 + 1 ) {
+		if ( !g_bWriting && InterlockedExchange( &g_Idle.posted, 1 ) == 0 )
+			PostMessage( g_Idle.hDlg, WM_JOYSTICK_CHANGED, 0, 0 );
+
+		// A noisy stick can change all the time; anything that comes in
+		// meanwhile leaves the event set, so it's seen after this.
+		Sleep( IDLE_MIN_PERIOD );
+	}
+
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// Name: RecoveryStart()
+// Desc: Start the thread that gets the joystick back if it's unplugged, and
+//       ask to be told about HID devices coming and going.
+//-----------------------------------------------------------------------------
+bool RecoveryStart( HWND hDlg )
+{
+	// GUID_DEVINTERFACE_HID, from hidclass.h
+	static const GUID HidInterface = { 0x4D1E55B2, 0xF16F, 0x11CF, { 0x88, 0xCB, 0x00, 0x11, 0x11, 0x00, 0x00, 0x30 } };
+	DEV_BROADCAST_DEVICEINTERFACE filter;
+
+	memset( &filter, 0, sizeof filter );
+	filter.dbcc_size = sizeof filter;
+	filter.dbcc_devicetype = DBT_DEVTYP_DEVICEINTERFACE;
+	filter.dbcc_classguid = HidInterface;
+	g_Recovery.hNotify = RegisterDeviceNotification( hDlg, &filter, DEVICE_NOTIFY_WINDOW_HANDLE );	// else there's DBT_DEVNODES_CHANGED
+
+	g_Recovery.hDlg = hDlg;
+	g_Recovery.lost = 0;
+	if ( (g_Recovery.hWake = CreateEvent( NULL, FALSE, FALSE, NULL )) == NULL ||
+		 (g_Recovery.hStop = CreateEvent( NULL, TRUE, FALSE, NULL )) == NULL ||
+		 (g_Recovery.hThread = CreateThread( NULL, 0, RecoveryThreadProc, NULL, 0, NULL )) == NULL ) {
+		RecoveryStop();
+		return false;
+	}
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Name: RecoveryStop()
+// Desc: Stop the recovery thread. Reads then try the joystick again each time.
+//-----------------------------------------------------------------------------
+void RecoveryStop( void )
+{
+	if ( g_Recovery.hThread != NULL ) {
+		SetEvent( g_Recovery.hStop );
+		WaitForSingleObject( g_Recovery.hThread, INFINITE );
+		CloseHandle( g_Recovery.hThread );
+	}
+	if ( g_Recovery.hWake != NULL )
+		CloseHandle( g_Recovery.hWake );
+	if ( g_Recovery.hStop != NULL )
+		CloseHandle( g_Recovery.hStop );
+	if ( g_Recovery.hNotify != NULL )
+		UnregisterDeviceNotification( g_Recovery.hNotify );
+	g_Recovery.hThread = g_Recovery.hWake = g_Recovery.hStop = NULL;
+	g_Recovery.hNotify = NULL;
+	g_Recovery.lost = 0;
+}
+
+//-----------------------------------------------------------------------------
+// Name: RecoveryLost()
+// Desc: Hand the joystick to the recovery thread, as it can't be read.
+//       Returns false if there's no recovery thread to take it.
+//-----------------------------------------------------------------------------
+bool RecoveryLost( void )
+{
+	if ( g_Recovery.hThread == NULL )
+		return false;
+	if ( InterlockedExchange( &g_Recovery.lost, 1 ) == 0 ) {
+		InterlockedIncrement( &g_Health.disconnects );
+		SetEvent( g_Recovery.hWake );
+	}
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Name: RecoveryThreadProc()
+// Desc: While the joystick's lost, try to acquire it again, waiting longer
+//       each time it fails, or less if a device has just arrived.
+//-----------------------------------------------------------------------------
+DWORD WINAPI RecoveryThreadProc( LPVOID lpParameter )
+{
+	HANDLE events[2] = { g_Recovery.hStop, g_Recovery.hWake };
+	DWORD wait = INFINITE;
+	DWORD woke;
+
+	while ( (woke = WaitForMultipleObjects( 2, events, FALSE, wait )) != WAIT_OBJECT_0 ) {
+		if ( !g_Recovery.lost ) {
+			wait = INFINITE;
+			continue;
+		}
+		if ( woke == WAIT_OBJECT_0 + 1 )
+			wait = INFINITE;		// just lost, or something arrived: start the waits again
+
+		DIJOYSTATE js;
+		HRESULT hr = g_pJoystick->Acquire();
+		if ( SUCCEEDED( hr ) ) {
+			g_pJoystick->Poll();
+			hr = g_pJoystick->GetDeviceState( sizeof js, &js );
+		}
+		if ( FAILED( hr ) ) {
+			wait = wait == INFINITE ? RECOVERY_FIRST_WAIT : min( wait * 2, (DWORD)RECOVERY_MAX_WAIT );
+			continue;
+		}
+
+		InterlockedIncrement( &g_Health.reacquires );
+		InterlockedExchange( &g_Recovery.lost, 0 );
+		wait = INFINITE;
+		if ( !g_bWriting && InterlockedExchange( &g_Idle.posted, 1 ) == 0 )
+			PostMessage( g_Recovery.hDlg, WM_JOYSTICK_CHANGED, 0, 0 );
+	}
+
+	return 0;
+}
+
 //-----------------------------------------------------------------------------
 // Name: ConfigAboutProc
 // Desc: Handles the `About' dialog.
@@ -1219,6 +2965,225 @@ INT_PTR CALLBACK ConfigAboutProc( HWND hDlg, UINT msg, WPARAM wParam, LPARAM lPa
 	return TRUE;
 }
 
+//-----------------------------------------------------------------------------
+// Name: AdvancedDlgProc
+// Desc: Handles the `Advanced' dialog. Changes only go into g_Config; the
+//       config dialog's Save or Cancel decides whether they're kept.
+//-----------------------------------------------------------------------------
+INT_PTR CALLBACK AdvancedDlgProc( HWND hDlg, UINT msg, WPARAM wParam, LPARAM lParam )
+{
+    switch( msg ) 
+    {
+		case WM_CLOSE:
+			EnableWindow( GetWindow( hDlg, GW_OWNER ), TRUE );
+            EndDialog( hDlg, 0 );
+			break;
+
+        case WM_INITDIALOG:
+			{
+				char buf[64];
+				EnableWindow( GetWindow( hDlg, GW_OWNER ), FALSE );
+
+				sprintf(buf, "%u", g_Config.FlushInterval );
+					SetWindowText( GetDlgItem( hDlg, IDC_FLUSH_INTERVAL ), buf );
+				EnableWindow( GetDlgItem( hDlg, IDC_CALIBRATE ), g_pJoystick != NULL && g_bHaveDevice && !g_bRawAxes );
+				sprintf(buf, "%u", g_Config.MaxSessionMins );
+					SetWindowText( GetDlgItem( hDlg, IDC_MAX_SESSION ), buf );
+				sprintf(buf, "%u", g_Config.SegmentMins );
+					SetWindowText( GetDlgItem( hDlg, IDC_SEGMENT_MINS ), buf );
+				sprintf(buf, "%u", g_Config.SegmentMB );
+					SetWindowText( GetDlgItem( hDlg, IDC_SEGMENT_MB ), buf );
+
+			    if ( g_Config.MappedOutput ==  true ) 
+					CheckDlgButton( hDlg, IDC_MAPPED_OUTPUT, BST_CHECKED );
+						else CheckDlgButton( hDlg, IDC_MAPPED_OUTPUT, BST_UNCHECKED );
+			    if ( g_Config.RawAxes ==  true ) 
+					CheckDlgButton( hDlg, IDC_RAW_AXES, BST_CHECKED );
+						else CheckDlgButton( hDlg, IDC_RAW_AXES, BST_UNCHECKED );
+			    if ( g_Config.SharedFeed ==  true ) 
+					CheckDlgButton( hDlg, IDC_SHARED_FEED, BST_CHECKED );
+						else CheckDlgButton( hDlg, IDC_SHARED_FEED, BST_UNCHECKED );
+
+				sprintf(buf, "%u", g_Config.OversampleRate );
+					SetWindowText( GetDlgItem( hDlg, IDC_OVERSAMPLE_RATE ), buf );
+				for ( int i = 0; i < sizeof DecimationFilters / sizeof DecimationFilters[0]; i++ )
+					SendMessage( GetDlgItem( hDlg, IDC_DECIMATION_FILTER ), CB_ADDSTRING, 0, (LPARAM)DecimationFilters[i] );
+				SendMessage( GetDlgItem( hDlg, IDC_DECIMATION_FILTER ), CB_SETCURSEL, g_Config.DecimationFilter, 0 );
+				for ( int i = 0; i < sizeof TimingStrategies / sizeof TimingStrategies[0]; i++ )
+					SendMessage( GetDlgItem( hDlg, IDC_TIMING ), CB_ADDSTRING, 0, (LPARAM)TimingStrategies[i] );
+				SendMessage( GetDlgItem( hDlg, IDC_TIMING ), CB_SETCURSEL, g_Config.TimingStrategy, 0 );
+				for ( int i = 0; i < sizeof SamplerPriorities / sizeof SamplerPriorities[0]; i++ )
+					SendMessage( GetDlgItem( hDlg, IDC_SAMPLER_PRIORITY ), CB_ADDSTRING, 0, (LPARAM)SamplerPriorities[i] );
+				SendMessage( GetDlgItem( hDlg, IDC_SAMPLER_PRIORITY ), CB_SETCURSEL, g_Config.SamplerPriority, 0 );
+				sprintf(buf, "%ld", g_Config.SamplerCore );
+					SetWindowText( GetDlgItem( hDlg, IDC_SAMPLER_CORE ), buf );
+				EnableWindow( GetDlgItem( hDlg, IDC_SAMPLER_PRIORITY ), g_Config.TimingStrategy != TIMING_QUEUE );
+				EnableWindow( GetDlgItem( hDlg, IDC_SAMPLER_CORE ), g_Config.TimingStrategy != TIMING_QUEUE );
+			    if ( g_Config.LockMemory ==  true ) 
+					CheckDlgButton( hDlg, IDC_LOCK_MEMORY, BST_CHECKED );
+						else CheckDlgButton( hDlg, IDC_LOCK_MEMORY, BST_UNCHECKED );
+			    if ( g_Config.EnvelopeColumns ==  true ) 
+					CheckDlgButton( hDlg, IDC_ENVELOPE, BST_CHECKED );
+						else CheckDlgButton( hDlg, IDC_ENVELOPE, BST_UNCHECKED );
+				SetWindowText( GetDlgItem( hDlg, IDC_CONDITIONING ), g_Config.Conditioning );
+
+				sprintf(buf, "%u", g_Config.StreamPort );
+					SetWindowText( GetDlgItem( hDlg, IDC_STREAM_PORT ), buf );
+				sprintf(buf, "%u", g_Config.MarkerPort );
+					SetWindowText( GetDlgItem( hDlg, IDC_MARKER_PORT ), buf );
+			}
+			break;
+
+		case WM_COMMAND:
+            switch( LOWORD(wParam) )
+			{
+				case IDCANCEL:
+				    EnableWindow( GetWindow( hDlg, GW_OWNER ), TRUE );
+                    EndDialog( hDlg, 0 );
+					break;
+
+				case IDC_TIMING:
+					// Only our own thread's priority and processor can be set.
+					if ( HIWORD(wParam) == CBN_SELCHANGE ) {
+						bool own = SendMessage( GetDlgItem( hDlg, IDC_TIMING ), CB_GETCURSEL, 0, 0 ) != TIMING_QUEUE;
+						EnableWindow( GetDlgItem( hDlg, IDC_SAMPLER_PRIORITY ), own );
+						EnableWindow( GetDlgItem( hDlg, IDC_SAMPLER_CORE ), own );
+					}
+					break;
+
+				case IDC_CALIBRATE:
+					DialogBox( g_hInst, MAKEINTRESOURCE(IDD_CALIBRATE), hDlg, CalibrateDlgProc );
+					break;
+
+				case IDOK:
+					{
+						char buf[16];
+
+						GetWindowText( GetDlgItem( hDlg, IDC_FLUSH_INTERVAL ), buf, sizeof buf );
+						if ( atoi(buf) < 0 ) {
+								MessageBox(hDlg, "Flush interval must be greater than or equal to zero.", Title, MB_OK | MB_ICONEXCLAMATION);
+								break;
+						}
+						if ( atoi(buf) > 0 && atoi(buf) < WRITER_PERIOD ) {
+							char text[128];
+							_snprintf(text, sizeof text, "Warning: data can't be forced to disk more often than every %u ms.", WRITER_PERIOD);
+							MessageBox(hDlg, text, Title, MB_OK | MB_ICONWARNING);
+						}
+						g_Config.FlushInterval = atoi(buf);
+
+						GetWindowText( GetDlgItem( hDlg, IDC_MAX_SESSION ), buf, sizeof buf );
+						if ( atoi(buf) < 0 ) {
+								MessageBox(hDlg, "Session length must be greater than or equal to zero.", Title, MB_OK | MB_ICONEXCLAMATION);
+								break;
+						}
+						g_Config.MaxSessionMins = atoi(buf);
+
+						GetWindowText( GetDlgItem( hDlg, IDC_SEGMENT_MINS ), buf, sizeof buf );
+						if ( atoi(buf) < 0 ) {
+								MessageBox(hDlg, "Segment length must be greater than or equal to zero.", Title, MB_OK | MB_ICONEXCLAMATION);
+								break;
+						}
+						g_Config.SegmentMins = atoi(buf);
+
+						GetWindowText( GetDlgItem( hDlg, IDC_SEGMENT_MB ), buf, sizeof buf );
+						if ( atoi(buf) < 0 || atoi(buf) > 4096 ) {
+								MessageBox(hDlg, "Segment size must be between 0 and 4096 MB.", Title, MB_OK | MB_ICONEXCLAMATION);
+								break;
+						}
+						g_Config.SegmentMB = atoi(buf);
+
+						if( IsDlgButtonChecked( hDlg, IDC_MAPPED_OUTPUT ) == BST_CHECKED )
+							g_Config.MappedOutput = true; else g_Config.MappedOutput = false;
+						if ( (IsDlgButtonChecked( hDlg, IDC_RAW_AXES ) == BST_CHECKED) != g_Config.RawAxes ) {
+							g_Config.RawAxes = !g_Config.RawAxes;
+							// The device has to be let go of to change how it reports.
+							if (g_pJoystick != NULL) {
+								g_pJoystick->Unacquire();
+								g_pJoystick->EnumObjects( EnumObjectsCallback, (VOID*)GetWindow( hDlg, GW_OWNER ), DIDFT_AXIS );
+							}
+						}
+						GetWindowText( GetDlgItem( hDlg, IDC_OVERSAMPLE_RATE ), buf, sizeof buf );
+						if ( atoi(buf) < 0 || atoi(buf) > 1000 ) {
+								MessageBox(hDlg, "Internal sampling rate must be between 0 and 1000 Hz.", Title, MB_OK | MB_ICONEXCLAMATION);
+								break;
+						}
+						if ( atoi(buf) > 0 && atoi(buf) < 2 * g_Config.TicksPerSec ) {
+							char text[128];
+							_snprintf(text, sizeof text, "Warning: sampling at %u Hz gives little more than one sample a tick.", atoi(buf));
+							MessageBox(hDlg, text, Title, MB_OK | MB_ICONWARNING);
+						}
+						g_Config.OversampleRate = atoi(buf);
+
+						LRESULT filter = SendMessage( GetDlgItem( hDlg, IDC_DECIMATION_FILTER ), CB_GETCURSEL, 0, 0 );
+						if ( filter != CB_ERR )
+							g_Config.DecimationFilter = (long)filter;
+						LRESULT timing = SendMessage( GetDlgItem( hDlg, IDC_TIMING ), CB_GETCURSEL, 0, 0 );
+						if ( timing != CB_ERR )
+							g_Config.TimingStrategy = (long)timing;
+						GetWindowText( GetDlgItem( hDlg, IDC_SAMPLER_CORE ), buf, sizeof buf );
+						if ( atoi(buf) < -1 || atoi(buf) >= (int)(8 * sizeof(DWORD_PTR)) ) {
+								char text[128];
+								_snprintf(text, sizeof text, "Processor must be -1 (for any), or between 0 and %d.", (int)(8 * sizeof(DWORD_PTR)) -1);
+								MessageBox(hDlg, text, Title, MB_OK | MB_ICONEXCLAMATION);
+								break;
+						}
+						g_Config.SamplerCore = atoi(buf);
+						LRESULT priority = SendMessage( GetDlgItem( hDlg, IDC_SAMPLER_PRIORITY ), CB_GETCURSEL, 0, 0 );
+						if ( priority != CB_ERR )
+							g_Config.SamplerPriority = (long)priority;
+						if( IsDlgButtonChecked( hDlg, IDC_LOCK_MEMORY ) == BST_CHECKED )
+							g_Config.LockMemory = true; else g_Config.LockMemory = false;
+						if( IsDlgButtonChecked( hDlg, IDC_ENVELOPE ) == BST_CHECKED )
+							g_Config.EnvelopeColumns = true; else g_Config.EnvelopeColumns = false;
+
+						{
+							// Check it compiles, at about the rate it'll run at.
+							char spec[sizeof g_Config.Conditioning], err[128], text[256];
+							static CONDCHAIN chain[2];
+							double rate = max( (double)g_Config.OversampleRate, g_Config.TicksPerSec );
+							GetWindowText( GetDlgItem( hDlg, IDC_CONDITIONING ), spec, sizeof spec );
+							if ( spec[0] && !ConditionCompile( spec, rate, g_Config.XYMinMax, chain, err, sizeof err ) ) {
+								_snprintf(text, sizeof text, "Conditioning: %s.", err);
+								MessageBox(hDlg, text, Title, MB_OK | MB_ICONEXCLAMATION);
+								break;
+							}
+							strcpy( g_Config.Conditioning, spec );
+						}
+
+						if( IsDlgButtonChecked( hDlg, IDC_SHARED_FEED ) == BST_CHECKED )
+							g_Config.SharedFeed = true; else g_Config.SharedFeed = false;
+
+						GetWindowText( GetDlgItem( hDlg, IDC_STREAM_PORT ), buf, sizeof buf );
+						if ( atoi(buf) < 0 || atoi(buf) > 65535 ) {
+								MessageBox(hDlg, "Stream port must be between 0 and 65535.", Title, MB_OK | MB_ICONEXCLAMATION);
+								break;
+						}
+						g_Config.StreamPort = atoi(buf);
+
+						GetWindowText( GetDlgItem( hDlg, IDC_MARKER_PORT ), buf, sizeof buf );
+						if ( atoi(buf) < 0 || atoi(buf) > 65535 ) {
+								MessageBox(hDlg, "Marker port must be between 0 and 65535.", Title, MB_OK | MB_ICONEXCLAMATION);
+								break;
+						}
+						g_Config.MarkerPort = atoi(buf);
+
+					    EnableWindow( GetWindow( hDlg, GW_OWNER ), TRUE );
+	                    EndDialog( hDlg, 1 );
+						break;
+					}
+
+				default:
+					return FALSE;
+			}
+			break;
+
+		default:
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
 //-----------------------------------------------------------------------------
 // Name: ConfigDialogProc
 // Desc: Handles dialog messages
@@ -1315,6 +3280,10 @@ INT_PTR CALLBACK ConfigDlgProc( HWND hDlg, UINT msg, WPARAM wParam, LPARAM lPara
 					DialogBox( g_hInst, MAKEINTRESOURCE(IDD_ABOUT), hDlg, ConfigAboutProc );
 					break;
 
+                case IDC_CONFIG_ADVANCED:
+					DialogBox( g_hInst, MAKEINTRESOURCE(IDD_ADVANCED), hDlg, AdvancedDlgProc );
+					break;
+
 				case IDC_CONFIG_CANCEL:
 					LoadConfig(); // kill any changes we made
 				    EnableWindow( GetWindow( hDlg, GW_OWNER ), TRUE );
@@ -1418,6 +3387,7 @@ INT_PTR CALLBACK ConfigDlgProc( HWND hDlg, UINT msg, WPARAM wParam, LPARAM lPara
 							// Try re-init the joystick to pick up the new axes
 							if (g_pJoystick != NULL)
 								g_pJoystick->EnumObjects( EnumObjectsCallback, (VOID*)hDlg, DIDFT_AXIS );
+							CalibrationLoad();
 						}
 
 						GetWindowText( GetDlgItem( hDlg, IDC_GRID_COUNT ), buf, sizeof buf );
@@ -1506,31 +3476,63 @@ BOOL CALLBACK EnumChildProc(HWND hwndChild, LPARAM lParam)
 			rcParent->left + 2,
 			rcParent->top + 2,
 			rcParent->right - 4,
-			rcParent->bottom - 56,
+			rcParent->bottom - (g_Replay.data != NULL ? 84 : 56),
 			TRUE );
 			break;
 
-		// Config button
-		case ID_EDIT_CONFIG:
+		// Replay controls
+		case IDC_REPLAY_POS:
 			MoveWindow( hwndChild,
 			rcParent->left + 5,
-			rcParent->bottom - 50,
-			rcChild.right - rcChild.left,
+			rcParent->bottom - 78,
+			rcParent->right - 85,
 			rcChild.bottom - rcChild.top,
-			!g_bWriting );
+			TRUE );
 			break;
 
-		// Cancel button
-		case IDCANCEL:
+		case IDC_REPLAY_SPEED:
+			{
+				RECT rcWindow;		// the client rect of a combo leaves out the drop down
+				GetWindowRect( hwndChild, &rcWindow );
+				MoveWindow( hwndChild,
+				rcParent->right - 75,
+				rcParent->bottom - 77,
+				rcWindow.right - rcWindow.left,
+				rcWindow.bottom - rcWindow.top,
+				TRUE );
+			}
+			break;
+
+		case IDC_REPLAY:
 			MoveWindow( hwndChild,
-			rcParent->right - 95,
+			(rcParent->right - (rcChild.right - rcChild.left)) / 2,
 			rcParent->bottom - 50,
 			rcChild.right - rcChild.left,
 			rcChild.bottom - rcChild.top,
 			!g_bWriting );
 			break;
 
-		// Message line
+		// Config button
+		case ID_EDIT_CONFIG:
+			MoveWindow( hwndChild,
+			rcParent->left + 5,
+			rcParent->bottom - 50,
+			rcChild.right - rcChild.left,
+			rcChild.bottom - rcChild.top,
+			!g_bWriting );
+			break;
+
+		// Cancel button
+		case IDCANCEL:
+			MoveWindow( hwndChild,
+			rcParent->right - 95,
+			rcParent->bottom - 50,
+			rcChild.right - rcChild.left,
+			rcChild.bottom - rcChild.top,
+			!g_bWriting );
+			break;
+
+		// Message line
 		case IDC_MSGS:
 			MoveWindow( hwndChild,
 			rcParent->left + 5,
@@ -1549,11 +3551,12 @@ BOOL CALLBACK EnumChildProc(HWND hwndChild, LPARAM lParam)
 
 //-----------------------------------------------------------------------------
 // Name: StartWriting()
-// Desc: Initialize for writing to the output file.
+// Desc: Initialize for writing to the output file, and start the writer thread.
 //-----------------------------------------------------------------------------
 bool StartWriting( void )
 {
 	long lResult = 0;
+	DecimatorReset();
 	char buf[MAX_PATH];
 	strncpy(buf, g_Config.FilePattern, sizeof buf);
 	buf[sizeof buf -1] = 0;
@@ -1565,70 +3568,5193 @@ bool StartWriting( void )
 	for ( int i = 0; i < 1000 ; i++ ) {
 		sprintf(p, "%03i", i);
 		if ( access(buf, 0) == -1 && errno == ENOENT ) {
-			if ( (fp = fopen(buf, "w")) != NULL ) {
+			// A mapping needs read access as well as write.
+			if ( (fp = fopen(buf, g_Config.MappedOutput ? "w+" : "w")) != NULL ) {
 				if ( g_Config.ShowFilename )
 					_snprintf(g_MsgText, sizeof g_MsgText, "Writing to %s", buf);
-				if ( g_Config.OutputFileBanner ) {
-					time_t now = time(NULL);
-					struct tm * nowtm = localtime(&now);
-					if ( fprintf(fp, "# File created at %s# Axes maximum value: %u\n# Ticks / second: %0.1lf\n# %s\n",
-							asctime(nowtm), g_Config.XYMinMax, g_Config.TicksPerSec, g_Config.BannerComment ) <= 0 ) {
-						_snprintf(g_MsgText, sizeof g_MsgText, "Error %u writing to output file %s",
-								errno, buf);
-					}
+
+				if ( !ReserveOutput() ) {
+					fclose(fp);
+					fp = NULL;
+					remove(buf);
+					errno = ENOMEM;
+					return false;
+				}
+
+				memset( &g_Block, 0, sizeof g_Block );
+				g_Block.Started = GetTickCount();
+				memset( &g_Health, 0, sizeof g_Health );
+				memset( &g_Ticks, 0, sizeof g_Ticks );
+				_snprintf( g_Health.name, sizeof g_Health.name, "%s%s", buf, HealthExtension );
+				g_Health.name[sizeof g_Health.name -1] = 0;
+				g_Health.saved = GetTickCount();
+				_snprintf( g_SessionInfo.name, sizeof g_SessionInfo.name, "%s%s", buf, InfoExtension );
+				g_SessionInfo.name[sizeof g_SessionInfo.name -1] = 0;
+				g_SessionInfo.started = time(NULL);
+				SegmentReset( buf );
+
+				if ( g_Config.OutputFileBanner && !WriteBanner() ) {
+					_snprintf(g_MsgText, sizeof g_MsgText, "Error %u writing to output file %s",
+							errno, buf);
+				}
+
+				// The writer thread takes it from here. The clock starts now, and
+				// any markers from before are for someone else's session.
+				ResetSessionClock();
+				if ( g_pVirtual != NULL ) {
+					g_VirtualTicks = 0;
+					VirtualReset( *g_pVirtual, g_VirtualSampler );
+				}
+				g_WriteQueue.head = g_WriteQueue.tail = 0;
+				StatsReset();
+				memset( &g_Anchor, 0, sizeof g_Anchor );
+				g_bWriterStop = false;
+				if ( (g_hWriterWake = CreateEvent( NULL, FALSE, FALSE, NULL )) == NULL ||
+					 (g_hWriterThread = CreateThread( NULL, 0, WriterThreadProc, NULL, 0, NULL )) == NULL ) {
+					if ( g_hWriterWake ) { CloseHandle( g_hWriterWake ); g_hWriterWake = NULL; }
+					CloseOutput();
+					remove(buf);
+					return false;
 				}
+
 				g_bWriting = true;
 				return true;
 			}
 		}
 	}
 
-	return false;
+	return false;
+}
+
+//-----------------------------------------------------------------------------
+// Name: StopWriting()
+// Desc: Let the writer thread drain the queue, then close the output file.
+//-----------------------------------------------------------------------------
+void StopWriting( void )
+{
+	g_bWriting = false;
+
+	g_bWriterStop = true;
+	SetEvent( g_hWriterWake );
+	WaitForSingleObject( g_hWriterThread, INFINITE );
+	CloseHandle( g_hWriterThread );
+	CloseHandle( g_hWriterWake );
+	g_hWriterThread = g_hWriterWake = NULL;
+
+	CloseOutput();
+	if ( g_Segment.on )
+		SegmentListed();
+	SessionInfoSave( true );
+	g_MsgText[0] = 0;
+}
+
+//-----------------------------------------------------------------------------
+// Name: WriteBanner()
+// Desc: Write the comment lines that start each file, saying how it was made.
+//-----------------------------------------------------------------------------
+bool WriteBanner( void )
+{
+	char banner[sizeof g_Config.BannerComment + 512 + MAX_PATH];
+	time_t now = time(NULL);
+	struct tm * nowtm = localtime(&now);
+	int len = _snprintf(banner, sizeof banner,
+			"# File created at %s# Axes maximum value: %u\n# Ticks / second: %0.1lf\n# %s\n",
+			asctime(nowtm), g_Config.XYMinMax, g_Config.TicksPerSec, g_Config.BannerComment );
+	if ( len > 0 && g_bRawAxes && g_pVirtual == NULL )
+		len += _snprintf(&banner[len], sizeof banner - len,
+			"%sx %ld..%ld, y %ld..%ld, y down%s; scale with /rescale\n", RawBanner,
+			g_RawMin[0], g_RawMax[0], g_RawMin[1], g_RawMax[1],
+			g_Config.OriginLowerLeft ? ", origin lower left" : "" );
+	else if ( len > 0 && g_Calibration.lut[0] != NULL )
+		len += _snprintf(&banner[len], sizeof banner - len,
+			"# Calibrated: %s, centre %ld,%ld, rest %ld,%ld, x %ld..%ld, y %ld..%ld\n",
+			g_DeviceName, g_Calibration.cal.centre[0], g_Calibration.cal.centre[1],
+			g_Calibration.cal.rest[0], g_Calibration.cal.rest[1],
+			g_Calibration.cal.lowest[0], g_Calibration.cal.highest[0],
+			g_Calibration.cal.lowest[1], g_Calibration.cal.highest[1] );
+	if ( len > 0 && g_Config.OversampleRate > 0 )
+		len += _snprintf(&banner[len], sizeof banner - len,
+			"# Oversampled: %.1lf Hz, %d samples a line, %s filter\n",
+			g_Decimator.rate, g_Decimator.factor, DecimationFilters[g_Decimator.filter] );
+	if ( len > 0 && g_Decimator.conditioning )
+		len += _snprintf(&banner[len], sizeof banner - len,
+			"# Conditioning: %s\n", g_Config.Conditioning );
+	else if ( len > 0 && g_Config.Conditioning[0] )
+		len += _snprintf(&banner[len], sizeof banner - len,
+			"# Conditioning not applied: %s\n", g_Decimator.condition_error );
+	if ( len > 0 && (g_Config.EnvelopeColumns || g_Decimator.conditioning || g_bDeviceColumn) )
+		len += _snprintf(&banner[len], sizeof banner - len,
+			"# Columns after the sample:%s%s%s\n",
+			g_Config.EnvelopeColumns ? " min x, max x, min y, max y" : "",
+			g_Decimator.conditioning ? (g_Config.EnvelopeColumns ? ", raw x, raw y" : " raw x, raw y") : "",
+			g_bDeviceColumn ? (g_Config.EnvelopeColumns || g_Decimator.conditioning ? ", device" : " device") : "" );
+	if ( len > 0 && g_Segment.on )
+		len += _snprintf(&banner[len], sizeof banner - len,
+			"# Segment %d, listed in %s%s\n", g_Segment.n, FileTitle( g_Segment.base ), SegmentExtension );
+
+	return len > 0 && len < (int)sizeof banner && WriteOutput( banner, len );
+}
+
+//-----------------------------------------------------------------------------
+// Name: ReserveOutput()
+// Desc: Grab the space for a new output file up front, so it isn't grown a
+//       line at a time, or set up to write it through a mapping.
+//-----------------------------------------------------------------------------
+bool ReserveOutput( void )
+{
+	HANDLE hFile = (HANDLE)_get_osfhandle( _fileno(fp) );
+
+	if ( g_Config.MappedOutput )
+		return MappedOpen( hFile, ExpectedFileSize() );
+	if ( g_Config.MaxSessionMins > 0 || g_Config.SegmentMins > 0 )
+		PreallocateOutput( hFile, ExpectedFileSize() );	// it's only an optimisation
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Name: SegmentReset()
+// Desc: Set up for a new session written to the named file, splitting it if
+//       the settings say so, and start the manifest afresh.
+//-----------------------------------------------------------------------------
+void SegmentReset( const char * name )
+{
+	memset( &g_Segment, 0, sizeof g_Segment );
+	strncpy( g_Segment.base, name, sizeof g_Segment.base );
+	g_Segment.base[sizeof g_Segment.base -1] = 0;
+	strcpy( g_Segment.name, g_Segment.base );
+	g_Segment.first = -1;
+	g_Segment.length = (LONGLONG)g_Config.SegmentMins * 60 * 1000000;
+	g_Segment.limit = (ULONGLONG)g_Config.SegmentMB << 20;
+	g_Segment.due = g_Segment.length > 0 ? g_Segment.length : _I64_MAX;
+	g_Segment.on = g_Segment.length > 0 || g_Segment.limit > 0;
+
+	if ( g_Segment.on ) {
+		char manifest[MAX_PATH];
+		FILE * out;
+		_snprintf( manifest, sizeof manifest, "%s%s", g_Segment.base, SegmentExtension );
+		manifest[sizeof manifest -1] = 0;
+		if ( (out = fopen( manifest, "w" )) != NULL ) {
+			fprintf( out, "# Segments of %s, added as each is finished\n", FileTitle( g_Segment.base ) );
+			fclose( out );
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Name: SegmentDue()
+// Desc: Whether the sample at this time should start a new segment.
+//-----------------------------------------------------------------------------
+bool SegmentDue( LONGLONG time )
+{
+	return g_Segment.on && g_Segment.lines > 0 &&
+		   (time >= g_Segment.due || (g_Segment.limit > 0 && g_Health.bytes - g_Segment.bytes >= g_Segment.limit));
+}
+
+//-----------------------------------------------------------------------------
+// Name: SegmentNext()
+// Desc: Finish the segment being written, list it in the manifest, and carry
+//       on in a new one, for samples from this time on. If the new file can't
+//       be made the old one carries on, until the next boundary. Runs in the
+//       writer thread.
+//-----------------------------------------------------------------------------
+bool SegmentNext( LONGLONG time )
+{
+	char name[MAX_PATH];
+	FILE * next;
+	int len;
+
+	// The boundaries stay whole multiples of the length, even after a stall.
+	if ( g_Segment.length > 0 && time >= g_Segment.due )
+		g_Segment.due = (time / g_Segment.length + 1) * g_Segment.length;
+
+	// A name cut short by MAX_PATH would be some other file's.
+	len = _snprintf( name, sizeof name, "%s.%03d", g_Segment.base, g_Segment.n + 1 );
+	if ( len < 0 || len >= (int)sizeof name ||
+		 (next = fopen( name, g_Config.MappedOutput ? "w+" : "w" )) == NULL ) {
+		g_Segment.bytes = g_Health.bytes;
+		return false;
+	}
+
+	bool retcode = SyncOutput();
+	CloseOutput();
+	if ( !SegmentListed() )
+		retcode = false;
+
+	fp = next;
+	g_Segment.n++;
+	strcpy( g_Segment.name, name );
+	g_Segment.first = -1;
+	g_Segment.lines = 0;
+	g_Segment.bytes = g_Health.bytes;
+
+	// If it can't be mapped it's written through stdio instead; better that
+	// than losing the rest of the session.
+	if ( !ReserveOutput() )
+		retcode = false;
+	memset( &g_Block, 0, sizeof g_Block );
+	g_Block.Started = GetTickCount();
+	if ( g_Config.OutputFileBanner && !WriteBanner() )
+		retcode = false;
+	AddAnchor();		// so it can be put on the wall clock by itself
+
+	return retcode;
+}
+
+//-----------------------------------------------------------------------------
+// Name: SegmentListed()
+// Desc: Add the segment just finished to the manifest.
+//-----------------------------------------------------------------------------
+bool SegmentListed( void )
+{
+	char manifest[MAX_PATH], times[64] = ",";
+	FILE * out;
+
+	_snprintf( manifest, sizeof manifest, "%s%s", g_Segment.base, SegmentExtension );
+	manifest[sizeof manifest -1] = 0;
+	if ( (out = fopen( manifest, "a" )) == NULL )
+		return false;
+
+	if ( g_Segment.first >= 0 )
+		_snprintf( times, sizeof times, "%.6f,%.6f", g_Segment.first / 1000000.0, g_Segment.last / 1000000.0 );
+	fprintf( out, "%s segment,%s,%ld,%I64u\n%s,%s\n", EventRecord, times, g_Segment.lines,
+			 g_Health.bytes - g_Segment.bytes, FileTitle( g_Segment.name ), FileTitle( g_Segment.base ) );
+
+	bool ok = ferror( out ) == 0;
+	return fclose( out ) == 0 && ok;
+}
+
+//-----------------------------------------------------------------------------
+// Name: FileTitle()
+// Desc: The last part of a path, its file's name.
+//-----------------------------------------------------------------------------
+const char * FileTitle( const char * path )
+{
+	const char * slash = max( strrchr( path, '\\' ), strrchr( path, '/' ) );
+	return slash ? slash + 1 : path;
+}
+
+//-----------------------------------------------------------------------------
+// Name: WriteToFile()
+// Desc: Take a sample and, if it makes a line, queue it for the writer thread.
+//       This runs in the timer callback, so must never wait on the disk.
+//-----------------------------------------------------------------------------
+bool WriteToFile( void )
+{
+    DIJOYSTATE js;           // DInput joystick state
+    HRESULT hr;
+	JOYREC rec, line[2], env[2];
+
+	if ( g_pVirtual != NULL ) {
+		// A scripted device runs on the sample count rather than the clock,
+		// so a recording of one is exactly repeatable.
+		rec.time = (LONGLONG)floor( g_VirtualTicks++ * 1000000.0 / g_Decimator.rate + 0.5 );
+		DWORD pressed = VirtualPoll( *g_pVirtual, g_VirtualSampler, rec.time, js );
+		if ( g_Config.SuppressX == true )
+			js.lX = 0;
+		else if ( g_Config.SuppressY == true )
+			js.lY = 0;
+		if ( g_Config.Button2 && (pressed >> (g_Config.Button2 -1)) & 1 )
+			g_Button2 = true;
+
+	} else {
+		// Which tick this is, going by the time. A late one is still its own
+		// tick until the next is due.
+		LONGLONG now = SessionClock(), period = g_Decimator.period * 1000;
+		if ( g_Health.taken++ == 0 )
+			g_Ticks.start = now;
+		LONGLONG tick = max( g_Ticks.called, (now - g_Ticks.start) / period );
+		g_Health.missed += (LONG)(tick - g_Ticks.called);
+		g_Ticks.called = tick + 1;
+		HealthCount( g_Health.late, now - g_Ticks.start - tick * period );
+
+	    // Get the input's device state. If it's gone, say when, once.
+	    if( FAILED( hr = PollJoystick( js ) ) ) {
+			g_Health.unread++;
+			if ( g_Recovery.lost && !g_Ticks.gone ) {
+				g_Ticks.gone = true;
+				g_Ticks.gonetime = now;
+				QueueEvent( now, JOYREC_DISCONNECT, hr, 0 );
+			}
+	        return false;
+		}
+
+		// Say where samples are missing, before the one after them, and if
+		// that was the joystick being away, that it's back.
+		if ( tick > g_Ticks.read )
+			QueueEvent( g_Ticks.start + g_Ticks.read * period, JOYREC_GAP, (LONG)(tick - g_Ticks.read),
+						(LONG)min( (tick - g_Ticks.read) * period, (LONGLONG)MAXLONG ) );
+		g_Ticks.read = tick + 1;
+		if ( g_Ticks.gone ) {
+			g_Ticks.gone = false;
+			QueueEvent( now, JOYREC_RECONNECT, 0, (LONG)min( now - g_Ticks.gonetime, (LONGLONG)MAXLONG ) );
+		}
+
+		rec.time = SessionClock();
+	}
+
+	rec.type = JOYREC_SAMPLE;
+	rec.flags = 0;
+
+	if ( g_bRawAxes && g_pVirtual == NULL ) {
+		// Just as the device gave it; the reader does the rest.
+		rec.x = js.lX;
+		rec.y = js.lY;
+		rec.flags = JOYREC_RAWUNITS;
+
+	} else {
+		// Constrain the axes if we're not going negative
+		if (g_Config.OriginLowerLeft == true) {
+			if (js.lX < 0) js.lX = 0;
+			if (js.lY > 0) js.lY = 0;	// will flip the sign below
+		}
+
+		rec.x = js.lX;
+		rec.y = -js.lY;		// flip Y axis
+	}
+
+	// Oversampling, so most samples only go into the filter.
+	if ( !Decimate( rec, line, env ) )
+		return true;
+
+	// Report state of extra button if we're watching it.
+	line[0].button = g_Button2;
+	line[0].flags = rec.flags;
+	g_Button2 = false;
+
+	FeedDrain();
+	FeedPublish( line[0] );
+	Publish( line[0] );
+	StatsAdd( line[0] );
+	g_Health.lines++;
+
+	// If the queue is full the writer has fallen too far behind, and data is lost.
+	// The extra columns go first, for the writer to keep until the line comes.
+	bool queued = true;
+	if ( g_Config.EnvelopeColumns &&
+		 (!QueuePut( g_WriteQueue, env[0] ) || !QueuePut( g_WriteQueue, env[1] )) )
+		queued = false;
+	else if ( g_Decimator.conditioning && !QueuePut( g_WriteQueue, line[1] ) )
+		queued = false;
+	else if ( !QueuePut( g_WriteQueue, line[0] ) )
+		queued = false;
+
+	LONG depth = g_WriteQueue.head - g_WriteQueue.tail;
+	if ( depth > g_Health.highwater )
+		g_Health.highwater = depth;
+	if ( !queued )
+		g_Health.dropped++;
+	return queued;
+}
+
+//-----------------------------------------------------------------------------
+// Name: QueueEvent()
+// Desc: Queue an event the sampler's noticed, such as a gap, for the writer,
+//       and pass it on to other programs.
+//-----------------------------------------------------------------------------
+void QueueEvent( LONGLONG time, WORD type, LONG x, LONG y )
+{
+	JOYREC rec;
+
+	rec.time = time;
+	rec.x = x;
+	rec.y = y;
+	rec.type = type;
+	rec.button = 0;
+	rec.flags = 0;
+	FeedPublish( rec );
+	Publish( rec );
+	if ( !QueuePut( g_WriteQueue, rec ) )
+		g_Health.dropped++;
+}
+
+//-----------------------------------------------------------------------------
+// Name: DecimatorReset()
+// Desc: Work out the sampling rate, filter and conditioning for a new session.
+//       The timer only does whole millisecs, so the oversampling rate is
+//       rounded to suit, and to a whole number of samples a tick.
+//-----------------------------------------------------------------------------
+void DecimatorReset( void )
+{
+	static const double pi = 3.141592653589793;
+	int i;
+
+	memset( &g_Decimator, 0, sizeof g_Decimator );
+	g_Decimator.filter = g_Config.DecimationFilter;
+	g_Decimator.factor = 1;
+	g_Decimator.period = (UINT)(1000.0 / g_Config.TicksPerSec);
+	g_Decimator.rate = g_Config.TicksPerSec;
+
+	if ( g_Config.OversampleRate > g_Config.TicksPerSec ) {
+		g_Decimator.period = (UINT)max( 1.0, floor( 1000.0 / g_Config.OversampleRate + 0.5 ) );
+		g_Decimator.rate = 1000.0 / g_Decimator.period;
+		g_Decimator.factor = (int)floor( g_Decimator.rate / g_Config.TicksPerSec + 0.5 );
+		g_Decimator.factor = max( 1, min( g_Decimator.factor, MAX_DECIMATION ) );
+	}
+
+	int R = g_Decimator.factor;
+	if ( R == 1 )
+		g_Decimator.filter = DECIMATE_MEAN;		// of one sample, so nothing to filter
+	switch ( g_Decimator.filter ) {
+		case DECIMATE_CIC:
+			g_Decimator.half = CIC_STAGES * (R - 1);
+			break;
+
+		case DECIMATE_FIR:
+			// Hamming windowed sinc, cut off at the line rate's Nyquist frequency,
+			// scaled for unity gain at DC.
+			{
+				double sum = 0, fc = 0.5 / R;
+				g_Decimator.taps = FIR_SPAN * R + 1;
+				for ( i = 0; i < g_Decimator.taps; i++ ) {
+					double k = i - (g_Decimator.taps - 1) / 2.0;
+					double sinc = k == 0 ? 2 * fc : sin( 2 * pi * fc * k ) / (pi * k);
+					g_Decimator.tap[i] = sinc * (0.54 - 0.46 * cos( 2 * pi * i / (g_Decimator.taps - 1) ));
+					sum += g_Decimator.tap[i];
+				}
+				for ( i = 0; i < g_Decimator.taps; i++ )
+					g_Decimator.tap[i] /= sum;
+				g_Decimator.half = g_Decimator.taps - 1;
+			}
+			break;
+
+		default:
+			g_Decimator.filter = DECIMATE_MEAN;
+			g_Decimator.half = R - 1;
+			break;
+	}
+
+	// A chain that won't compile was let through the dialog somehow; record
+	// without it, and say so in the banner. It works in axis units, so it's
+	// left to whoever scales a raw capture.
+	if ( g_bRawAxes && g_pVirtual == NULL && g_Config.Conditioning[0] != 0 )
+		strcpy( g_Decimator.condition_error, "the axes are raw" );
+	else
+		g_Decimator.conditioning = g_Config.Conditioning[0] != 0 &&
+			ConditionCompile( g_Config.Conditioning, g_Decimator.rate, g_Config.XYMinMax,
+							  g_Chain, g_Decimator.condition_error, sizeof g_Decimator.condition_error );
+	g_Decimator.channels = g_Decimator.conditioning ? 4 : 2;
+}
+
+//-----------------------------------------------------------------------------
+// Name: Decimate()
+// Desc: Add a sample. Once there's a tick's worth, condition them, filter them
+//       down to one line, and return true with the line in out[0], the same
+//       filtering of the raw values in out[1] (if there's conditioning), and
+//       in env the min and max of the tick's worth of samples around it.
+//-----------------------------------------------------------------------------
+bool Decimate( const JOYREC& in, JOYREC out[2], JOYREC env[2] )
+{
+	const int R = g_Decimator.factor;
+	const int channels = g_Decimator.channels;
+	const int raw = g_Decimator.conditioning ? 2 : 0;	// channels the sample goes in
+	const ULONG n = g_Decimator.n;
+	const ULONG mask = DECIMATOR_RING - 1;
+	double filtered[4];
+	int c, i;
+
+	g_Decimator.v[raw][n & mask] = in.x;
+	g_Decimator.v[raw +1][n & mask] = in.y;
+	g_Decimator.time[n & mask] = in.time;
+
+	if ( n == 0 ) {
+		// Start as though the stick had been sitting still here forever, so
+		// the filters don't ramp up from zero.
+		LONG still[4] = { in.x, in.y, in.x, in.y };
+		if ( g_Decimator.conditioning ) {
+			still[0] = ConditionPrime( g_Chain[0], in.x );
+			still[1] = ConditionPrime( g_Chain[1], in.y );
+		}
+		g_Decimator.start = in.time;
+		for ( i = 1; i <= (int)mask; i++ )
+			g_Decimator.time[(n - i) & mask] = in.time - (LONGLONG)floor( i * 1000000.0 / g_Decimator.rate + 0.5 );
+		for ( c = 0; c < channels; c++ ) {
+			for ( i = 1; i <= (int)mask; i++ )
+				g_Decimator.v[c][(n - i) & mask] = still[c];
+			if ( g_Decimator.filter == DECIMATE_CIC ) {
+				for ( i = 0; i < CIC_STAGES * R; i++ ) {
+					ULONGLONG acc = g_Decimator.integ[c][0] += (ULONGLONG)(LONGLONG)still[c];
+					for ( int stage = 1; stage < CIC_STAGES; stage++ )
+						acc = g_Decimator.integ[c][stage] += acc;
+					if ( (i + 1) % R == 0 ) {
+						for ( int stage = 0; stage < CIC_STAGES; stage++ ) {
+							ULONGLONG prev = g_Decimator.comb[c][stage];
+							g_Decimator.comb[c][stage] = acc;
+							acc -= prev;
+						}
+					}
+				}
+			}
+		}
+	}
+	g_Decimator.n++;
+
+	if ( (n + 1) % R != 0 )
+		return false;
+
+	// A tick's worth is in. Condition it a stage at a time...
+	const ULONG first = n + 1 - R;
+	if ( g_Decimator.conditioning ) {
+		LONG batch[MAX_DECIMATION];
+		for ( c = 0; c < 2; c++ ) {
+			for ( i = 0; i < R; i++ )
+				batch[i] = g_Decimator.v[c +2][(first + i) & mask];
+			Condition( g_Chain[c], batch, R, 0, g_Chain[c].stages );
+			for ( i = 0; i < R; i++ )
+				g_Decimator.v[c][(first + i) & mask] = batch[i];
+		}
+	}
+
+	// ...then filter it down to one line.
+	for ( c = 0; c < channels; c++ ) {
+		const LONG * ring = g_Decimator.v[c];
+		switch ( g_Decimator.filter ) {
+			case DECIMATE_MEAN:
+				{
+					LONGLONG sum = 0;
+					for ( i = 0; i < R; i++ )
+						sum += ring[(first + i) & mask];
+					filtered[c] = (double)sum / R;
+				}
+				break;
+
+			case DECIMATE_CIC:
+				{
+					ULONGLONG acc = 0;
+					for ( i = 0; i < R; i++ ) {
+						acc = g_Decimator.integ[c][0] += (ULONGLONG)(LONGLONG)ring[(first + i) & mask];
+						for ( int stage = 1; stage < CIC_STAGES; stage++ )
+							acc = g_Decimator.integ[c][stage] += acc;
+					}
+					for ( int stage = 0; stage < CIC_STAGES; stage++ ) {
+						ULONGLONG prev = g_Decimator.comb[c][stage];
+						g_Decimator.comb[c][stage] = acc;
+						acc -= prev;
+					}
+					filtered[c] = (double)(LONGLONG)acc / pow( (double)R, CIC_STAGES );
+				}
+				break;
+
+			case DECIMATE_FIR:
+				{
+					double acc = 0;
+					for ( i = 0; i < g_Decimator.taps; i++ )
+						acc += g_Decimator.tap[i] * ring[(n - i) & mask];
+					filtered[c] = acc;
+				}
+				break;
+		}
+	}
+
+	// The middle of the filter, which may fall between two samples.
+	ULONG back = (ULONG)g_Decimator.half / 2;
+	LONGLONG time = g_Decimator.time[(n - back) & mask];
+	if ( g_Decimator.half & 1 )
+		time = (time + g_Decimator.time[(n - back - 1) & mask]) / 2;
+
+	// The first line or two would be mostly made up, so aren't written.
+	if ( time < g_Decimator.start )
+		return false;
+
+	env[0].time = env[1].time = time;
+	env[0].type = env[1].type = JOYREC_ENVELOPE;
+	env[0].button = env[1].button = 0;
+	env[0].flags = 0;
+	env[1].flags = JOYREC_MAXIMUM;
+	env[0].x = env[1].x = g_Decimator.v[0][(n - back) & mask];
+	env[0].y = env[1].y = g_Decimator.v[1][(n - back) & mask];
+	for ( ULONG j = n - (g_Decimator.half + R) / 2, end = j + R; j != end; j++ ) {
+		env[0].x = min( env[0].x, g_Decimator.v[0][j & mask] );
+		env[1].x = max( env[1].x, g_Decimator.v[0][j & mask] );
+		env[0].y = min( env[0].y, g_Decimator.v[1][j & mask] );
+		env[1].y = max( env[1].y, g_Decimator.v[1][j & mask] );
+	}
+
+	for ( c = 0; c < channels; c += 2 ) {
+		JOYREC& rec = out[c / 2];
+		rec.time = time;
+		rec.type = c == 0 ? JOYREC_SAMPLE : JOYREC_RAW;
+		rec.button = 0;
+		rec.flags = 0;
+		rec.x = (LONG)floor( filtered[c] + 0.5 );
+		rec.y = (LONG)floor( filtered[c +1] + 0.5 );
+	}
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Name: ConditionCompile()
+// Desc: Turn a conditioning chain's text into stages for each axis. The text
+//       is a comma separated list of stages, applied in order; one starting
+//       x: or y: is for that axis only.
+//
+//       deadzone <units>        zero near the centre, stretching the rest to fit
+//       ema <Hz>                one pole low pass
+//       biquad <Hz> [<Q>]       two pole low pass, Butterworth by default
+//       curve <exponent>        response curve; over 1 is gentler near the centre
+//       jitter <units>          hold still until the stick moves further than this
+//
+//       rate is samples a second and range the axis maximum. Returns false,
+//       with the reason in err, if the text doesn't make sense.
+//-----------------------------------------------------------------------------
+bool ConditionCompile( const char * spec, double rate, LONG range, CONDCHAIN chain[2], char * err, size_t errlen )
+{
+	static const double pi = 3.141592653589793;
+	char item[64], name[16];
+	int curves = 0;
+
+	memset( chain, 0, 2 * sizeof *chain );
+	for ( const char * p = spec; *p; ) {
+		const char * comma = strchr( p, ',' );
+		size_t len = comma ? comma - p : strlen( p );
+		double a, b = 0.7071;
+		int axes = 3;		// bit 0 for x, 1 for y
+
+		_snprintf( item, sizeof item, "%.*s", (int)min( len, sizeof item -1 ), p );
+		item[sizeof item -1] = 0;
+		p += comma ? len + 1 : len;
+
+		char * s = item;
+		while ( isspace( (unsigned char)*s ) ) s++;
+		if ( *s == 0 )
+			continue;
+		if ( (tolower( (unsigned char)s[0] ) == 'x' || tolower( (unsigned char)s[0] ) == 'y') && s[1] == ':' ) {
+			axes = tolower( (unsigned char)s[0] ) == 'x' ? 1 : 2;
+			s += 2;
+		}
+
+		int count = sscanf( s, "%15s %lf %lf", name, &a, &b );
+		CONDSTAGE stage;
+		memset( &stage, 0, sizeof stage );
+
+		if ( count < 2 ) {
+			_snprintf( err, errlen, "`%s' needs a stage and a number", s );
+			return false;
+
+		} else if ( _stricmp( name, "deadzone" ) == 0 ) {
+			if ( a < 0 || a >= range ) {
+				_snprintf( err, errlen, "A dead zone must be between 0 and the axis maximum, %ld", range );
+				return false;
+			}
+			stage.kind = COND_DEADZONE;
+			stage.n = (LONG)a;
+			stage.k[0] = ((LONGLONG)range << 16) / (range - stage.n);
+
+		} else if ( _stricmp( name, "ema" ) == 0 || _stricmp( name, "biquad" ) == 0 ) {
+			if ( a <= 0 || b <= 0 ) {
+				_snprintf( err, errlen, "`%s' needs a cut-off above 0 Hz", s );
+				return false;
+			}
+			a = min( a, 0.45 * rate );		// it can't go above Nyquist
+			if ( tolower( (unsigned char)name[0] ) == 'e' ) {
+				stage.kind = COND_EMA;
+				stage.k[0] = (LONGLONG)floor( 65536.0 * (1 - exp( -2 * pi * a / rate )) + 0.5 );
+			} else {
+				double w0 = 2 * pi * a / rate, alpha = sin( w0 ) / (2 * b), cosw0 = cos( w0 );
+				double a0 = 1 + alpha, scale = (double)(1 << BIQUAD_SHIFT) / a0;
+				stage.kind = COND_BIQUAD;
+				stage.k[0] = (LONGLONG)floor( (1 - cosw0) / 2 * scale + 0.5 );
+				stage.k[1] = (LONGLONG)floor( (1 - cosw0) * scale + 0.5 );
+				stage.k[2] = stage.k[0];
+				stage.k[3] = (LONGLONG)floor( -2 * cosw0 * scale + 0.5 );
+				stage.k[4] = (LONGLONG)floor( (1 - alpha) * scale + 0.5 );
+			}
+
+		} else if ( _stricmp( name, "curve" ) == 0 ) {
+			if ( a < 0.2 || a > 5 ) {
+				_snprintf( err, errlen, "A curve's exponent must be between 0.2 and 5" );
+				return false;
+			}
+			if ( curves == MAX_CURVES ) {
+				_snprintf( err, errlen, "No more than %d curves", MAX_CURVES );
+				return false;
+			}
+			stage.kind = COND_CURVE;
+			stage.n = curves;
+			stage.k[0] = ((LONGLONG)CURVE_POINTS << 32) / range;
+			stage.k[1] = range;
+			for ( int i = 0; i <= CURVE_POINTS; i++ )
+				g_CurveTable[curves][i] = (LONG)floor( range * pow( (double)i / CURVE_POINTS, a ) + 0.5 );
+			curves++;
+
+		} else if ( _stricmp( name, "jitter" ) == 0 ) {
+			if ( a < 0 ) {
+				_snprintf( err, errlen, "Jitter suppression must be 0 or more" );
+				return false;
+			}
+			stage.kind = COND_JITTER;
+			stage.n = (LONG)a;
+
+		} else {
+			_snprintf( err, errlen, "Unknown stage `%s'", name );
+			return false;
+		}
+
+		for ( int axis = 0; axis < 2; axis++ ) {
+			if ( !(axes & (1 << axis)) )
+				continue;
+			if ( chain[axis].stages == MAX_STAGES ) {
+				_snprintf( err, errlen, "No more than %d stages an axis", MAX_STAGES );
+				return false;
+			}
+			chain[axis].stage[chain[axis].stages++] = stage;
+		}
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Name: ConditionPrime()
+// Desc: Set a chain up as though the stick had been at v forever, and return
+//       what it makes of it.
+//-----------------------------------------------------------------------------
+LONG ConditionPrime( CONDCHAIN& chain, LONG v )
+{
+	for ( int i = 0; i < chain.stages; i++ ) {
+		CONDSTAGE& stage = chain.stage[i];
+		stage.s[0] = stage.s[1] = stage.s[2] = stage.s[3] = 0;
+		switch ( stage.kind ) {
+			case COND_EMA:
+				stage.s[0] = (LONGLONG)v << 16;
+				break;
+			case COND_BIQUAD:
+				stage.s[0] = stage.s[1] = stage.s[2] = stage.s[3] = (LONGLONG)v << 8;
+				break;
+			case COND_JITTER:
+				stage.s[0] = v;
+				break;
+			default:
+				Condition( chain, &v, 1, i, i + 1 );
+				break;
+		}
+	}
+	return v;
+}
+
+//-----------------------------------------------------------------------------
+// Name: Condition()
+// Desc: Put n samples of an axis through stages [first, last) of its chain,
+//       in place, a stage at a time. All fixed point, with no division.
+//-----------------------------------------------------------------------------
+void Condition( CONDCHAIN& chain, LONG * v, int n, int first, int last )
+{
+	int i;
+
+	for ( int st = first; st < last; st++ ) {
+		CONDSTAGE& stage = chain.stage[st];
+		LONGLONG * k = stage.k, * s = stage.s;
+
+		switch ( stage.kind ) {
+			case COND_DEADZONE:
+				for ( i = 0; i < n; i++ ) {
+					LONG a = v[i] < 0 ? -v[i] : v[i];
+					a = a <= stage.n ? 0 : (LONG)(((a - stage.n) * k[0]) >> 16);
+					v[i] = v[i] < 0 ? -a : a;
+				}
+				break;
+
+			case COND_EMA:		// s[0] is the output, with 16 bits of fraction
+				for ( i = 0; i < n; i++ ) {
+					s[0] += (k[0] * (((LONGLONG)v[i] << 16) - s[0])) >> 16;
+					v[i] = (LONG)((s[0] + 0x8000) >> 16);
+				}
+				break;
+
+			case COND_BIQUAD:	// direct form I; s[] are the last two in and out, with 8 bits of fraction
+				for ( i = 0; i < n; i++ ) {
+					LONGLONG x = (LONGLONG)v[i] << 8;
+					LONGLONG y = (k[0] * x + k[1] * s[0] + k[2] * s[1] - k[3] * s[2] - k[4] * s[3]) >> BIQUAD_SHIFT;
+					s[1] = s[0];
+					s[0] = x;
+					s[3] = s[2];
+					s[2] = y;
+					v[i] = (LONG)((y + 0x80) >> 8);
+				}
+				break;
+
+			case COND_CURVE:	// interpolated from the table, by 16 bits of fraction
+				for ( i = 0; i < n; i++ ) {
+					const LONG * table = g_CurveTable[stage.n];
+					LONGLONG a = v[i] < 0 ? -(LONGLONG)v[i] : v[i];
+					if ( a > k[1] ) a = k[1];
+					LONGLONG pos = (a * k[0]) >> 16;
+					int at = (int)(pos >> 16);
+					LONG out = at >= CURVE_POINTS ? table[CURVE_POINTS] :
+						table[at] + (LONG)(((table[at +1] - table[at]) * (pos & 0xFFFF)) >> 16);
+					v[i] = v[i] < 0 ? -out : out;
+				}
+				break;
+
+			case COND_JITTER:	// s[0] is where it's being held
+				for ( i = 0; i < n; i++ ) {
+					if ( v[i] - s[0] > stage.n || s[0] - v[i] > stage.n )
+						s[0] = v[i];
+					v[i] = (LONG)s[0];
+				}
+				break;
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Name: QueuePut()
+// Desc: Add a record to a queue. There must only be one thread putting.
+//       Returns false if the queue is full.
+//-----------------------------------------------------------------------------
+bool QueuePut( RECQUEUE& q, const JOYREC& rec )
+{
+	ULONG head = (ULONG)q.head;
+
+	if ( head - (ULONG)q.tail >= QUEUE_SIZE )
+		return false;
+
+	q.rec[head & (QUEUE_SIZE -1)] = rec;
+
+	// The interlocked op is a full barrier, so the record is visible before the new head.
+	InterlockedExchange( &q.head, (LONG)(head + 1) );
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Name: QueueGet()
+// Desc: Take the oldest record off a queue. There must only be one thread getting.
+//       Returns false if the queue is empty.
+//-----------------------------------------------------------------------------
+bool QueueGet( RECQUEUE& q, JOYREC& rec )
+{
+	ULONG tail = (ULONG)q.tail;
+
+	if ( tail == (ULONG)q.head )
+		return false;
+
+	rec = q.rec[tail & (QUEUE_SIZE -1)];
+	InterlockedExchange( &q.tail, (LONG)(tail + 1) );
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Name: WriterThreadProc()
+// Desc: Drains the sample queue into the output file, and periodically closes
+//       off a block and forces it to disk. Runs until StopWriting() says so.
+//-----------------------------------------------------------------------------
+DWORD WINAPI WriterThreadProc( LPVOID lpParameter )
+{
+	JOYREC rec;
+	bool held = false;		// rec is off the queue, but too new to write yet
+
+	// Any markers still queued are from the last session, and on its clock.
+	// The marker thread may be queueing more, so they're taken off the queue
+	// the usual way, here, rather than the queue being reset under it.
+	g_nPendingMarkers = 0;
+	TakeMarkers();
+	g_nPendingMarkers = 0;
+	g_MarkersAfter = 0;
+
+	for (;;) {
+		WaitForSingleObject( g_hWriterWake, WRITER_PERIOD );
+
+		// Note this before draining, so nothing queued before the stop is missed.
+		bool stopping = g_bWriterStop;
+
+		if ( stopping || g_Anchor.n == 0 || GetTickCount() - g_Anchor.Last >= ANCHOR_PERIOD )
+			AddAnchor();
+
+		// Whatever was stamped before the horizon and is going to be queued, has been.
+		LONGLONG horizon = _I64_MAX;
+		if ( !stopping && g_hMarkerThread != NULL )
+			horizon = SessionClock() - MARKER_LATENCY * 1000;
+		TakeMarkers();
+
+		LONGLONG now = SessionClock();
+		while ( held || QueueGet( g_WriteQueue, rec ) ) {
+			if ( rec.time > horizon ) {
+				held = true;
+				break;
+			}
+			held = false;
+
+			// A segment starts with a sample, so markers from before it go in
+			// the last one, and the rest by time after it.
+			if ( rec.type == JOYREC_SAMPLE && SegmentDue( rec.time ) ) {
+				if ( !WriteMarkers( rec.time - 1 ) )
+					g_Health.writeerrors++;
+				if ( !SegmentNext( rec.time ) )
+					g_Health.writeerrors++;
+			}
+
+			if ( !WriteMarkers( rec.time ) || !WriteRecord( rec ) ) {
+				g_Health.writeerrors++;
+			} else if ( rec.type == JOYREC_SAMPLE ) {
+				g_Health.written++;
+				HealthCount( g_Health.latency, now - rec.time );
+				g_MarkersAfter = rec.time;
+				if ( g_Segment.first < 0 )
+					g_Segment.first = rec.time;
+				g_Segment.last = rec.time;
+				g_Segment.lines++;
+			}
+		}
+		if ( !WriteMarkers( horizon ) )
+			g_Health.writeerrors++;
+
+		if ( stopping ||
+			 (g_Config.FlushInterval > 0 && GetTickCount() - g_Block.Started >= (DWORD)g_Config.FlushInterval) ) {
+			if ( !SyncOutput() )
+				g_Health.writeerrors++;
+		}
+
+		// It's only for watching, so failing to write it doesn't matter.
+		if ( stopping || GetTickCount() - g_Health.saved >= HEALTH_PERIOD )
+			HealthSave();
+
+		if ( stopping )
+			break;
+	}
+
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// Name: WriteRecord()
+// Desc: Format one record as a line of the output file.
+//-----------------------------------------------------------------------------
+bool WriteRecord( const JOYREC& rec )
+{
+	static JOYREC envelope[2], raw;		// for the next sample
+	char line[128];
+	int len;
+	double elapsed = (double)rec.time / 1000000.0;
+
+	if ( rec.type == JOYREC_ENVELOPE )
+		envelope[(rec.flags & JOYREC_MAXIMUM) ? 1 : 0] = rec;
+	if ( rec.type == JOYREC_RAW )
+		raw = rec;
+	if ( rec.type == JOYREC_GAP ) {
+		// It may be ahead of lines still in the filter, so it goes in by
+		// time, like a marker.
+		MARKER m;
+		m.time = rec.time;
+		m.type = "gap";
+		_snprintf( m.text, sizeof m.text, "%.6f,%ld", (double)rec.y / 1000000.0, rec.x );
+		m.text[sizeof m.text -1] = 0;
+		AddPending( m );
+	}
+	if ( rec.type == JOYREC_DISCONNECT || rec.type == JOYREC_RECONNECT ) {
+		MARKER m;
+		m.time = rec.time;
+		if ( rec.type == JOYREC_DISCONNECT ) {
+			m.type = "disconnect";
+			_snprintf( m.text, sizeof m.text, "%08lx", (unsigned long)rec.x );
+		} else {
+			m.type = "reconnect";
+			_snprintf( m.text, sizeof m.text, "%.6f", (double)rec.y / 1000000.0 );
+		}
+		m.text[sizeof m.text -1] = 0;
+		AddPending( m );
+	}
+	if ( rec.type != JOYREC_SAMPLE )
+		return true;
+
+	if ( g_Config.Button2 )
+		len = _snprintf( line, sizeof line, "%6.3f,%5ld,%5ld,%2i", elapsed, rec.x, rec.y, rec.button );
+	else
+		len = _snprintf( line, sizeof line, "%6.3f,%5ld,%5ld", elapsed, rec.x, rec.y );
+
+	if ( len > 0 && g_Config.EnvelopeColumns )
+		len += _snprintf( &line[len], sizeof line - len, ",%5ld,%5ld,%5ld,%5ld",
+						  envelope[0].x, envelope[1].x, envelope[0].y, envelope[1].y );
+	if ( len > 0 && g_Decimator.conditioning )
+		len += _snprintf( &line[len], sizeof line - len, ",%5ld,%5ld", raw.x, raw.y );
+	if ( len > 0 && g_bDeviceColumn )
+		len += _snprintf( &line[len], sizeof line - len, ",%2lu", (unsigned long)(rec.flags >> JOYREC_DEVICESHIFT) );
+	if ( len > 0 )
+		line[len++] = '\n';
+
+	return len > 0 && WriteOutput( line, len );
+}
+
+//-----------------------------------------------------------------------------
+// Name: WriteOutput()
+// Desc: Write text to the output file, adding it to the current block.
+//-----------------------------------------------------------------------------
+bool WriteOutput( const char * buf, size_t len )
+{
+	g_Block.Crc = Crc32c( g_Block.Crc, buf, len );
+	for ( const char * p = buf; (p = (const char *)memchr( p, '\n', buf + len - p )) != NULL; p++ )
+		g_Block.Lines++;
+
+	return PutOutput( buf, len );
+}
+
+//-----------------------------------------------------------------------------
+// Name: PutOutput()
+// Desc: Write text to whichever output we're using, outside of any block.
+//-----------------------------------------------------------------------------
+bool PutOutput( const char * buf, size_t len )
+{
+	g_Health.bytes += len;
+
+	if ( g_Mapped.hMap != NULL )
+		return MappedWrite( buf, len );
+
+	return fwrite( buf, 1, len, fp ) == len;
+}
+
+//-----------------------------------------------------------------------------
+// Name: SyncOutput()
+// Desc: Close off the current block with a trailer, and force everything
+//       through stdio and the OS cache onto the disk.
+//-----------------------------------------------------------------------------
+bool SyncOutput( void )
+{
+	bool retcode = true;
+
+	if ( g_Block.Lines > 0 ) {
+		char trailer[96];
+		int len = _snprintf( trailer, sizeof trailer, "%s %lu, %lu lines, crc32c %08lx\n",
+							BlockTrailer, g_Block.Number, g_Block.Lines, g_Block.Crc );
+		if ( len <= 0 || !PutOutput( trailer, len ) )
+			retcode = false;
+		g_Block.Number++;
+		g_Block.Lines = 0;
+		g_Block.Crc = 0;
+	}
+
+	if ( g_Mapped.hMap != NULL ) {
+		if ( !MappedSync() )
+			retcode = false;
+	} else if ( fflush( fp ) != 0 || _commit( _fileno( fp ) ) != 0 ) {
+		retcode = false;
+	}
+
+	g_Block.Started = GetTickCount();
+	return retcode;
+}
+
+//-----------------------------------------------------------------------------
+// Name: CloseOutput()
+// Desc: Close the output file, cutting off any space allocated but not used.
+//-----------------------------------------------------------------------------
+void CloseOutput( void )
+{
+	if ( g_Mapped.hMap != NULL ) {
+		MappedClose();
+	} else {
+		// The OS file pointer is at the end of what we wrote once stdio is flushed.
+		fflush(fp);
+		SetEndOfFile( (HANDLE)_get_osfhandle( _fileno(fp) ) );
+	}
+
+	fclose(fp);
+	fp = NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Name: HealthCount()
+// Desc: Count a latency, or lateness, in one of the histograms.
+//-----------------------------------------------------------------------------
+void HealthCount( LONG * hist, LONGLONG micros )
+{
+	unsigned long bucket = 0;
+
+	if ( micros > 0 ) {
+		_BitScanReverse( &bucket, (unsigned long)min( micros, (LONGLONG)MAXLONG ) );
+		bucket++;
+	}
+	hist[min( bucket, LATENCY_BUCKETS -1 )]++;
+}
+
+//-----------------------------------------------------------------------------
+// Name: HealthPercentile()
+// Desc: The latency, in microsecs, of the fraction p of what's in a histogram.
+//       It's the top of the bucket it falls in, so is within a factor of two.
+//-----------------------------------------------------------------------------
+LONGLONG HealthPercentile( const LONG * hist, double p )
+{
+	LONGLONG total = 0, seen = 0;
+	int i;
+
+	for ( i = 0; i < LATENCY_BUCKETS; i++ )
+		total += hist[i];
+	if ( total == 0 )
+		return 0;
+
+	for ( i = 0; i < LATENCY_BUCKETS -1; i++ ) {
+		if ( (seen += hist[i]) >= p * total )
+			break;
+	}
+	return i == 0 ? 0 : (LONGLONG)1 << i;
+}
+
+//-----------------------------------------------------------------------------
+// Name: HealthSummary()
+// Desc: A few words for the status line on how recording is going.
+//-----------------------------------------------------------------------------
+void HealthSummary( char * buf, size_t len )
+{
+	LONG lost = g_Health.unread + g_Health.dropped;
+
+	_snprintf( buf, len, "%ld lines, %ld missed, %ld lost", g_Health.written, g_Health.missed, lost );
+	if ( g_Health.writeerrors > 0 ) {
+		size_t used = strlen( buf );
+		_snprintf( &buf[used], len - used, ", %ld WRITE ERRORS", g_Health.writeerrors );
+	}
+	if ( g_Health.disconnects > 0 ) {
+		size_t used = strlen( buf );
+		_snprintf( &buf[used], len - used, ", %ld disconnects", g_Health.disconnects );
+	}
+	buf[len -1] = 0;
+}
+
+//-----------------------------------------------------------------------------
+// Name: HealthSave()
+// Desc: Write the health counters to the .stats file, replacing what was
+//       there. The writer thread does this every so often, and when it stops.
+//-----------------------------------------------------------------------------
+bool HealthSave( void )
+{
+	FILE * out;
+
+	g_Health.saved = GetTickCount();
+	if ( g_Health.name[0] == 0 || (out = fopen( g_Health.name, "w" )) == NULL )
+		return false;
+
+	fprintf( out, "# Recorder health at %.3f s\n", SessionClock() / 1000000.0 );
+	fprintf( out, "Samples taken: %ld\n", g_Health.taken );
+	fprintf( out, "Ticks missed: %ld\n", g_Health.missed );
+	fprintf( out, "Samples unread: %ld\n", g_Health.unread );
+	fprintf( out, "Lines queued: %ld\n", g_Health.lines );
+	fprintf( out, "Lines written: %ld\n", g_Health.written );
+	fprintf( out, "Records dropped: %ld\n", g_Health.dropped );
+	fprintf( out, "Queue high water: %ld of %d\n", g_Health.highwater, QUEUE_SIZE );
+	fprintf( out, "Reacquires: %ld\n", g_Health.reacquires );
+	fprintf( out, "Disconnects: %ld\n", g_Health.disconnects );
+	fprintf( out, "Feed events dropped: %ld\n", g_Health.feeddropped );
+	fprintf( out, "Markers dropped: %ld\n", g_Health.markersdropped );
+	fprintf( out, "Stream records dropped: %ld\n", g_Health.streamdropped );
+	fprintf( out, "Write errors: %ld\n", g_Health.writeerrors );
+	fprintf( out, "Bytes written: %I64u\n", g_Health.bytes );
+	if ( g_Segment.on )
+		fprintf( out, "Segments: %d\n", g_Segment.n + 1 );
+	for ( int i = 0; i < 2; i++ ) {
+		const LONG * hist = i == 0 ? g_Health.latency : g_Health.late;
+		fprintf( out, "%s (ms): 50%% %.3f, 90%% %.3f, 99%% %.3f, 99.9%% %.3f, max %.3f\n",
+			i == 0 ? "Write latency" : "Tick lateness",
+			HealthPercentile( hist, 0.5 ) / 1000.0, HealthPercentile( hist, 0.9 ) / 1000.0,
+			HealthPercentile( hist, 0.99 ) / 1000.0, HealthPercentile( hist, 0.999 ) / 1000.0,
+			HealthPercentile( hist, 1.0 ) / 1000.0 );
+	}
+
+	// How much of a core the sampler's taking, and for the sleep-then-spin
+	// timing how much of that is spinning.
+	double secs = SessionClock() / 1000000.0;
+	bool spin = g_Config.TimingStrategy == TIMING_SPIN;
+	long timing = max( 0L, min( g_Config.TimingStrategy, (long)(sizeof TimingStrategies / sizeof TimingStrategies[0]) -1 ) );
+	fprintf( out, "Timing: %s", TimingStrategies[timing] );
+	if ( secs > 0 )
+		fprintf( out, ", sampling %.1f%% of a core", 100.0 * (g_Health.busy + g_Sampler.wait.spun) / secs );
+	if ( spin && secs > 0 )
+		fprintf( out, ", %.1f%% spinning, margin %.3f ms", 100.0 * g_Sampler.wait.spun / secs, g_Sampler.wait.margin / 1000.0 );
+	if ( g_Sampler.tuning[0] )
+		fprintf( out, "; %s", g_Sampler.tuning );
+	fprintf( out, "\n" );
+
+	// How long the program took to come up, which the joystick can hold up.
+	if ( g_pVirtual == NULL )
+		fprintf( out, "Startup: window in %.0f ms, joystick ready in %.0f ms (%s)\n", g_Device.shown, g_Device.found,
+			g_Device.cached ? "the one used last time" : "looked for" );
+
+	bool ok = ferror( out ) == 0;
+	return fclose( out ) == 0 && ok;
+}
+
+//-----------------------------------------------------------------------------
+// Name: JsonString()
+// Desc: Write text as a JSON string, quoted and escaped. The text is in the
+//       ANSI code page, so anything past ASCII (a name with an accent in it,
+//       say) is written as \u escapes of its UTF-16, which JSON takes as is.
+//-----------------------------------------------------------------------------
+static void JsonString( FILE * out, const char * s )
+{
+	int len = MultiByteToWideChar( CP_ACP, 0, s, -1, NULL, 0 );
+	WCHAR * wide = len > 0 ? (WCHAR *)malloc( len * sizeof *wide ) : NULL;
+
+	if ( wide == NULL || MultiByteToWideChar( CP_ACP, 0, s, -1, wide, len ) == 0 ) {
+		free( wide );
+		fputs( "\"\"", out );
+		return;
+	}
+
+	fputc( '"', out );
+	for ( const WCHAR * w = wide; *w; w++ ) {
+		if ( *w == '"' || *w == '\\' )
+			fprintf( out, "\\%c", (char)*w );
+		else if ( *w < 0x20 || *w >= 0x80 )
+			fprintf( out, "\\u%04x", (unsigned)*w );
+		else
+			fputc( (char)*w, out );
+	}
+	fputc( '"', out );
+	free( wide );
+}
+
+//-----------------------------------------------------------------------------
+// Name: JsonTime()
+// Desc: Write a wall clock time as a JSON string, in ISO 8601 UTC.
+//-----------------------------------------------------------------------------
+static void JsonTime( FILE * out, time_t t )
+{
+	char buf[32];
+	struct tm * tm = gmtime( &t );
+
+	if ( tm == NULL || strftime( buf, sizeof buf, "%Y-%m-%dT%H:%M:%SZ", tm ) == 0 )
+		fputs( "null", out );
+	else
+		fprintf( out, "\"%s\"", buf );
+}
+
+//-----------------------------------------------------------------------------
+// Name: SessionInfoSave()
+// Desc: Write the session's JSON sidecar; with finished, the counters as well.
+//       It's written to a temporary file then put in place, so a reader never
+//       sees half of one.
+//-----------------------------------------------------------------------------
+bool SessionInfoSave( bool finished )
+{
+	char tmpname[MAX_PATH + 8];
+	FILE * out;
+	int i;
+
+	if ( g_SessionInfo.name[0] == 0 )
+		return false;
+	_snprintf( tmpname, sizeof tmpname, "%s.tmp", g_SessionInfo.name );
+	tmpname[sizeof tmpname -1] = 0;
+	if ( (out = fopen( tmpname, "w" )) == NULL )
+		return false;
+
+	// The settings, by their names in the registry.
+	const struct { const char * name; bool value; } bools[] = {
+		{ "ShowAxes", g_Config.ShowAxes }, { "ShowFileName", g_Config.ShowFilename },
+		{ "OutputFileBanner", g_Config.OutputFileBanner }, { "OriginLowerLeft", g_Config.OriginLowerLeft },
+		{ "DrawOctants", g_Config.DrawOctants }, { "RememberWindow", g_Config.RememberWindow },
+		{ "SoundFeedback", g_Config.SoundFeedback }, { "SuppressX", g_Config.SuppressX },
+		{ "SuppressY", g_Config.SuppressY }, { "MappedOutput", g_Config.MappedOutput },
+		{ "SharedFeed", g_Config.SharedFeed }, { "LockMemory", g_Config.LockMemory },
+		{ "EnvelopeColumns", g_Config.EnvelopeColumns }, { "RawAxes", g_Config.RawAxes },
+	};
+	const struct { const char * name; long value; } longs[] = {
+		{ "EllipseSize", g_Config.EllipseSize }, { "XYMinMax", g_Config.XYMinMax },
+		{ "GridCount", g_Config.GridCount }, { "TickCount", g_Config.TickCount },
+		{ "JoystickButton", g_Config.JoystickButton }, { "Button2", g_Config.Button2 },
+		{ "WindowPositionX", g_Config.WPosnX }, { "WindowPositionY", g_Config.WPosnY },
+		{ "WindowSizeX", g_Config.WSizeX }, { "WindowSizeY", g_Config.WSizeY },
+		{ "FlushInterval", g_Config.FlushInterval }, { "MaxSessionMins", g_Config.MaxSessionMins },
+		{ "SegmentMins", g_Config.SegmentMins }, { "SegmentMB", g_Config.SegmentMB },
+		{ "StreamPort", g_Config.StreamPort }, { "MarkerPort", g_Config.MarkerPort },
+		{ "OversampleRate", g_Config.OversampleRate }, { "DecimationFilter", g_Config.DecimationFilter },
+		{ "TimingStrategy", g_Config.TimingStrategy }, { "SamplerPriority", g_Config.SamplerPriority },
+		{ "SamplerCore", g_Config.SamplerCore },
+	};
+	const struct { const char * name; const char * value; } texts[] = {
+		{ "FilePattern", g_Config.FilePattern }, { "BannerComment", g_Config.BannerComment },
+		{ "Conditioning", g_Config.Conditioning },
+		{ "LabelPosX", g_Config.LabelPosX }, { "LabelNegX", g_Config.LabelNegX },
+		{ "LabelPosY", g_Config.LabelPosY }, { "LabelNegY", g_Config.LabelNegY },
+		{ "LabelTopLeft", g_Config.LabelTopLeft }, { "LabelTopRight", g_Config.LabelTopRight },
+		{ "LabelBottomRight", g_Config.LabelBottomRight }, { "LabelBottomLeft", g_Config.LabelBottomLeft },
+	};
+
+	fprintf( out, "{\n\t\"program\": " );
+	JsonString( out, Title );
+	fprintf( out, ",\n\t\"version\": " );
+	JsonString( out, g_Version + strlen( "Version: " ) );
+	fprintf( out, ",\n\t\"file\": " );
+	JsonString( out, FileTitle( g_Segment.base ) );
+	fprintf( out, ",\n\t\"started\": " );
+	JsonTime( out, g_SessionInfo.started );
+	fprintf( out, ",\n\t\"finished\": " );
+	if ( finished )
+		JsonTime( out, time(NULL) );
+	else
+		fputs( "null", out );
+	if ( g_Segment.on ) {
+		char manifest[MAX_PATH];
+		_snprintf( manifest, sizeof manifest, "%s%s", FileTitle( g_Segment.base ), SegmentExtension );
+		manifest[sizeof manifest -1] = 0;
+		fprintf( out, ",\n\t\"segments\": { \"manifest\": " );
+		JsonString( out, manifest );
+		fprintf( out, ", \"count\": %d }", g_Segment.n + 1 );
+	}
+
+	// What was recorded from.
+	fprintf( out, ",\n\t\"device\": {\n\t\t\"virtual\": %s", g_pVirtual != NULL ? "true" : "false" );
+	if ( g_pVirtual == NULL && g_bHaveDevice ) {
+		const GUID& guid = g_DeviceGuid;
+		DIDEVCAPS dc;
+		fprintf( out, ",\n\t\t\"name\": " );
+		JsonString( out, g_DeviceName );
+		fprintf( out, ",\n\t\t\"guid\": \"{%08lX-%04X-%04X-%02X%02X-%02X%02X%02X%02X%02X%02X}\"",
+			guid.Data1, guid.Data2, guid.Data3, guid.Data4[0], guid.Data4[1], guid.Data4[2],
+			guid.Data4[3], guid.Data4[4], guid.Data4[5], guid.Data4[6], guid.Data4[7] );
+		dc.dwSize = sizeof dc;
+		if ( g_pJoystick != NULL && g_pJoystick->GetCapabilities( &dc ) == DI_OK )
+			fprintf( out, ",\n\t\t\"capabilities\": { \"type\": %lu, \"flags\": %lu, \"axes\": %lu, \"buttons\": %lu, \"povs\": %lu }",
+				dc.dwDevType, dc.dwFlags, dc.dwAxes, dc.dwButtons, dc.dwPOVs );
+	}
+	if ( g_pVirtual == NULL && g_bRawAxes )
+		fprintf( out, ",\n\t\t\"raw\": { \"x\": [%ld, %ld], \"y\": [%ld, %ld] }",
+			g_RawMin[0], g_RawMax[0], g_RawMin[1], g_RawMax[1] );
+	else if ( g_pVirtual == NULL && g_Calibration.lut[0] != NULL )
+		fprintf( out, ",\n\t\t\"calibration\": { \"centre\": [%ld, %ld], \"rest\": [%ld, %ld], \"x\": [%ld, %ld], \"y\": [%ld, %ld] }",
+			g_Calibration.cal.centre[0], g_Calibration.cal.centre[1], g_Calibration.cal.rest[0], g_Calibration.cal.rest[1],
+			g_Calibration.cal.lowest[0], g_Calibration.cal.highest[0], g_Calibration.cal.lowest[1], g_Calibration.cal.highest[1] );
+	fprintf( out, "\n\t}" );
+
+	// How it was timed. The resolution is what timeBeginPeriod() was given,
+	// which is none if nothing was sampled through the sampler.
+	long timing = max( 0L, min( g_Config.TimingStrategy, (long)(sizeof TimingStrategies / sizeof TimingStrategies[0]) -1 ) );
+	fprintf( out, ",\n\t\"timer\": {\n\t\t\"strategy\": " );
+	JsonString( out, TimingStrategies[timing] );
+	if ( g_Sampler.resolution > 0 )
+		fprintf( out, ",\n\t\t\"resolution_ms\": %u", g_Sampler.resolution );
+	else
+		fprintf( out, ",\n\t\t\"resolution_ms\": null" );
+	fprintf( out, ",\n\t\t\"period_ms\": %u,\n\t\t\"sample_hz\": %.6g,\n\t\t\"line_hz\": %.6g,\n\t\t\"samples_per_line\": %d,\n\t\t\"filter\": ",
+		g_Decimator.period, g_Decimator.rate, g_Config.TicksPerSec, g_Decimator.factor );
+	JsonString( out, DecimationFilters[g_Decimator.filter] );
+	fprintf( out, ",\n\t\t\"counter_hz\": %I64d,\n\t\t\"sampler\": ", g_qpcfreq );
+	JsonString( out, g_Sampler.tuning );
+	fprintf( out, "\n\t}" );
+
+	fprintf( out, ",\n\t\"config\": {" );
+	for ( i = 0; i < (int)(sizeof bools / sizeof bools[0]); i++ )
+		fprintf( out, "%s\n\t\t\"%s\": %s", i ? "," : "", bools[i].name, bools[i].value ? "true" : "false" );
+	for ( i = 0; i < (int)(sizeof longs / sizeof longs[0]); i++ )
+		fprintf( out, ",\n\t\t\"%s\": %ld", longs[i].name, longs[i].value );
+	fprintf( out, ",\n\t\t\"TicksPerSec\": %.6g", g_Config.TicksPerSec );
+	for ( i = 0; i < (int)(sizeof texts / sizeof texts[0]); i++ ) {
+		fprintf( out, ",\n\t\t\"%s\": ", texts[i].name );
+		JsonString( out, texts[i].value );
+	}
+	fprintf( out, "\n\t}" );
+
+	// How it went, as in the .stats file.
+	if ( finished ) {
+		double secs = SessionClock() / 1000000.0;
+		fprintf( out, ",\n\t\"counters\": {\n" );
+		fprintf( out, "\t\t\"seconds\": %.6f,\n", secs );
+		fprintf( out, "\t\t\"samples_taken\": %ld,\n", g_Health.taken );
+		fprintf( out, "\t\t\"ticks_missed\": %ld,\n", g_Health.missed );
+		fprintf( out, "\t\t\"samples_unread\": %ld,\n", g_Health.unread );
+		fprintf( out, "\t\t\"lines_queued\": %ld,\n", g_Health.lines );
+		fprintf( out, "\t\t\"lines_written\": %ld,\n", g_Health.written );
+		fprintf( out, "\t\t\"records_dropped\": %ld,\n", g_Health.dropped );
+		fprintf( out, "\t\t\"queue_high_water\": %ld,\n", g_Health.highwater );
+		fprintf( out, "\t\t\"queue_size\": %d,\n", QUEUE_SIZE );
+		fprintf( out, "\t\t\"reacquires\": %ld,\n", g_Health.reacquires );
+		fprintf( out, "\t\t\"disconnects\": %ld,\n", g_Health.disconnects );
+		fprintf( out, "\t\t\"feed_events_dropped\": %ld,\n", g_Health.feeddropped );
+		fprintf( out, "\t\t\"markers_dropped\": %ld,\n", g_Health.markersdropped );
+		fprintf( out, "\t\t\"stream_records_dropped\": %ld,\n", g_Health.streamdropped );
+		fprintf( out, "\t\t\"write_errors\": %ld,\n", g_Health.writeerrors );
+		fprintf( out, "\t\t\"bytes_written\": %I64u,\n", g_Health.bytes );
+		fprintf( out, "\t\t\"sampling_core_share\": %.6f", secs > 0 ? (g_Health.busy + g_Sampler.wait.spun) / secs : 0.0 );
+		for ( i = 0; i < 2; i++ ) {
+			const LONG * hist = i == 0 ? g_Health.latency : g_Health.late;
+			fprintf( out, ",\n\t\t\"%s\": { \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f }",
+				i == 0 ? "write_latency_ms" : "tick_lateness_ms",
+				HealthPercentile( hist, 0.5 ) / 1000.0, HealthPercentile( hist, 0.9 ) / 1000.0,
+				HealthPercentile( hist, 0.99 ) / 1000.0, HealthPercentile( hist, 0.999 ) / 1000.0,
+				HealthPercentile( hist, 1.0 ) / 1000.0 );
+		}
+		fprintf( out, "\n\t}" );
+	} else {
+		fprintf( out, ",\n\t\"counters\": null" );
+	}
+	fprintf( out, "\n}\n" );
+
+	bool ok = ferror( out ) == 0;
+	if ( fclose( out ) != 0 || !ok ) {
+		remove( tmpname );
+		return false;
+	}
+	return MoveFileEx( tmpname, g_SessionInfo.name, MOVEFILE_REPLACE_EXISTING ) != 0;
+}
+
+//-----------------------------------------------------------------------------
+// Name: ExpectedFileSize()
+// Desc: Guess how big the output file could get in the longest expected session,
+//       or segment of it.
+//-----------------------------------------------------------------------------
+ULONGLONG ExpectedFileSize( void )
+{
+	double secs = 60.0 * g_Config.MaxSessionMins;
+	if ( g_Config.SegmentMins > 0 && (secs <= 0 || g_Config.SegmentMins < g_Config.MaxSessionMins) )
+		secs = 60.0 * g_Config.SegmentMins;
+	double bytes = g_Config.TicksPerSec * secs * BYTES_PER_LINE;
+
+	if ( g_Config.EnvelopeColumns )
+		bytes += g_Config.TicksPerSec * secs * ENVELOPE_BYTES;
+
+	if ( g_Config.FlushInterval > 0 )
+		bytes += secs * 1000.0 / g_Config.FlushInterval * TRAILER_BYTES;
+	if ( g_Config.SegmentMB > 0 )
+		bytes = min( bytes, g_Config.SegmentMB * 1048576.0 );
+	return (ULONGLONG)bytes + sizeof g_Config.BannerComment + 1024;
+}
+
+//-----------------------------------------------------------------------------
+// Name: PreallocateOutput()
+// Desc: Set aside disk space for the file up front, so it isn't fragmented by
+//       being grown one small write at a time. The file is cut back to its real
+//       length when closed. SetFileValidData() isn't used: it would expose old
+//       disk contents, and appending never needs the zero-fill it saves.
+//-----------------------------------------------------------------------------
+bool PreallocateOutput( HANDLE hFile, ULONGLONG size )
+{
+	LARGE_INTEGER li, zero;
+	li.QuadPart = (LONGLONG)size;
+	zero.QuadPart = 0;
+
+	bool retcode = SetFilePointerEx( hFile, li, NULL, FILE_BEGIN ) && SetEndOfFile( hFile );
+	SetFilePointerEx( hFile, zero, NULL, FILE_BEGIN );
+	return retcode;
+}
+
+//-----------------------------------------------------------------------------
+// Name: MappedOpen()
+// Desc: Set up to write the file through a memory mapping of at least size bytes.
+//-----------------------------------------------------------------------------
+bool MappedOpen( HANDLE hFile, ULONGLONG size )
+{
+	memset( &g_Mapped, 0, sizeof g_Mapped );
+	g_Mapped.hFile = hFile;
+
+	// Always at least two chunks, so the one ahead can be mapped too.
+	size = (size + MAP_CHUNK -1) / MAP_CHUNK * MAP_CHUNK;
+	if ( size < 2 * MAP_CHUNK )
+		size = 2 * MAP_CHUNK;
+
+	if ( (g_Mapped.hMap = CreateFileMapping( hFile, NULL, PAGE_READWRITE,
+							(DWORD)(size >> 32), (DWORD)size, NULL )) == NULL )
+		return false;
+	g_Mapped.mapsize = size;
+
+	if ( (g_Mapped.view[0] = (char *)MapViewOfFile( g_Mapped.hMap, FILE_MAP_WRITE, 0, 0, MAP_CHUNK )) == NULL ) {
+		CloseHandle( g_Mapped.hMap );
+		g_Mapped.hMap = NULL;
+		return false;
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Name: MappedAhead()
+// Desc: Map the chunk after the current one, growing the mapping if need be.
+//-----------------------------------------------------------------------------
+bool MappedAhead( void )
+{
+	ULONGLONG next = g_Mapped.viewbase + MAP_CHUNK;
+
+	if ( next + MAP_CHUNK > g_Mapped.mapsize ) {
+		// Views stay valid after their mapping's handle is closed.
+		ULONGLONG size = g_Mapped.mapsize * 2;
+		HANDLE hMap = CreateFileMapping( g_Mapped.hFile, NULL, PAGE_READWRITE,
+							(DWORD)(size >> 32), (DWORD)size, NULL );
+		if ( hMap == NULL )
+			return false;
+		CloseHandle( g_Mapped.hMap );
+		g_Mapped.hMap = hMap;
+		g_Mapped.mapsize = size;
+	}
+
+	g_Mapped.view[1] = (char *)MapViewOfFile( g_Mapped.hMap, FILE_MAP_WRITE,
+							(DWORD)(next >> 32), (DWORD)next, MAP_CHUNK );
+	return g_Mapped.view[1] != NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Name: MappedWrite()
+// Desc: Copy text into the mapping, as a text mode stdio stream would write it.
+//-----------------------------------------------------------------------------
+bool MappedWrite( const char * buf, size_t len )
+{
+	for ( size_t i = 0; i < len; i++ ) {
+		for ( int crlf = (buf[i] == '\n'); crlf >= 0; crlf-- ) {
+			if ( g_Mapped.pos - g_Mapped.viewbase >= MAP_CHUNK ) {
+				// Move on to the next chunk, which is normally already mapped.
+				if ( g_Mapped.view[1] == NULL && !MappedAhead() )
+					return false;
+				FlushViewOfFile( g_Mapped.view[0], 0 );	// start it on its way to the disk
+				UnmapViewOfFile( g_Mapped.view[0] );
+				g_Mapped.view[0] = g_Mapped.view[1];
+				g_Mapped.view[1] = NULL;
+				g_Mapped.viewbase += MAP_CHUNK;
+			}
+			g_Mapped.view[0][g_Mapped.pos++ - g_Mapped.viewbase] = crlf ? '\r' : buf[i];
+		}
+	}
+
+	// Once we're half way through a chunk, get the next one ready.
+	if ( g_Mapped.view[1] == NULL && g_Mapped.pos - g_Mapped.viewbase >= MAP_CHUNK / 2 )
+		return MappedAhead();
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Name: MappedSync()
+// Desc: Force what's been written through the mapping onto the disk.
+//-----------------------------------------------------------------------------
+bool MappedSync( void )
+{
+	return FlushViewOfFile( g_Mapped.view[0], 0 ) && FlushFileBuffers( g_Mapped.hFile );
+}
+
+//-----------------------------------------------------------------------------
+// Name: MappedClose()
+// Desc: Drop the mapping, and cut the file back to what was actually written.
+//-----------------------------------------------------------------------------
+void MappedClose( void )
+{
+	LARGE_INTEGER li;
+
+	for ( int i = 0; i < 2; i++ )
+		if ( g_Mapped.view[i] != NULL )
+			UnmapViewOfFile( g_Mapped.view[i] );
+	CloseHandle( g_Mapped.hMap );
+
+	li.QuadPart = (LONGLONG)g_Mapped.pos;
+	if ( SetFilePointerEx( g_Mapped.hFile, li, NULL, FILE_BEGIN ) )
+		SetEndOfFile( g_Mapped.hFile );
+
+	memset( &g_Mapped, 0, sizeof g_Mapped );
+}
+
+//-----------------------------------------------------------------------------
+// Name: Crc32cHardware()
+// Desc: Whether the processor has SSE4.2, whose crc32 instruction does CRC-32C
+//       a word at a time. Found out once.
+//-----------------------------------------------------------------------------
+bool Crc32cHardware( void )
+{
+	static volatile int have = -1;
+
+	// Harmless if two threads race to find out; they get the same answer.
+	if ( have < 0 ) {
+		int info[4];
+		__cpuid( info, 1 );
+		have = (info[2] >> 20) & 1;		// ECX bit 20
+	}
+	return have != 0;
+}
+
+//-----------------------------------------------------------------------------
+// Name: Crc32c()
+// Desc: Extend a CRC-32C (Castagnoli) checksum over some more bytes. Start with zero.
+//-----------------------------------------------------------------------------
+unsigned long Crc32c( unsigned long crc, const void * buf, size_t len )
+{
+	static unsigned long table[256];
+	static volatile bool tablemade = false;
+	const unsigned char * p = (const unsigned char *)buf;
+
+	if ( Crc32cHardware() ) {
+		unsigned int c = ~(unsigned int)crc;
+
+		// A byte at a time up to a word boundary, then whole words.
+		for ( ; len > 0 && ((ULONG_PTR)p & (sizeof(ULONG_PTR) -1)) != 0; len-- )
+			c = _mm_crc32_u8( c, *p++ );
+#ifdef _M_X64
+		ULONGLONG c64 = c;
+		for ( ; len >= 8; len -= 8, p += 8 )
+			c64 = _mm_crc32_u64( c64, *(const ULONGLONG *)p );
+		c = (unsigned int)c64;
+#endif
+		for ( ; len >= 4; len -= 4, p += 4 )
+			c = _mm_crc32_u32( c, *(const unsigned int *)p );
+		for ( ; len > 0; len-- )
+			c = _mm_crc32_u8( c, *p++ );
+		return ~c & 0xffffffffUL;
+	}
+
+	// Harmless if two threads race to build this; they write the same values.
+	if ( !tablemade ) {
+		for ( unsigned long i = 0; i < 256; i++ ) {
+			unsigned long c = i;
+			for ( int k = 0; k < 8; k++ )
+				c = (c & 1) ? (c >> 1) ^ 0x82F63B78UL : c >> 1;
+			table[i] = c;
+		}
+		tablemade = true;
+	}
+
+	crc = ~crc & 0xffffffffUL;
+	while ( len-- > 0 )
+		crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return ~crc & 0xffffffffUL;
+}
+
+//-----------------------------------------------------------------------------
+// Name: SessionClock()
+// Desc: Microseconds since the session clock was last reset.
+//-----------------------------------------------------------------------------
+LONGLONG SessionClock( void )
+{
+	LARGE_INTEGER now;
+	QueryPerformanceCounter( &now );
+
+	// In two parts, so the multiply can't overflow however long we've been up.
+	LONGLONG ticks = now.QuadPart - g_qpcstart;
+	return ticks / g_qpcfreq * 1000000 + ticks % g_qpcfreq * 1000000 / g_qpcfreq;
+}
+
+//-----------------------------------------------------------------------------
+// Name: ResetSessionClock()
+// Desc: Start the session clock again from zero, telling feed readers.
+//-----------------------------------------------------------------------------
+void ResetSessionClock( void )
+{
+	LARGE_INTEGER now;
+	QueryPerformanceCounter( &now );
+	g_qpcstart = now.QuadPart;
+	g_timerstart = GetTickCount();
+
+	if ( g_pFeed != NULL ) {
+		g_pFeed->tickbase = g_timerstart;
+		g_pFeed->qpcbase = g_qpcstart;
+		InterlockedIncrement( &g_pFeed->session );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Name: FeedOpen()
+// Desc: Create the shared memory feed, or take over one that readers have
+//       kept after the copy of us writing it went. Fails if another copy of
+//       us is still writing it, or it's some other version of the feed.
+//-----------------------------------------------------------------------------
+bool FeedOpen( void )
+{
+	bool existed;
+
+	if ( g_pFeed != NULL )
+		return true;
+
+	if ( (g_hFeedOwner = CreateMutex( NULL, FALSE, FeedOwnerName )) == NULL )
+		return false;
+	if ( GetLastError() == ERROR_ALREADY_EXISTS ) {
+		CloseHandle( g_hFeedOwner );
+		g_hFeedOwner = NULL;
+		return false;
+	}
+
+	if ( (g_hFeedMap = CreateFileMapping( INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+						0, sizeof(JOYMON_FEED), JOYMON_FEED_NAME )) == NULL ) {
+		CloseHandle( g_hFeedOwner );
+		g_hFeedOwner = NULL;
+		return false;
+	}
+	existed = GetLastError() == ERROR_ALREADY_EXISTS;
+
+	// Mapping the whole feed fails if an existing mapping is too small for it.
+	if ( (g_pFeed = (JOYMON_FEED *)MapViewOfFile( g_hFeedMap, FILE_MAP_WRITE, 0, 0, sizeof(JOYMON_FEED) )) == NULL ||
+		 (existed && (g_pFeed->magic != JOYMON_FEED_MAGIC || g_pFeed->version != JOYMON_FEED_VERSION ||
+					  g_pFeed->size != JOYMON_FEED_SIZE || g_pFeed->recsize != sizeof(JOYREC))) ) {
+		if ( g_pFeed != NULL )
+			UnmapViewOfFile( g_pFeed );
+		g_pFeed = NULL;
+		CloseHandle( g_hFeedMap );
+		CloseHandle( g_hFeedOwner );
+		g_hFeedMap = g_hFeedOwner = NULL;
+		return false;
+	}
+
+	// Readers still attached start again, in a new session. New readers are
+	// kept out while it's reset.
+	if ( existed ) {
+		InterlockedExchange( (volatile LONG *)&g_pFeed->magic, 0 );
+		InterlockedExchange( &g_pFeed->latestseq, 0 );
+		memset( g_pFeed->ring, 0, sizeof g_pFeed->ring );
+		InterlockedExchange( &g_pFeed->head, 0 );
+		InterlockedIncrement( &g_pFeed->session );
+	}
+
+	// New mappings are zeroed, so only the header needs filling in.
+	g_pFeed->version = JOYMON_FEED_VERSION;
+	g_pFeed->size = JOYMON_FEED_SIZE;
+	g_pFeed->recsize = sizeof(JOYREC);
+	g_pFeed->tickbase = g_timerstart;
+	g_pFeed->qpcbase = g_qpcstart;
+	g_pFeed->qpcfreq = g_qpcfreq;
+	InterlockedExchange( (volatile LONG *)&g_pFeed->magic, JOYMON_FEED_MAGIC );
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Name: FeedClose()
+// Desc: Withdraw the shared memory feed. Readers keep their view, but it goes
+//       stale. Only the GUI calls this, when not recording, so it's the writer.
+//-----------------------------------------------------------------------------
+void FeedClose( void )
+{
+	if ( g_pFeed == NULL )
+		return;
+
+	JOYMON_FEED * feed = g_pFeed;
+	g_pFeed = NULL;
+
+	UnmapViewOfFile( feed );
+	CloseHandle( g_hFeedMap );
+	CloseHandle( g_hFeedOwner );
+	g_hFeedMap = g_hFeedOwner = NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Name: FeedPublish()
+// Desc: Put a record in the feed ring; position samples also become the latest.
+//       Only the feed's writer may call this; anyone else uses FeedPost().
+//-----------------------------------------------------------------------------
+void FeedPublish( const JOYREC& rec )
+{
+	JOYMON_FEED * feed = g_pFeed;
+	if ( feed == NULL )
+		return;
+
+	// The interlocked ops are full barriers, which orders the copies for readers.
+	if ( rec.type == JOYREC_SAMPLE ) {
+		LONG seq = feed->latestseq;
+		InterlockedExchange( &feed->latestseq, seq + 1 );
+		feed->latest = rec;
+		InterlockedExchange( &feed->latestseq, seq + 2 );
+	}
+
+	LONG head = feed->head;
+	feed->ring[head & (JOYMON_FEED_SIZE -1)] = rec;
+	InterlockedExchange( &feed->head, head + 1 );
+}
+
+//-----------------------------------------------------------------------------
+// Name: FeedPost()
+// Desc: Put a record in the feed from whichever thread. While recording, the
+//       GUI's go on the queue for the sampler; if that's full, it's dropped
+//       and counted rather than the GUI waiting.
+//-----------------------------------------------------------------------------
+void FeedPost( const JOYREC& rec )
+{
+	if ( g_pFeed == NULL )
+		return;
+
+	if ( g_bWriting && GetCurrentThreadId() == g_dwGuiThread ) {
+		if ( !QueuePut( g_FeedQueue, rec ) )
+			InterlockedIncrement( &g_Health.feeddropped );
+		return;
+	}
+
+	FeedDrain();		// anything still queued from when the sampler was running
+	FeedPublish( rec );
+}
+
+//-----------------------------------------------------------------------------
+// Name: FeedDrain()
+// Desc: Publish what the GUI queued for the feed. Only the feed's writer may
+//       call this: the sampler, or the GUI once the sampler's stopped.
+//-----------------------------------------------------------------------------
+void FeedDrain( void )
+{
+	JOYREC rec;
+
+	while ( QueueGet( g_FeedQueue, rec ) )
+		FeedPublish( rec );
+}
+
+//-----------------------------------------------------------------------------
+// Name: StatsReset()
+// Desc: Clear the running statistics, for a new session.
+//-----------------------------------------------------------------------------
+void StatsReset( void )
+{
+	LONG seq = g_Running.seq;
+	InterlockedExchange( &g_Running.seq, seq + 1 );
+	memset( &g_Running.s, 0, sizeof g_Running.s );
+	InterlockedExchange( &g_Running.seq, seq + 2 );
+}
+
+//-----------------------------------------------------------------------------
+// Name: StatsAdd()
+// Desc: Add a line to the running statistics. Only the sampler calls this.
+//-----------------------------------------------------------------------------
+void StatsAdd( const JOYREC& line )
+{
+	RUNNINGSTATS& s = g_Running.s;
+	LONG v[2] = { line.x, line.y };
+	int axis;
+
+	if ( line.flags & JOYREC_RAWUNITS )
+		RawProject( v[0], v[1], g_RawMin, g_RawMax, g_Config.OriginLowerLeft, g_Config.XYMinMax );
+
+	// The interlocked ops are full barriers, which orders the changes for readers.
+	LONG seq = g_Running.seq;
+	InterlockedExchange( &g_Running.seq, seq + 1 );
+
+	if ( s.lines++ == 0 ) {
+		s.first = line.time;
+		for ( axis = 0; axis < 2; axis++ )
+			s.min[axis] = s.max[axis] = v[axis];
+	} else {
+		s.distance += _hypot( (double)(v[0] - s.x), (double)(v[1] - s.y) );
+	}
+	s.last = line.time;
+
+	for ( axis = 0; axis < 2; axis++ ) {
+		double d = v[axis] - s.mean[axis];
+		s.mean[axis] += d / (LONGLONG)s.lines;
+		s.m2[axis] += d * (v[axis] - s.mean[axis]);
+		s.min[axis] = min( s.min[axis], v[axis] );
+		s.max[axis] = max( s.max[axis], v[axis] );
+	}
+
+	int octant = Octant( v[0], v[1] );
+	if ( octant < 0 )
+		s.centre++;
+	else
+		s.octant[octant]++;
+
+	// The button's set on a line if it was pressed since the one before.
+	if ( line.button )
+		s.presses++;
+	s.x = v[0];
+	s.y = v[1];
+
+	InterlockedExchange( &g_Running.seq, seq + 2 );
+}
+
+//-----------------------------------------------------------------------------
+// Name: StatsCopy()
+// Desc: Take a consistent copy of the running statistics, without holding up
+//       the sampler. If it changes them part way through, copy them again.
+//-----------------------------------------------------------------------------
+void StatsCopy( RUNNINGSTATS& s )
+{
+	LONG before, after;
+
+	do {
+		while ( (before = g_Running.seq) & 1 )
+			YieldProcessor();		// the sampler's in the middle of it
+		MemoryBarrier();
+		s = g_Running.s;
+		MemoryBarrier();
+		after = g_Running.seq;
+	} while ( before != after );
+}
+
+//-----------------------------------------------------------------------------
+// Name: PublisherStart()
+// Desc: Start listening for subscribers on the configured loopback port.
+//-----------------------------------------------------------------------------
+bool PublisherStart( void )
+{
+	WSADATA wsadata;
+	SOCKET s;
+	struct sockaddr_in addr;
+	BOOL exclusive = TRUE;
+	u_long nonblocking = 1;
+
+	if ( g_hPublisherThread != NULL )
+		return true;
+
+	if ( WSAStartup( MAKEWORD(2,2), &wsadata ) != 0 )
+		return false;
+
+	memset( &addr, 0, sizeof addr );
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons( (u_short)g_Config.StreamPort );
+	addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );	// this machine only
+
+	if ( (s = socket( AF_INET, SOCK_STREAM, IPPROTO_TCP )) == INVALID_SOCKET ) {
+		WSACleanup();
+		return false;
+	}
+	if ( setsockopt( s, SOL_SOCKET, SO_EXCLUSIVEADDRUSE, (const char *)&exclusive, sizeof exclusive ) != 0 ||
+		 bind( s, (struct sockaddr *)&addr, sizeof addr ) != 0 ||
+		 listen( s, SOMAXCONN ) != 0 ||
+		 ioctlsocket( s, FIONBIO, &nonblocking ) != 0 ) {
+		closesocket( s );
+		WSACleanup();
+		return false;
+	}
+
+	g_ListenSocket = s;
+	g_PublishQueue.head = g_PublishQueue.tail = 0;
+	g_PublishLost = 0;
+	g_bPublisherStop = false;
+
+	if ( (g_hPublisherThread = CreateThread( NULL, 0, PublisherThreadProc, NULL, 0, NULL )) == NULL ) {
+		closesocket( g_ListenSocket );
+		g_ListenSocket = INVALID_SOCKET;
+		WSACleanup();
+		return false;
+	}
+
+	g_PublisherPort = g_Config.StreamPort;
+	g_bPublishing = true;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Name: PublisherStop()
+// Desc: Hang up on all subscribers and stop listening.
+//-----------------------------------------------------------------------------
+void PublisherStop( void )
+{
+	if ( g_hPublisherThread == NULL )
+		return;
+
+	g_bPublishing = false;
+	g_bPublisherStop = true;
+	WaitForSingleObject( g_hPublisherThread, INFINITE );
+	CloseHandle( g_hPublisherThread );
+	g_hPublisherThread = NULL;
+
+	closesocket( g_ListenSocket );
+	g_ListenSocket = INVALID_SOCKET;
+	g_PublisherPort = 0;
+	WSACleanup();
+}
+
+//-----------------------------------------------------------------------------
+// Name: Publish()
+// Desc: Queue a record for subscribers. Only whoever is sampling may call this:
+//       the timer callback while recording, otherwise the GUI.
+//-----------------------------------------------------------------------------
+void Publish( const JOYREC& rec )
+{
+	// If the queue's full the publisher thread is stuck. What's lost is counted,
+	// and the count goes out in every frame, so subscribers can tell.
+	if ( g_bPublishing && !QueuePut( g_PublishQueue, rec ) ) {
+		InterlockedIncrement( &g_PublishLost );
+		InterlockedIncrement( &g_Health.streamdropped );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Name: PublishFrame()
+// Desc: Add a frame of records to every subscriber's buffer. A subscriber
+//       whose buffer is too full misses the whole frame, never part of one.
+//-----------------------------------------------------------------------------
+static void PublishFrame( const JOYREC * recs, int count, DWORD seq )
+{
+	JOYMON_FRAME frame;
+	int len = sizeof frame + count * sizeof(JOYREC);
+
+	frame.magic = JOYMON_FRAME_MAGIC;
+	frame.seq = seq;
+	frame.count = (WORD)count;
+	frame.recsize = sizeof(JOYREC);
+	frame.lost = (DWORD)g_PublishLost;
+
+	for ( int i = 0; i < MAX_SUBSCRIBERS; i++ ) {
+		SUBSCRIBER& sub = g_Subscribers[i];
+		if ( sub.s == INVALID_SOCKET )
+			continue;
+
+		if ( SUBSCRIBER_BUFFER - sub.end < len && sub.start > 0 ) {
+			memmove( sub.buf, &sub.buf[sub.start], sub.end - sub.start );
+			sub.end -= sub.start;
+			sub.start = 0;
+		}
+		if ( SUBSCRIBER_BUFFER - sub.end < len ) {
+			sub.dropped++;
+			continue;
+		}
+
+		frame.dropped = sub.dropped;
+		memcpy( &sub.buf[sub.end], &frame, sizeof frame );
+		memcpy( &sub.buf[sub.end + sizeof frame], recs, count * sizeof(JOYREC) );
+		sub.end += len;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Name: PublisherThreadProc()
+// Desc: Accept subscribers, frame queued records for them, and send what each
+//       of them will take without blocking.
+//-----------------------------------------------------------------------------
+DWORD WINAPI PublisherThreadProc( LPVOID lpParameter )
+{
+	static JOYREC recs[FRAME_RECORDS];
+	DWORD seq = 0;
+	int i, count;
+
+	for ( i = 0; i < MAX_SUBSCRIBERS; i++ )
+		g_Subscribers[i].s = INVALID_SOCKET;
+
+	while ( !g_bPublisherStop ) {
+		fd_set readable, writable;
+		struct timeval timeout = { 0, PUBLISH_PERIOD * 1000 };
+
+		FD_ZERO( &readable );
+		FD_ZERO( &writable );
+		FD_SET( g_ListenSocket, &readable );
+		for ( i = 0; i < MAX_SUBSCRIBERS; i++ ) {
+			if ( g_Subscribers[i].s == INVALID_SOCKET )
+				continue;
+			FD_SET( g_Subscribers[i].s, &readable );
+			if ( g_Subscribers[i].end > g_Subscribers[i].start )
+				FD_SET( g_Subscribers[i].s, &writable );
+		}
+
+		// Either something happens on a socket, or it's time to look at the queue.
+		if ( select( 0, &readable, &writable, NULL, &timeout ) == SOCKET_ERROR ) {
+			FD_ZERO( &readable );
+			FD_ZERO( &writable );
+			Sleep( PUBLISH_PERIOD );
+		}
+
+		if ( FD_ISSET( g_ListenSocket, &readable ) ) {
+			SOCKET s = accept( g_ListenSocket, NULL, NULL );
+			if ( s != INVALID_SOCKET ) {
+				u_long nonblocking = 1;
+				for ( i = 0; i < MAX_SUBSCRIBERS && g_Subscribers[i].s != INVALID_SOCKET; i++ )
+					;
+				if ( i == MAX_SUBSCRIBERS || ioctlsocket( s, FIONBIO, &nonblocking ) != 0 ) {
+					closesocket( s );	// full up
+				} else {
+					g_Subscribers[i].s = s;
+					g_Subscribers[i].dropped = 0;
+					g_Subscribers[i].start = g_Subscribers[i].end = 0;
+				}
+			}
+		}
+
+		// Subscribers have nothing to say; reading only tells us when they hang up.
+		for ( i = 0; i < MAX_SUBSCRIBERS; i++ ) {
+			SUBSCRIBER& sub = g_Subscribers[i];
+			if ( sub.s != INVALID_SOCKET && FD_ISSET( sub.s, &readable ) ) {
+				char junk[256];
+				int n = recv( sub.s, junk, sizeof junk, 0 );
+				if ( n == 0 || (n == SOCKET_ERROR && WSAGetLastError() != WSAEWOULDBLOCK) ) {
+					closesocket( sub.s );
+					sub.s = INVALID_SOCKET;
+				}
+			}
+		}
+
+		// Frame up whatever's been queued.
+		do {
+			for ( count = 0; count < FRAME_RECORDS && QueueGet( g_PublishQueue, recs[count] ); count++ )
+				;
+			if ( count > 0 )
+				PublishFrame( recs, count, seq++ );
+		} while ( count == FRAME_RECORDS );
+
+		for ( i = 0; i < MAX_SUBSCRIBERS; i++ ) {
+			SUBSCRIBER& sub = g_Subscribers[i];
+			if ( sub.s == INVALID_SOCKET || sub.end == sub.start )
+				continue;
+
+			int n = send( sub.s, &sub.buf[sub.start], sub.end - sub.start, 0 );
+			if ( n == SOCKET_ERROR ) {
+				if ( WSAGetLastError() != WSAEWOULDBLOCK ) {
+					closesocket( sub.s );
+					sub.s = INVALID_SOCKET;
+				}
+			} else if ( (sub.start += n) == sub.end ) {
+				sub.start = sub.end = 0;
+			}
+		}
+	}
+
+	for ( i = 0; i < MAX_SUBSCRIBERS; i++ ) {
+		if ( g_Subscribers[i].s != INVALID_SOCKET ) {
+			closesocket( g_Subscribers[i].s );
+			g_Subscribers[i].s = INVALID_SOCKET;
+		}
+	}
+
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// Name: MarkerStart()
+// Desc: Start taking markers on the configured loopback port.
+//-----------------------------------------------------------------------------
+bool MarkerStart( void )
+{
+	WSADATA wsadata;
+	SOCKET s;
+	struct sockaddr_in addr;
+	BOOL exclusive = TRUE;
+
+	if ( g_hMarkerThread != NULL )
+		return true;
+
+	if ( WSAStartup( MAKEWORD(2,2), &wsadata ) != 0 )
+		return false;
+
+	memset( &addr, 0, sizeof addr );
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons( (u_short)g_Config.MarkerPort );
+	addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );	// this machine only
+
+	if ( (s = socket( AF_INET, SOCK_DGRAM, IPPROTO_UDP )) == INVALID_SOCKET ) {
+		WSACleanup();
+		return false;
+	}
+	if ( setsockopt( s, SOL_SOCKET, SO_EXCLUSIVEADDRUSE, (const char *)&exclusive, sizeof exclusive ) != 0 ||
+		 bind( s, (struct sockaddr *)&addr, sizeof addr ) != 0 ) {
+		closesocket( s );
+		WSACleanup();
+		return false;
+	}
+
+	g_MarkerSocket = s;
+	g_bMarkerStop = false;
+
+	if ( (g_hMarkerThread = CreateThread( NULL, 0, MarkerThreadProc, NULL, 0, NULL )) == NULL ) {
+		closesocket( g_MarkerSocket );
+		g_MarkerSocket = INVALID_SOCKET;
+		WSACleanup();
+		return false;
+	}
+
+	g_MarkerPort = g_Config.MarkerPort;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Name: MarkerStop()
+// Desc: Stop taking markers. Only called when not recording.
+//-----------------------------------------------------------------------------
+void MarkerStop( void )
+{
+	if ( g_hMarkerThread == NULL )
+		return;
+
+	// Closing the socket wakes the thread out of recvfrom().
+	g_bMarkerStop = true;
+	closesocket( g_MarkerSocket );
+	WaitForSingleObject( g_hMarkerThread, INFINITE );
+	CloseHandle( g_hMarkerThread );
+	g_hMarkerThread = NULL;
+
+	g_MarkerSocket = INVALID_SOCKET;
+	g_MarkerPort = 0;
+	WSACleanup();
+}
+
+//-----------------------------------------------------------------------------
+// Name: MarkerThreadProc()
+// Desc: Stamp each marker as it arrives and queue it for the writer thread.
+//       A datagram is one marker: its text, optionally preceded by @<time>,
+//       the time in microseconds on the session clock, if the sender knows it
+//       better than we do (e.g. from the shared feed's qpcbase).
+//-----------------------------------------------------------------------------
+DWORD WINAPI MarkerThreadProc( LPVOID lpParameter )
+{
+	char msg[1024];
+
+	for (;;) {
+		int len = recvfrom( g_MarkerSocket, msg, sizeof msg -1, 0, NULL, NULL );
+		LONGLONG now = SessionClock();
+
+		if ( g_bMarkerStop )
+			break;
+		if ( len == SOCKET_ERROR ) {
+			// Long markers are cut short, which is fine.
+			if ( WSAGetLastError() != WSAEMSGSIZE && WSAGetLastError() != WSAECONNRESET )
+				break;
+			len = sizeof msg -1;
+		}
+		if ( !g_bWriting )
+			continue;		// nothing to put it in
+		msg[len] = 0;
+
+		char * p = msg;
+		if ( *p == '@' ) {
+			char * end;
+			LONGLONG t = _strtoi64( p + 1, &end, 10 );
+			if ( end != p + 1 ) {
+				now = t;
+				p = end;
+			}
+		}
+		while ( *p == ' ' || *p == '\t' )
+			p++;
+
+		ULONG head = (ULONG)g_MarkerQueue.head;
+		if ( head - (ULONG)g_MarkerQueue.tail >= MARKER_QUEUE_SIZE ) {
+			InterlockedIncrement( &g_Health.markersdropped );
+			continue;		// the writer's stuck
+		}
+
+		// One marker, one line: no control characters, and no trailing blanks.
+		MARKER& m = g_MarkerQueue.marker[head & (MARKER_QUEUE_SIZE -1)];
+		int i;
+		m.time = now;
+		m.type = "marker";
+		for ( i = 0; i < MARKER_TEXT -1 && p[i] != 0; i++ )
+			m.text[i] = (unsigned char)p[i] < ' ' ? ' ' : p[i];
+		while ( i > 0 && m.text[i-1] == ' ' )
+			i--;
+		m.text[i] = 0;
+
+		// "ref <name> <value>" is a reading of some other clock, an external
+		// reference that /timemap can put the samples on instead of wall time.
+		char name[64], value[64], * end;
+		if ( sscanf( m.text, "ref %63[^ ,] %63s", name, value ) == 2 &&
+			 (strtod( value, &end ), *end == 0) ) {
+			m.type = "reference";
+			_snprintf( m.text, sizeof m.text, "%s,%s", name, value );
+		}
+
+		InterlockedExchange( &g_MarkerQueue.head, (LONG)(head + 1) );
+	}
+
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// Name: TakeMarkers()
+// Desc: Move newly arrived markers off the queue into the pending list, keeping
+//       that in time order (markers with their own times can arrive out of it).
+//-----------------------------------------------------------------------------
+void TakeMarkers( void )
+{
+	ULONG tail = (ULONG)g_MarkerQueue.tail;
+
+	while ( tail != (ULONG)g_MarkerQueue.head && g_nPendingMarkers < MARKER_QUEUE_SIZE ) {
+		AddPending( g_MarkerQueue.marker[tail & (MARKER_QUEUE_SIZE -1)] );
+		InterlockedExchange( &g_MarkerQueue.tail, (LONG)++tail );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Name: AddPending()
+// Desc: Put a record in its place in the pending list. Writer thread only.
+//-----------------------------------------------------------------------------
+void AddPending( const MARKER& m )
+{
+	int i;
+
+	if ( g_nPendingMarkers >= MARKER_QUEUE_SIZE ) {
+		InterlockedIncrement( &g_Health.markersdropped );
+		return;
+	}
+
+	for ( i = g_nPendingMarkers; i > 0 && g_PendingMarkers[i-1].time > m.time; i-- )
+		g_PendingMarkers[i] = g_PendingMarkers[i-1];
+	g_PendingMarkers[i] = m;
+	g_nPendingMarkers++;
+}
+
+//-----------------------------------------------------------------------------
+// Name: WriteMarkers()
+// Desc: Write the pending markers stamped no later than upto. One stamped
+//       before samples already written (given its own time, too late) goes in
+//       after them instead, as a late record that says when it was stamped.
+//-----------------------------------------------------------------------------
+bool WriteMarkers( LONGLONG upto )
+{
+	int n, done = 0;
+	bool ok = true;
+
+	for ( n = 0; n < g_nPendingMarkers && g_PendingMarkers[n].time <= upto; n++ ) {
+		const MARKER& m = g_PendingMarkers[n];
+		char line[MARKER_TEXT + 96];
+		int len;
+		if ( m.time < g_MarkersAfter )
+			len = _snprintf( line, sizeof line, "%s late,%.6f,%.6f,%s,%s\n", EventRecord,
+							(double)g_MarkersAfter / 1000000.0, (double)m.time / 1000000.0, m.type, m.text );
+		else
+			len = _snprintf( line, sizeof line, "%s %s,%.6f,%s\n", EventRecord, m.type,
+							(double)m.time / 1000000.0, m.text );
+		if ( len <= 0 || !WriteOutput( line, len ) )
+			ok = false;
+	}
+
+	done = n;
+	for ( n = done; n < g_nPendingMarkers; n++ )
+		g_PendingMarkers[n - done] = g_PendingMarkers[n];
+	g_nPendingMarkers -= done;
+
+	return ok;
+}
+
+//-----------------------------------------------------------------------------
+// Name: UnixMicros()
+// Desc: Convert a FILETIME to microseconds since 1970.
+//-----------------------------------------------------------------------------
+static LONGLONG UnixMicros( const FILETIME& ft )
+{
+	ULONGLONG t = ((ULONGLONG)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+	return (LONGLONG)(t / 10) - 11644473600000000LL;
+}
+
+//-----------------------------------------------------------------------------
+// Name: ReadClocks()
+// Desc: Read the session clock and the wall clock (microsecs since 1970) at
+//       the same moment, give or take the uncertainty (microsecs).
+//-----------------------------------------------------------------------------
+void ReadClocks( LONGLONG& session, LONGLONG& wall, LONGLONG& uncertainty )
+{
+	FILETIME ft, was;
+	LONGLONG before, after, oldseen;
+	int i;
+
+	if ( g_pGetSystemTimePrecise != NULL ) {
+		// The precise clock can be read at any moment, so bracket it with the
+		// session clock, and keep the tightest of a few tries.
+		uncertainty = _I64_MAX;
+		for ( i = 0; i < 5; i++ ) {
+			before = SessionClock();
+			g_pGetSystemTimePrecise( &ft );
+			after = SessionClock();
+			if ( (after - before) / 2 + 1 < uncertainty ) {
+				session = before + (after - before) / 2;
+				wall = UnixMicros( ft );
+				uncertainty = (after - before) / 2 + 1;
+			}
+		}
+		return;
+	}
+
+	// The ordinary system time only moves on a clock interrupt, up to 16ms
+	// apart, so wait for it to tick over and time that instead.
+	DWORD giveup = GetTickCount() + 100;
+	oldseen = SessionClock();
+	GetSystemTimeAsFileTime( &was );
+	for (;;) {
+		before = SessionClock();
+		GetSystemTimeAsFileTime( &ft );
+		after = SessionClock();
+
+		if ( CompareFileTime( &ft, &was ) != 0 ) {
+			// It ticked over after the last read that saw the old time.
+			session = oldseen + (after - oldseen) / 2;
+			wall = UnixMicros( ft );
+			uncertainty = (after - oldseen) / 2 + 1;
+			return;
+		}
+		if ( (LONG)(GetTickCount() - giveup) >= 0 ) {
+			session = after;
+			wall = UnixMicros( ft );
+			uncertainty = 16000;
+			return;
+		}
+		oldseen = before;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Name: AddAnchor()
+// Desc: Pair the clocks, update the drift estimate, and queue an anchor record
+//       to be written in its place among the samples. Writer thread only.
+//-----------------------------------------------------------------------------
+void AddAnchor( void )
+{
+	MARKER m;
+	LONGLONG wall, uncertainty;
+	double x, y, d, drift = 0.0;
+
+	ReadClocks( m.time, wall, uncertainty );
+
+	if ( g_Anchor.n == 0 )
+		g_Anchor.FirstOffset = wall - m.time;
+	x = (double)m.time / 1000000.0;
+	y = (double)(wall - m.time - g_Anchor.FirstOffset);
+	g_Anchor.n++;
+	g_Anchor.Sx += x;
+	g_Anchor.Sy += y;
+	g_Anchor.Sxx += x * x;
+	g_Anchor.Sxy += x * y;
+	g_Anchor.Last = GetTickCount();
+
+	// Microsecs of offset per second is parts per million.
+	d = g_Anchor.n * g_Anchor.Sxx - g_Anchor.Sx * g_Anchor.Sx;
+	if ( g_Anchor.n >= 2 && d > 0 )
+		drift = (g_Anchor.n * g_Anchor.Sxy - g_Anchor.Sx * g_Anchor.Sy) / d;
+
+	m.type = "anchor";
+	_snprintf( m.text, sizeof m.text, "%I64d.%06d,%I64d,%.3f",
+		wall / 1000000, (int)(wall % 1000000), uncertainty, drift );
+	m.text[sizeof m.text -1] = 0;
+	AddPending( m );
+}
+
+//-----------------------------------------------------------------------------
+// Name: AttachToConsole()
+// Desc: We're a GUI program, so need to find a console for command line output.
+//-----------------------------------------------------------------------------
+void AttachToConsole( void )
+{
+	if ( AttachConsole( ATTACH_PARENT_PROCESS ) || AllocConsole() ) {
+		freopen( "CONOUT$", "w", stdout );
+		freopen( "CONOUT$", "w", stderr );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Name: RunCommandLine()
+// Desc: Run one of the command line utilities instead of the GUI.
+//       Returns the process exit code.
+//-----------------------------------------------------------------------------
+int RunCommandLine( int argc, char ** argv )
+{
+	AttachToConsole();
+
+	if ( argc >= 3 && _stricmp( argv[1], "/recover" ) == 0 ) {
+		char outname[MAX_PATH];
+		if ( argc >= 4 )
+			strncpy( outname, argv[3], sizeof outname );
+		else
+			_snprintf( outname, sizeof outname, "%s.recovered", argv[2] );
+		outname[sizeof outname -1] = 0;
+		return RecoverFile( argv[2], outname );
+	}
+
+	if ( argc >= 2 && _stricmp( argv[1], "/subscribe" ) == 0 ) {
+		int port = argc >= 3 ? atoi( argv[2] ) : 0;
+		int secs = argc >= 4 ? atoi( argv[3] ) : 10;
+		if ( port <= 0 || port > 65535 ) {
+			// Default to wherever the monitor is set to stream.
+			LoadConfig();
+			port = g_Config.StreamPort;
+		}
+		if ( port > 0 && port <= 65535 && secs > 0 )
+			return SubscribeTest( port, secs );
+	}
+
+	if ( argc >= 3 && _stricmp( argv[1], "/timemap" ) == 0 ) {
+		char outname[MAX_PATH];
+		const char * refname = NULL;
+		if ( argc >= 5 && _stricmp( argv[argc -2], "/ref" ) == 0 ) {
+			refname = argv[argc -1];
+			argc -= 2;
+		}
+		if ( argc >= 4 )
+			strncpy( outname, argv[3], sizeof outname );
+		else
+			_snprintf( outname, sizeof outname, "%s.timed", argv[2] );
+		outname[sizeof outname -1] = 0;
+		return TimeMap( argv[2], outname, refname );
+	}
+
+	if ( argc >= 3 && _stricmp( argv[1], "/rescale" ) == 0 ) {
+		char outname[MAX_PATH];
+		LONG range = 0;
+		if ( argc >= 5 && _stricmp( argv[argc -2], "/max" ) == 0 ) {
+			range = atol( argv[argc -1] );
+			argc -= 2;
+		}
+		if ( argc >= 4 )
+			strncpy( outname, argv[3], sizeof outname );
+		else
+			_snprintf( outname, sizeof outname, "%s.scaled", argv[2] );
+		outname[sizeof outname -1] = 0;
+		if ( range >= 0 )
+			return RescaleFile( argv[2], outname, range );
+	}
+
+	if ( argc >= 3 && _stricmp( argv[1], "/convert" ) == 0 ) {
+		const char * match = NULL;
+		if ( argc >= 5 && _stricmp( argv[argc -2], "/match" ) == 0 ) {
+			match = argv[argc -1];
+			argc -= 2;
+		}
+		return ConvertTree( argv[2], argc >= 4 ? argv[3] : NULL, match );
+	}
+
+	if ( argc >= 3 && _stricmp( argv[1], "/verify" ) == 0 ) {
+		const char * match = NULL;
+		if ( argc >= 5 && _stricmp( argv[argc -2], "/match" ) == 0 ) {
+			match = argv[argc -1];
+			argc -= 2;
+		}
+		return VerifyTree( argv[2], match );
+	}
+
+	if ( argc >= 3 && _stricmp( argv[1], "/aggregate" ) == 0 ) {
+		const char * by = NULL;
+		if ( argc >= 5 && _stricmp( argv[argc -2], "/by" ) == 0 ) {
+			by = argv[argc -1];
+			argc -= 2;
+		}
+		return Aggregate( argv[2], argc >= 4 ? argv[3] : NULL, by );
+	}
+
+	if ( argc >= 3 && _stricmp( argv[1], "/segments" ) == 0 ) {
+		double from = argc >= 4 ? atof( argv[3] ) : 0;
+		double to = argc >= 5 ? atof( argv[4] ) : HUGE_VAL;
+		return SegmentsFind( argv[2], from, to );
+	}
+
+	if ( argc >= 3 && _stricmp( argv[1], "/stress" ) == 0 ) {
+		char pattern[MAX_PATH];
+		double rate = argc >= 4 ? atof( argv[3] ) : 1000.0;
+		int secs = argc >= 5 ? atoi( argv[4] ) : 10;
+		if ( argc >= 6 ) {
+			strncpy( pattern, argv[5], sizeof pattern );
+		} else {
+			GetTempPath( sizeof pattern - 16, pattern );
+			strcat( pattern, "joystress." );
+		}
+		pattern[sizeof pattern -1] = 0;
+		if ( rate > 0 && secs > 0 )
+			return StressTest( argv[2], rate, secs, pattern );
+	}
+
+	if ( argc >= 2 && _stricmp( argv[1], "/timerbench" ) == 0 ) {
+		int secs = argc >= 3 ? atoi( argv[2] ) : 5;
+		int period = argc >= 4 ? atoi( argv[3] ) : 1;
+		LoadConfig();
+		if ( secs > 0 && period > 0 )
+			return TimerBench( secs, period );
+	}
+
+	if ( argc >= 3 && _stricmp( argv[1], "/mark" ) == 0 ) {
+		int port = argc >= 4 ? atoi( argv[2] ) : 0;
+		if ( argc < 4 ) {
+			LoadConfig();
+			port = g_Config.MarkerPort;
+		}
+		if ( port > 0 && port <= 65535 )
+			return SendMarker( port, argv[argc -1] );
+	}
+
+	fprintf( stderr, "%s %s\n"
+		"Usage:\n"
+		"  joystick                                 run the monitor\n"
+		"  joystick /virtual <script> [<device>]    run the monitor on a scripted device\n"
+		"  joystick /recover <file> [<output>]      salvage the intact blocks of a damaged file\n"
+		"  joystick /subscribe [<port> [<secs>]]    check the sample stream is being delivered\n"
+		"  joystick /mark [<port>] <text>           put a marker in the file being recorded\n"
+		"  joystick /timemap <file> [<output>] [/ref <name>]\n"
+		"                                           put a file's samples on wall clock (or reference) time\n"
+		"  joystick /rescale <file> [<output>] [/max <n>]\n"
+		"                                           scale a raw capture's samples to the axis maximum\n"
+		"  joystick /convert <file or folder> [<output folder>] [/match <wildcard>]\n"
+		"                                           convert recordings to the columnar format\n"
+		"  joystick /verify <file or folder> [/match <wildcard>]\n"
+		"                                           check recordings' blocks against their checksums\n"
+		"  joystick /aggregate <folder or manifest> [<output>] [/by folder|name|file|all]\n"
+		"                                           work out results for groups of recordings\n"
+		"  joystick /segments <manifest> [<from> [<to>]]\n"
+		"                                           list a split session's files holding those seconds\n"
+		"  joystick /stress <script> [<rate> [<secs> [<file>]]]\n"
+		"                                           run a script's devices through the writer flat out\n"
+		"  joystick /timerbench [<secs> [<ms>]]     compare the ways ticks can be timed\n",
+		Title, g_Version );
+	return 2;
+}
+
+//-----------------------------------------------------------------------------
+// Name: RecoverFile()
+// Desc: Copy every block of a (possibly truncated) output file whose trailer
+//       checks out to a new file. Returns 0 if all was well, 1 if anything was
+//       damaged or missing, or 2 if it couldn't be done at all.
+//-----------------------------------------------------------------------------
+int RecoverFile( const char * inname, const char * outname )
+{
+	FILE * in, * out;
+	char line[4096];
+	char * pending = NULL;
+	size_t pendinglen = 0, pendingsize = 0;
+	unsigned long crc = 0, lines = 0, goodblocks = 0, goodlines = 0, badblocks = 0, badlines = 0;
+	bool linestart = true;
+
+	if ( (in = fopen( inname, "r" )) == NULL ) {
+		fprintf( stderr, "%s: %s\n", inname, strerror(errno) );
+		return 2;
+	}
+	if ( (out = fopen( outname, "w" )) == NULL ) {
+		fprintf( stderr, "%s: %s\n", outname, strerror(errno) );
+		fclose( in );
+		return 2;
+	}
+
+	while ( fgets( line, sizeof line, in ) != NULL ) {
+		size_t len = strlen( line );
+
+		// Preallocated or crash-damaged files can end in a run of zeros.
+		if ( len == 0 )
+			break;
+
+		unsigned long number, wantlines, wantcrc;
+		if ( linestart && strncmp( line, BlockTrailer, sizeof BlockTrailer -1 ) == 0 ) {
+			if ( sscanf( line + sizeof BlockTrailer -1, " %lu, %lu lines, crc32c %lx",
+						&number, &wantlines, &wantcrc ) == 3 &&
+				 wantlines == lines && wantcrc == crc ) {
+				if ( fwrite( pending, 1, pendinglen, out ) != pendinglen || fputs( line, out ) < 0 ) {
+					fprintf( stderr, "%s: %s\n", outname, strerror(errno) );
+					break;
+				}
+				goodblocks++;
+				goodlines += lines;
+			} else {
+				printf( "Block ending at trailer `%.*s' is damaged; skipped %lu lines.\n",
+						(int)strcspn( line, "\n" ), line, lines );
+				badblocks++;
+				badlines += lines;
+			}
+			pendinglen = 0;
+			crc = lines = 0;
+			continue;
+		}
+
+		// Hold the lines of this block until we see its trailer.
+		if ( pendinglen + len > pendingsize ) {
+			size_t newsize = max( pendingsize * 2, pendinglen + len + sizeof line );
+			char * p = (char *)realloc( pending, newsize );
+			if ( p == NULL ) {
+				fprintf( stderr, "Out of memory holding a block of %lu lines.\n", lines );
+				break;
+			}
+			pending = p;
+			pendingsize = newsize;
+		}
+		memcpy( pending + pendinglen, line, len );
+		pendinglen += len;
+		crc = Crc32c( crc, line, len );
+		linestart = line[len -1] == '\n';
+		if ( linestart )
+			lines++;
+	}
+
+	if ( fclose( out ) != 0 )
+		fprintf( stderr, "%s: %s\n", outname, strerror(errno) );
+	fclose( in );
+	free( pending );
+
+	printf( "%s: recovered %lu blocks (%lu lines) to %s.\n", inname, goodblocks, goodlines, outname );
+	if ( badblocks > 0 )
+		printf( "%lu damaged blocks (%lu lines) were skipped.\n", badblocks, badlines );
+	if ( pendinglen > 0 )
+		printf( "The file ends in an incomplete block of %lu lines, which was discarded.\n", lines );
+
+	return ( badblocks == 0 && pendinglen == 0 ) ? 0 : 1;
+}
+
+//-----------------------------------------------------------------------------
+// Name: RecvAll()
+// Desc: Read exactly len bytes from a socket, unless the deadline passes first.
+//-----------------------------------------------------------------------------
+static bool RecvAll( SOCKET s, char * buf, int len, DWORD deadline )
+{
+	while ( len > 0 ) {
+		fd_set readable;
+		LONG left = (LONG)(deadline - GetTickCount());
+		if ( left <= 0 )
+			return false;
+
+		struct timeval timeout = { left / 1000, (left % 1000) * 1000 };
+		FD_ZERO( &readable );
+		FD_SET( s, &readable );
+		if ( select( 0, &readable, NULL, NULL, &timeout ) <= 0 )
+			return false;
+
+		int n = recv( s, buf, len, 0 );
+		if ( n <= 0 )
+			return false;
+		buf += n;
+		len -= n;
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Name: SubscribeTest()
+// Desc: Subscribe to a running monitor's stream for a while, check the frames,
+//       and report the delivery rate. Returns 0 if nothing was missed, 1 if
+//       frames or records were dropped or damaged, or 2 if it couldn't be done
+//       at all.
+//-----------------------------------------------------------------------------
+int SubscribeTest( int port, int secs )
+{
+	WSADATA wsadata;
+	SOCKET s;
+	struct sockaddr_in addr;
+	JOYMON_FRAME frame;
+	static JOYREC recs[65536 / sizeof(JOYREC)];
+	unsigned long frames = 0, records = 0, gaps = 0, bad = 0, dropped = 0, lost = 0;
+	DWORD lostbefore = 0;
+	LONGLONG firsttime = 0, lasttime = 0;
+	DWORD seq = 0, started, deadline;
+
+	if ( WSAStartup( MAKEWORD(2,2), &wsadata ) != 0 ) {
+		fprintf( stderr, "Couldn't start Winsock\n" );
+		return 2;
+	}
+
+	memset( &addr, 0, sizeof addr );
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons( (u_short)port );
+	addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+
+	if ( (s = socket( AF_INET, SOCK_STREAM, IPPROTO_TCP )) == INVALID_SOCKET ||
+		 connect( s, (struct sockaddr *)&addr, sizeof addr ) != 0 ) {
+		fprintf( stderr, "Couldn't connect to port %d; is the monitor streaming there?\n", port );
+		if ( s != INVALID_SOCKET )
+			closesocket( s );
+		WSACleanup();
+		return 2;
+	}
+
+	started = GetTickCount();
+	deadline = started + secs * 1000;
+	fprintf( stderr, "Listening on port %d for %d seconds...\n", port, secs );
+
+	while ( RecvAll( s, (char *)&frame, sizeof frame, deadline ) ) {
+		if ( frame.magic != JOYMON_FRAME_MAGIC || frame.recsize != sizeof(JOYREC) ||
+			 frame.count * sizeof(JOYREC) > sizeof recs ) {
+			// We can't find the next frame after this, so give up.
+			bad++;
+			break;
+		}
+		if ( !RecvAll( s, (char *)recs, frame.count * sizeof(JOYREC), deadline ) )
+			break;
+
+		if ( frames > 0 && frame.seq != seq + 1 )
+			gaps += frame.seq - seq - 1;
+		seq = frame.seq;
+		dropped = frame.dropped;
+		if ( frames == 0 )
+			lostbefore = frame.lost;	// before we were listening
+		lost = frame.lost - lostbefore;
+
+		for ( int i = 0; i < frame.count; i++ ) {
+			if ( frames == 0 && i == 0 )
+				firsttime = recs[i].time;
+			else if ( recs[i].time < lasttime && recs[i].type == JOYREC_SAMPLE )
+				bad++;		// out of order
+			lasttime = recs[i].time;
+		}
+
+		frames++;
+		records += frame.count;
+	}
+
+	closesocket( s );
+	WSACleanup();
+
+	double elapsed = (GetTickCount() - started) / 1000.0;
+	printf( "%lu frames, %lu records in %.1f s: %.1f records/s\n",
+		frames, records, elapsed, elapsed > 0 ? records / elapsed : 0.0 );
+	if ( lasttime > firsttime )
+		printf( "Records span %.3f s of session clock: %.1f records/s as sampled\n",
+			(lasttime - firsttime) / 1e6, records / ((lasttime - firsttime) / 1e6) );
+	printf( "%lu frames missing, %lu reported dropped for being slow, %lu bad\n", gaps, dropped, bad );
+	printf( "%lu records lost before they were framed, as the monitor's publisher fell behind\n", lost );
+
+	return (gaps > 0 || bad > 0 || lost > 0) ? 1 : 0;
+}
+
+//-----------------------------------------------------------------------------
+// Name: SendMarker()
+// Desc: Send a marker to a running monitor. Returns the process exit code.
+//-----------------------------------------------------------------------------
+int SendMarker( int port, const char * text )
+{
+	WSADATA wsadata;
+	SOCKET s;
+	struct sockaddr_in addr;
+	int len = (int)strlen( text );
+
+	if ( WSAStartup( MAKEWORD(2,2), &wsadata ) != 0 ) {
+		fprintf( stderr, "Couldn't start Winsock\n" );
+		return 2;
+	}
+
+	memset( &addr, 0, sizeof addr );
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons( (u_short)port );
+	addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+
+	// It's a datagram, so there's no telling whether anyone was listening.
+	if ( (s = socket( AF_INET, SOCK_DGRAM, IPPROTO_UDP )) == INVALID_SOCKET ||
+		 sendto( s, text, len, 0, (struct sockaddr *)&addr, sizeof addr ) != len ) {
+		fprintf( stderr, "Couldn't send the marker to port %d\n", port );
+		if ( s != INVALID_SOCKET )
+			closesocket( s );
+		WSACleanup();
+		return 2;
+	}
+
+	closesocket( s );
+	WSACleanup();
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// Name: FormatMicros()
+// Desc: Format microseconds as seconds, exactly.
+//-----------------------------------------------------------------------------
+static char * FormatMicros( char * buf, size_t len, LONGLONG t )
+{
+	ULONGLONG u = t < 0 ? (ULONGLONG)-t : (ULONGLONG)t;
+	_snprintf( buf, len, "%s%I64u.%06u", t < 0 ? "-" : "", u / 1000000, (unsigned)(u % 1000000) );
+	buf[len -1] = 0;
+	return buf;
+}
+
+// A point where the session clock is known on the target clock.
+typedef struct {
+	LONGLONG	session, target, uncertainty;	// microsecs
+} TIMEPOINT;
+
+static int CompareTimePoints( const void * a, const void * b )
+{
+	LONGLONG d = ((const TIMEPOINT *)a)->session - ((const TIMEPOINT *)b)->session;
+	return d < 0 ? -1 : d > 0;
+}
+
+//-----------------------------------------------------------------------------
+// Name: MapTime()
+// Desc: Map a session time onto the target clock. Between two points it's
+//       interpolated, and good to the worse of their uncertainties; beyond
+//       them it's extrapolated at the fitted rate, allowing 10 ppm of wander.
+//-----------------------------------------------------------------------------
+static void MapTime( const TIMEPOINT * p, int n, double rate, LONGLONG t, LONGLONG& mapped, LONGLONG& bound )
+{
+	int lo = 0, hi = n - 1;
+
+	if ( t <= p[0].session || t >= p[n-1].session ) {
+		const TIMEPOINT& end = t <= p[0].session ? p[0] : p[n-1];
+		LONGLONG dist = t - end.session;
+		mapped = end.target + (LONGLONG)floor( dist * rate + 0.5 );
+		bound = end.uncertainty + (dist < 0 ? -dist : dist) / 100000;
+		return;
+	}
+
+	// Find p[lo].session <= t < p[lo+1].session
+	while ( hi - lo > 1 ) {
+		int mid = (lo + hi) / 2;
+		if ( p[mid].session <= t )
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	double f = (double)(t - p[lo].session) / (double)(p[hi].session - p[lo].session);
+	mapped = p[lo].target + (LONGLONG)floor( f * (double)(p[hi].target - p[lo].target) + 0.5 );
+	bound = max( p[lo].uncertainty, p[hi].uncertainty );
+}
+
+//-----------------------------------------------------------------------------
+// Name: TimeMap()
+// Desc: Copy an output file, putting every sample and #! record on absolute
+//       time, using the anchor records (or the external reference refname),
+//       with the error bound in microsecs after each time. Returns 0 if all
+//       was well, or 2 if it couldn't be done.
+//-----------------------------------------------------------------------------
+int TimeMap( const char * inname, const char * outname, const char * refname )
+{
+	FILE * in, * out;
+	char line[1024], text[64], name[64];
+	TIMEPOINT * points = NULL;
+	int n = 0, allocated = 0, i;
+	double secs, value;
+
+	if ( (in = fopen( inname, "r" )) == NULL ) {
+		fprintf( stderr, "Couldn't open %s: %s\n", inname, strerror(errno) );
+		return 2;
+	}
+
+	// First find every point where the clocks were compared.
+	while ( fgets( line, sizeof line, in ) != NULL ) {
+		TIMEPOINT p;
+		LONGLONG whole;
+		char frac[8];
+
+		if ( refname == NULL && strncmp( line, "#! anchor,", 10 ) == 0 &&
+			 sscanf( &line[10], "%lf,%I64d.%6[0-9],%I64d", &secs, &whole, frac, &p.uncertainty ) == 4 ) {
+			strncat( frac, "000000", 6 - strlen(frac) );
+			p.target = whole * 1000000 + atoi( frac );
+		} else if ( refname != NULL && strncmp( line, "#! reference,", 13 ) == 0 &&
+			 sscanf( &line[13], "%lf,%63[^,],%lf", &secs, name, &value ) == 3 && strcmp( name, refname ) == 0 ) {
+			p.target = (LONGLONG)floor( value * 1000000.0 + 0.5 );
+			p.uncertainty = 0;		// worked out from the fit, below
+		} else {
+			continue;
+		}
+		p.session = (LONGLONG)floor( secs * 1000000.0 + 0.5 );
+
+		if ( n == allocated ) {
+			allocated = allocated ? allocated * 2 : 256;
+			TIMEPOINT * more = (TIMEPOINT *)realloc( points, allocated * sizeof *points );
+			if ( more == NULL ) {
+				fprintf( stderr, "Out of memory\n" );
+				free( points );
+				fclose( in );
+				return 2;
+			}
+			points = more;
+		}
+		points[n++] = p;
+	}
+
+	if ( n == 0 ) {
+		fprintf( stderr, "%s has no %s records to map times with\n", inname, refname ? "matching reference" : "anchor" );
+		fclose( in );
+		free( points );
+		return 2;
+	}
+	qsort( points, n, sizeof *points, CompareTimePoints );
+
+	// Fit a straight line through the offsets, for the overall drift.
+	double Sx = 0, Sy = 0, Sxx = 0, Sxy = 0, d, drift = 0, a, worst = 0;
+	LONGLONG offset0 = points[0].target - points[0].session;
+	for ( i = 0; i < n; i++ ) {
+		double x = points[i].session / 1000000.0, y = (double)(points[i].target - points[i].session - offset0);
+		Sx += x; Sy += y; Sxx += x * x; Sxy += x * y;
+	}
+	d = n * Sxx - Sx * Sx;
+	if ( n >= 2 && d > 0 )
+		drift = (n * Sxy - Sx * Sy) / d;
+	a = (Sy - drift * Sx) / n;
+
+	// A reference is only read when its message arrives, so how far the points
+	// stray from the line is the best measure of how good they are.
+	if ( refname != NULL ) {
+		for ( i = 0; i < n; i++ ) {
+			double r = fabs( (double)(points[i].target - points[i].session - offset0) - (a + drift * points[i].session / 1000000.0) );
+			if ( r > worst )
+				worst = r;
+		}
+		for ( i = 0; i < n; i++ )
+			points[i].uncertainty = (LONGLONG)ceil( worst ) + 1;
+	}
+
+	if ( (out = fopen( outname, "w" )) == NULL ) {
+		fprintf( stderr, "Couldn't create %s: %s\n", outname, strerror(errno) );
+		fclose( in );
+		free( points );
+		return 2;
+	}
+
+	if ( refname != NULL )
+		fprintf( out, "# Times mapped to reference `%s' ", refname );
+	else
+		fprintf( out, "# Times mapped to wall clock (seconds since 1970 UTC) " );
+	fprintf( out, "using %d points, drift %.3f ppm\n# Each time is followed by its error bound in microseconds\n", n, drift );
+
+	rewind( in );
+	while ( fgets( line, sizeof line, in ) != NULL ) {
+		char * start = line, * end;
+		LONGLONG mapped, bound;
+
+		// The block trailers don't survive the changes.
+		if ( strncmp( line, BlockTrailer, strlen(BlockTrailer) ) == 0 )
+			continue;
+
+		// Samples start with their time, #! records have it after their type.
+		if ( strncmp( line, EventRecord, strlen(EventRecord) ) == 0 ) {
+			if ( (start = strchr( line, ',' )) == NULL ) {
+				fputs( line, out );
+				continue;
+			}
+			start++;
+		} else if ( line[0] == '#' ) {
+			fputs( line, out );
+			continue;
+		}
+
+		secs = strtod( start, &end );
+		if ( end == start || *end != ',' ) {
+			fputs( line, out );
+			continue;
+		}
+
+		// The time's only as good as the digits it was written with, too.
+		const char * dot = (const char *)memchr( start, '.', end - start );
+		int digits = dot ? (int)(end - dot - 1) : 0;
+		LONGLONG rounding = digits >= 6 ? 0 : (LONGLONG)(500000.0 / pow( 10.0, digits ));
+
+		MapTime( points, n, 1.0 + drift / 1000000.0, (LONGLONG)floor( secs * 1000000.0 + 0.5 ), mapped, bound );
+		fprintf( out, "%.*s%s,%I64d%s", (int)(start - line), line, FormatMicros( text, sizeof text, mapped ), bound + rounding, end );
+	}
+
+	if ( ferror( in ) || ferror( out ) ) {
+		fprintf( stderr, "Error reading %s or writing %s\n", inname, outname );
+		fclose( in );
+		fclose( out );
+		free( points );
+		return 2;
+	}
+
+	fclose( in );
+	fclose( out );
+	free( points );
+	printf( "Mapped %s to %s using %d points; drift %.3f ppm\n", inname, outname, n, drift );
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// Name: RawHeader()
+// Desc: Read a raw capture's banner line, if that's what line is.
+//-----------------------------------------------------------------------------
+bool RawHeader( const char * line, LONG lo[2], LONG hi[2], bool& origin )
+{
+	if ( strncmp( line, RawBanner, sizeof RawBanner -1 ) != 0 ||
+		 sscanf( line + sizeof RawBanner -1, "x %ld..%ld, y %ld..%ld", &lo[0], &hi[0], &lo[1], &hi[1] ) != 4 ||
+		 hi[0] <= lo[0] || hi[1] <= lo[1] )
+		return false;
+
+	origin = strstr( line, "origin lower left" ) != NULL;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Name: RawToRange()
+// Desc: Scale a raw axis value in lo..hi to -range..range.
+//-----------------------------------------------------------------------------
+LONG RawToRange( LONG v, LONG lo, LONG hi, LONG range )
+{
+	return (LONG)floor( (2.0 * v - lo - hi) * range / (hi - lo) + 0.5 );
+}
+
+//-----------------------------------------------------------------------------
+// Name: RawProject()
+// Desc: Turn a raw sample into what would have been written live with an axis
+//       maximum of range: scaled, Y flipped, and kept to the top right quadrant
+//       if the origin was lower left.
+//-----------------------------------------------------------------------------
+void RawProject( LONG& x, LONG& y, const LONG lo[2], const LONG hi[2], bool origin, LONG range )
+{
+	x = RawToRange( x, lo[0], hi[0], range );
+	y = -RawToRange( y, lo[1], hi[1], range );
+	if ( origin ) {
+		if ( x < 0 ) x = 0;
+		if ( y < 0 ) y = 0;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Name: RescaleFile()
+// Desc: Copy a raw capture, scaling every sample to an axis maximum of range
+//       (or the one it was recorded with, if that's zero). Returns 0 if all
+//       was well, or 2 if it couldn't be done.
+//-----------------------------------------------------------------------------
+int RescaleFile( const char * inname, const char * outname, LONG range )
+{
+	FILE * in, * out;
+	char line[1024];
+	LONG lo[2], hi[2], v[9];
+	unsigned long samples = 0;
+	bool raw = false, origin = false;
+
+	if ( (in = fopen( inname, "r" )) == NULL ) {
+		fprintf( stderr, "Couldn't open %s: %s\n", inname, strerror(errno) );
+		return 2;
+	}
+
+	// The banner's all at the top.
+	while ( fgets( line, sizeof line, in ) != NULL && line[0] == '#' ) {
+		if ( RawHeader( line, lo, hi, origin ) )
+			raw = true;
+		else if ( range <= 0 && strncmp( line, "# Axes maximum value:", 21 ) == 0 )
+			range = atol( &line[21] );
+	}
+	if ( !raw ) {
+		fprintf( stderr, "%s isn't a raw capture\n", inname );
+		fclose( in );
+		return 2;
+	}
+	if ( range <= 0 )
+		range = 1000;
+
+	if ( (out = fopen( outname, "w" )) == NULL ) {
+		fprintf( stderr, "Couldn't create %s: %s\n", outname, strerror(errno) );
+		fclose( in );
+		return 2;
+	}
+
+	rewind( in );
+	while ( fgets( line, sizeof line, in ) != NULL ) {
+		char * comma = strchr( line, ',' );
+		int fields, len, i;
+
+		// The block trailers don't survive the changes.
+		if ( strncmp( line, BlockTrailer, strlen(BlockTrailer) ) == 0 )
+			continue;
+
+		if ( line[0] == '#' ) {
+			if ( strncmp( line, RawBanner, sizeof RawBanner -1 ) == 0 )
+				fprintf( out, "# Rescaled from raw device units: x %ld..%ld, y %ld..%ld\n", lo[0], hi[0], lo[1], hi[1] );
+			else if ( strncmp( line, "# Axes maximum value:", 21 ) == 0 )
+				fprintf( out, "# Axes maximum value: %ld\n", range );
+			else
+				fputs( line, out );
+			continue;
+		}
+
+		// The time's copied as it is; what follows is x, y, the button if it's
+		// there, and the min and max columns if they are.
+		fields = comma == NULL ? 0 : sscanf( comma, ",%ld,%ld,%ld,%ld,%ld,%ld,%ld,%ld,%ld",
+											  &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7], &v[8] );
+		if ( fields < 2 ) {
+			fputs( line, out );
+			continue;
+		}
+
+		RawProject( v[0], v[1], lo, hi, origin, range );
+		len = fields % 2 ? 3 : 2;
+		if ( fields >= len + 4 ) {
+			// Flipping Y swaps its min and max over.
+			LONG * env = &v[len];
+			LONG minx = env[0], maxx = env[1], miny = env[2], maxy = env[3];
+			RawProject( minx, maxy, lo, hi, origin, range );
+			RawProject( maxx, miny, lo, hi, origin, range );
+			env[0] = minx; env[1] = maxx; env[2] = maxy; env[3] = miny;
+		}
+
+		fprintf( out, "%.*s,%5ld,%5ld", (int)(comma - line), line, v[0], v[1] );
+		for ( i = 2; i < fields; i++ )
+			fprintf( out, i == 2 && len == 3 ? ",%2ld" : ",%5ld", v[i] );
+		fputc( '\n', out );
+		samples++;
+	}
+
+	if ( ferror( in ) || ferror( out ) ) {
+		fprintf( stderr, "Error reading %s or writing %s\n", inname, outname );
+		fclose( in );
+		fclose( out );
+		return 2;
+	}
+
+	fclose( in );
+	fclose( out );
+	printf( "Rescaled %lu samples from %s to %s, axis maximum %ld\n", samples, inname, outname, range );
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// Name: PoolRun()
+// Desc: Do items 0..items-1 on a pool of threads, one per processor, calling
+//       work for each. Each thread starts with its own run of items, and one
+//       that finishes early takes half of what's left of another's, so the
+//       load evens out however uneven the items are. This thread is worker 0.
+//       Returns how many workers there were.
+//-----------------------------------------------------------------------------
+int PoolRun( int items, POOLWORK work, void * context )
+{
+	SYSTEM_INFO si;
+	HANDLE threads[MAX_POOL];
+	int i;
+
+	GetSystemInfo( &si );
+	g_Pool.workers = max( 1, min( (int)si.dwNumberOfProcessors, min( items, MAX_POOL ) ) );
+	g_Pool.work = work;
+	g_Pool.context = context;
+	for ( i = 0; i < g_Pool.workers; i++ ) {
+		InitializeCriticalSection( &g_Pool.queue[i].lock );
+		g_Pool.queue[i].head = (int)((LONGLONG)items * i / g_Pool.workers);
+		g_Pool.queue[i].tail = (int)((LONGLONG)items * (i + 1) / g_Pool.workers);
+	}
+
+	// A thread that doesn't start just leaves its items for the others to take.
+	for ( i = 1; i < g_Pool.workers; i++ )
+		threads[i] = CreateThread( NULL, 0, PoolThreadProc, (LPVOID)(INT_PTR)i, 0, NULL );
+	PoolThreadProc( (LPVOID)0 );
+
+	for ( i = 1; i < g_Pool.workers; i++ ) {
+		if ( threads[i] != NULL ) {
+			WaitForSingleObject( threads[i], INFINITE );
+			CloseHandle( threads[i] );
+		}
+	}
+	for ( i = 0; i < g_Pool.workers; i++ )
+		DeleteCriticalSection( &g_Pool.queue[i].lock );
+
+	return g_Pool.workers;
+}
+
+//-----------------------------------------------------------------------------
+// Name: PoolSteal()
+// Desc: Take the far half of the next worker's queue that has anything left.
+//       Returns false if they're all empty.
+//-----------------------------------------------------------------------------
+static bool PoolSteal( int self )
+{
+	POOLQUEUE& mine = g_Pool.queue[self];
+
+	for ( int i = 1; i < g_Pool.workers; i++ ) {
+		POOLQUEUE& victim = g_Pool.queue[(self + i) % g_Pool.workers];
+		int head, tail;
+
+		EnterCriticalSection( &victim.lock );
+		tail = victim.tail;
+		head = victim.tail = victim.head + (victim.tail - victim.head) / 2;
+		LeaveCriticalSection( &victim.lock );
+
+		if ( head < tail ) {
+			EnterCriticalSection( &mine.lock );
+			mine.head = head;
+			mine.tail = tail;
+			LeaveCriticalSection( &mine.lock );
+			return true;
+		}
+	}
+
+	return false;
+}
+
+//-----------------------------------------------------------------------------
+// Name: PoolThreadProc()
+// Desc: A pool worker: do its own items from the front, then steal, until
+//       there's nothing left anywhere.
+//-----------------------------------------------------------------------------
+DWORD WINAPI PoolThreadProc( LPVOID lpParameter )
+{
+	const int self = (int)(INT_PTR)lpParameter;
+	POOLQUEUE& mine = g_Pool.queue[self];
+
+	for ( ;; ) {
+		int item = -1;
+
+		EnterCriticalSection( &mine.lock );
+		if ( mine.head < mine.tail )
+			item = mine.head++;
+		LeaveCriticalSection( &mine.lock );
+
+		if ( item >= 0 )
+			g_Pool.work( item, self, g_Pool.context );
+		else if ( !PoolSteal( self ) )
+			break;
+	}
+
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// Name: JoinPath()
+// Desc: Put a name on the end of a folder, either of which may be empty.
+//-----------------------------------------------------------------------------
+static char * JoinPath( char * buf, size_t len, const char * folder, const char * name )
+{
+	_snprintf( buf, len, "%s%s%s", folder, folder[0] && name[0] ? "\\" : "", name );
+	buf[len -1] = 0;
+	return buf;
+}
+
+//-----------------------------------------------------------------------------
+// Name: FindFiles()
+// Desc: Add the files in folder top\sub, and all the folders below it, whose
+//       names match the wildcard match, to list. With no wildcard, take the
+//       files JoyMon writes, which end in a three digit number. Names are kept
+//       relative to top. Returns false if it ran out of memory.
+//-----------------------------------------------------------------------------
+bool FindFiles( const char * top, const char * sub, const char * match, FILELIST& list )
+{
+	WIN32_FIND_DATA fd;
+	HANDLE hFind;
+	char path[MAX_PATH], folder[MAX_PATH], name[MAX_PATH];
+	bool ok = true;
+
+	JoinPath( folder, sizeof folder, top, sub );
+
+	if ( (hFind = FindFirstFile( JoinPath( path, sizeof path, folder, match ? match : "*.???" ), &fd )) != INVALID_HANDLE_VALUE ) {
+		do {
+			const char * ext = strrchr( fd.cFileName, '.' );
+			if ( fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY )
+				continue;
+			if ( match == NULL && !(ext != NULL && strlen( ext ) == 4 &&
+				 isdigit( (unsigned char)ext[1] ) && isdigit( (unsigned char)ext[2] ) && isdigit( (unsigned char)ext[3] )) )
+				continue;
+
+			if ( list.n == list.allocated ) {
+				int allocated = list.allocated ? list.allocated * 2 : 1024;
+				char ** names = (char **)realloc( list.name, allocated * sizeof *names );
+				if ( names == NULL ) {
+					ok = false;
+					break;
+				}
+				list.name = names;
+				list.allocated = allocated;
+			}
+			if ( (list.name[list.n] = _strdup( JoinPath( name, sizeof name, sub, fd.cFileName ) )) == NULL ) {
+				ok = false;
+				break;
+			}
+			list.bytes += ((ULONGLONG)fd.nFileSizeHigh << 32) | fd.nFileSizeLow;
+			list.n++;
+		} while ( FindNextFile( hFind, &fd ) );
+		FindClose( hFind );
+	}
+
+	if ( ok && (hFind = FindFirstFile( JoinPath( path, sizeof path, folder, "*" ), &fd )) != INVALID_HANDLE_VALUE ) {
+		do {
+			if ( (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && strcmp( fd.cFileName, "." ) != 0 && strcmp( fd.cFileName, ".." ) != 0 )
+				ok = FindFiles( top, JoinPath( name, sizeof name, sub, fd.cFileName ), match, list );
+		} while ( ok && FindNextFile( hFind, &fd ) );
+		FindClose( hFind );
+	}
+
+	return ok;
+}
+
+//-----------------------------------------------------------------------------
+// Name: FreeFiles()
+// Desc: Empty a list of files.
+//-----------------------------------------------------------------------------
+void FreeFiles( FILELIST& list )
+{
+	for ( int i = 0; i < list.n; i++ )
+		free( list.name[i] );
+	free( list.name );
+	memset( &list, 0, sizeof list );
+}
+
+//-----------------------------------------------------------------------------
+// Name: MapWhole()
+// Desc: Map a whole file to read. An empty file maps as no data. Returns
+//       false if it can't be read.
+//-----------------------------------------------------------------------------
+bool MapWhole( const char * name, MAPPEDFILE& m )
+{
+	LARGE_INTEGER size;
+
+	memset( &m, 0, sizeof m );
+	if ( (m.hFile = CreateFile( name, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+							    OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL )) == INVALID_HANDLE_VALUE ) {
+		m.hFile = NULL;
+		return false;
+	}
+	if ( !GetFileSizeEx( m.hFile, &size ) || size.QuadPart > (SIZE_T)-1 / 2 ||
+		 (size.QuadPart > 0 &&
+		  ((m.hMap = CreateFileMapping( m.hFile, NULL, PAGE_READONLY, 0, 0, NULL )) == NULL ||
+		   (m.data = (const char *)MapViewOfFile( m.hMap, FILE_MAP_READ, 0, 0, 0 )) == NULL)) ) {
+		UnmapWhole( m );
+		return false;
+	}
+
+	m.size = (size_t)size.QuadPart;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Name: UnmapWhole()
+// Desc: Finish with a file from MapWhole().
+//-----------------------------------------------------------------------------
+void UnmapWhole( MAPPEDFILE& m )
+{
+	if ( m.data != NULL )
+		UnmapViewOfFile( m.data );
+	if ( m.hMap != NULL )
+		CloseHandle( m.hMap );
+	if ( m.hFile != NULL )
+		CloseHandle( m.hFile );
+	memset( &m, 0, sizeof m );
+}
+
+//-----------------------------------------------------------------------------
+// Name: ScanNewline()
+// Desc: Find the end of the line at p: the next newline, or end. Sixteen
+//       bytes at a time, since most of a file's time goes on this.
+//-----------------------------------------------------------------------------
+static const char * ScanNewline( const char * p, const char * end )
+{
+	const __m128i newline = _mm_set1_epi8( '\n' );
+	unsigned long bit;
+
+	for ( ; end - p >= 16; p += 16 ) {
+		int mask = _mm_movemask_epi8( _mm_cmpeq_epi8( _mm_loadu_si128( (const __m128i *)p ), newline ) );
+		if ( mask != 0 ) {
+			_BitScanForward( &bit, (unsigned long)mask );
+			return p + bit;
+		}
+	}
+	while ( p < end && *p != '\n' )
+		p++;
+	return p;
+}
+
+//-----------------------------------------------------------------------------
+// Name: ScanSample()
+// Desc: Read the sample on a line (without its newline): the time, to the
+//       microsec, and up to max values after it. Returns how many values, or
+//       -1 with what's wrong with it in *err.
+//-----------------------------------------------------------------------------
+static int ScanSample( const char * p, const char * end, LONGLONG& time, LONG * v, int max, const char ** err )
+{
+	LONGLONG whole = 0, value;
+	LONG frac = 0;
+	int n = 0, digits = 0, places = 0;
+	bool negative;
+
+	while ( p < end && *p == ' ' )
+		p++;
+	if ( (negative = p < end && *p == '-') )
+		p++;
+	for ( ; p < end && (unsigned)(*p - '0') < 10; p++, digits++ ) {
+		if ( (whole = whole * 10 + (*p - '0')) > 1000000000000LL ) {
+			*err = "time out of range";
+			return -1;
+		}
+	}
+	if ( p < end && *p == '.' ) {
+		for ( p++; p < end && (unsigned)(*p - '0') < 10; p++, digits++ ) {
+			if ( places < 6 ) {
+				frac = frac * 10 + (*p - '0');
+				places++;
+			}
+		}
+	}
+	if ( digits == 0 ) {
+		*err = "no time";
+		return -1;
+	}
+	for ( ; places < 6; places++ )
+		frac *= 10;
+	time = whole * 1000000 + frac;
+	if ( negative )
+		time = -time;
+
+	while ( p < end ) {
+		if ( *p != ',' ) {
+			*err = "unexpected character";
+			return -1;
+		}
+		if ( n == max ) {
+			*err = "too many columns";
+			return -1;
+		}
+		for ( p++; p < end && *p == ' '; p++ )
+			;
+		if ( (negative = p < end && *p == '-') )
+			p++;
+		for ( value = 0, digits = 0; p < end && (unsigned)(*p - '0') < 10; p++, digits++ ) {
+			if ( (value = value * 10 + (*p - '0')) > MAXLONG ) {
+				*err = "number out of range";
+				return -1;
+			}
+		}
+		if ( digits == 0 ) {
+			*err = "missing number";
+			return -1;
+		}
+		while ( p < end && *p == ' ' )
+			p++;
+		v[n++] = (LONG)(negative ? -value : value);
+	}
+
+	if ( n < 2 ) {
+		*err = "too few columns";
+		return -1;
+	}
+	return n;
+}
+
+//-----------------------------------------------------------------------------
+// Name: ConvertReport()
+// Desc: Say what's wrong with a line of a file being converted, or with the
+//       whole file if line is zero. Only the first few bad lines of a file
+//       are reported; the rest are just counted.
+//-----------------------------------------------------------------------------
+static void ConvertReport( CONVERTFILE& f, unsigned long line, const char * what )
+{
+	if ( line > 0 && ++f.malformed > CONVERT_REPORTS )
+		return;
+
+	EnterCriticalSection( &f.job->print );
+	if ( line > 0 )
+		printf( "%s(%lu): %s\n", f.name, line, what );
+	else
+		printf( "%s: %s\n", f.name, what );
+	LeaveCriticalSection( &f.job->print );
+}
+
+//-----------------------------------------------------------------------------
+// Name: ConvertFlush()
+// Desc: Write out the comment lines and samples gathered so far, each as a
+//       block, with the file header first if it's still to be done.
+//-----------------------------------------------------------------------------
+static bool ConvertFlush( CONVERTFILE& f )
+{
+	JOYMON_COLBLOCK block;
+	int c;
+
+	if ( !f.started ) {
+		JOYMON_COLHEADER header;
+		header.magic = JOYMON_COL_MAGIC;
+		header.version = JOYMON_COL_VERSION;
+		header.columns = (WORD)f.columns;
+		header.flags = (WORD)(f.columns % 2 ? JOYMON_COL_BUTTON : 0);
+		header.blockrows = CONVERT_BLOCK_ROWS;
+		if ( fwrite( &header, sizeof header, 1, f.out ) != 1 )
+			return false;
+		f.started = true;
+	}
+
+	block.magic = JOYMON_BLOCK_MAGIC;
+	block.reserved = 0;
+
+	if ( f.textrows > 0 ) {
+		block.type = JOYMON_BLOCK_TEXT;
+		block.rows = f.textrows;
+		block.size = (DWORD)f.textlen;
+		block.crc = Crc32c( 0, f.text, f.textlen );
+		if ( fwrite( &block, sizeof block, 1, f.out ) != 1 || fwrite( f.text, 1, f.textlen, f.out ) != f.textlen )
+			return false;
+		f.textrows = 0;
+		f.textlen = 0;
+	}
+
+	if ( f.rows > 0 ) {
+		block.type = JOYMON_BLOCK_SAMPLES;
+		block.rows = f.rows;
+		block.size = f.rows * (sizeof(LONGLONG) + f.columns * sizeof(LONG));
+		block.crc = Crc32c( 0, f.time, f.rows * sizeof(LONGLONG) );
+		for ( c = 0; c < f.columns; c++ )
+			block.crc = Crc32c( block.crc, f.column[c], f.rows * sizeof(LONG) );
+		if ( fwrite( &block, sizeof block, 1, f.out ) != 1 || fwrite( f.time, sizeof(LONGLONG), f.rows, f.out ) != f.rows )
+			return false;
+		for ( c = 0; c < f.columns; c++ )
+			if ( fwrite( f.column[c], sizeof(LONG), f.rows, f.out ) != f.rows )
+				return false;
+		f.rows = 0;
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Name: ConvertFile()
+// Desc: Convert one text file to the columnar format. Lines that aren't
+//       samples or comments are reported and left out. Returns false if the
+//       file couldn't be read or written at all.
+//-----------------------------------------------------------------------------
+static bool ConvertFile( const char * inname, const char * outname, CONVERTFILE& f )
+{
+	MAPPEDFILE m;
+	const char * p, * end, * next, * err;
+	unsigned long line = 0;
+	LONGLONG time;
+	LONG v[CONVERT_MAX_COLUMNS];
+	bool ok = true;
+
+	if ( !MapWhole( inname, m ) ) {
+		ConvertReport( f, 0, "couldn't be read" );
+		return false;
+	}
+	if ( (f.out = fopen( outname, "wb" )) == NULL ) {
+		ConvertReport( f, 0, strerror(errno) );
+		UnmapWhole( m );
+		return false;
+	}
+	f.bytes += m.size;
+
+	for ( p = m.data, end = m.data + m.size; ok && p < end && *p != 0; p = next ) {
+		const char * eol = ScanNewline( p, end );
+		size_t len = eol - p;
+		next = eol < end ? eol + 1 : end;
+		line++;
+
+		if ( len > 0 && p[len -1] == '\r' )
+			len--;
+		if ( len == 0 )
+			continue;
+
+		// Banner lines, markers and the like are kept, in order, as text. The
+		// block CRCs do the job of the block trailers.
+		if ( *p == '#' ) {
+			if ( len >= sizeof BlockTrailer -1 && memcmp( p, BlockTrailer, sizeof BlockTrailer -1 ) == 0 )
+				continue;
+			if ( f.textlen + sizeof(DWORD) + len + 1 > f.textsize ) {
+				size_t newsize = max( f.textsize * 2, f.textlen + sizeof(DWORD) + len + 1 );
+				char * text = (char *)realloc( f.text, newsize );
+				if ( text == NULL ) {
+					ConvertReport( f, line, "out of memory" );
+					ok = false;
+					break;
+				}
+				f.text = text;
+				f.textsize = newsize;
+			}
+			DWORD row = (DWORD)f.samples;
+			memcpy( f.text + f.textlen, &row, sizeof row );
+			memcpy( f.text + f.textlen + sizeof row, p, len );
+			f.text[f.textlen + sizeof row + len] = 0;
+			f.textlen += sizeof row + len + 1;
+			f.textrows++;
+			continue;
+		}
+
+		int fields = ScanSample( p, p + len, time, v, CONVERT_MAX_COLUMNS, &err );
+		if ( fields < 0 ) {
+			ConvertReport( f, line, err );
+			continue;
+		}
+		if ( f.columns == 0 ) {
+			f.columns = fields;
+		} else if ( fields != f.columns ) {
+			char what[64];
+			_snprintf( what, sizeof what, "%d columns after the time, not %d", fields, f.columns );
+			what[sizeof what -1] = 0;
+			ConvertReport( f, line, what );
+			continue;
+		}
+
+		f.time[f.rows] = time;
+		for ( int c = 0; c < fields; c++ )
+			f.column[c][f.rows] = v[c];
+		f.samples++;
+		if ( ++f.rows == CONVERT_BLOCK_ROWS )
+			ok = ConvertFlush( f );
+	}
+
+	if ( ok )
+		ok = ConvertFlush( f );
+	if ( fclose( f.out ) != 0 )
+		ok = false;
+	f.out = NULL;
+	if ( !ok ) {
+		ConvertReport( f, 0, "couldn't be written" );
+		remove( outname );
+	}
+
+	UnmapWhole( m );
+	return ok;
+}
+
+//-----------------------------------------------------------------------------
+// Name: ConvertWork()
+// Desc: Convert one of a job's files, on one of the pool's threads.
+//-----------------------------------------------------------------------------
+static void ConvertWork( int item, int worker, void * context )
+{
+	CONVERTJOB& job = *(CONVERTJOB *)context;
+	CONVERTFILE *& f = job.file[worker];		// the worker's buffers, kept between files
+	char inname[MAX_PATH], outname[MAX_PATH];
+
+	job.stats[worker].files++;
+	if ( f == NULL && (f = (CONVERTFILE *)calloc( 1, sizeof *f )) == NULL ) {
+		job.stats[worker].failed++;
+		return;
+	}
+	f->job = &job;
+	f->name = job.files->name[item];
+	f->columns = f->rows = 0;
+	f->textrows = 0;
+	f->textlen = 0;
+	f->samples = f->malformed = f->bytes = 0;
+	f->started = false;
+
+	JoinPath( inname, sizeof inname, job.src, job.files->name[item] );
+	JoinPath( outname, sizeof outname, job.dst, job.files->name[item] );
+	strncat( outname, ".jmc", sizeof outname - strlen(outname) - 1 );
+
+	if ( !ConvertFile( inname, outname, *f ) )
+		job.stats[worker].failed++;
+	job.stats[worker].bytes += f->bytes;
+	job.stats[worker].samples += f->samples;
+	job.stats[worker].malformed += f->malformed;
+
+	if ( f->malformed > CONVERT_REPORTS ) {
+		EnterCriticalSection( &job.print );
+		printf( "%s: %I64u more malformed lines\n", f->name, f->malformed - CONVERT_REPORTS );
+		LeaveCriticalSection( &job.print );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Name: ConvertTree()
+// Desc: Convert a file, or every recording in a folder and the folders below
+//       it, to the columnar format, into the same places in the folder dst
+//       (or beside them). Returns 0 if all was well, 1 if some lines or files
+//       couldn't be converted, or 2 if nothing could be done.
+//-----------------------------------------------------------------------------
+int ConvertTree( const char * src, const char * dst, const char * match )
+{
+	CONVERTJOB job;
+	FILELIST files;
+	char top[MAX_PATH], path[MAX_PATH];
+	DWORD attrs;
+	int i, workers;
+
+	memset( &job, 0, sizeof job );
+	memset( &files, 0, sizeof files );
+	if ( (attrs = GetFileAttributes( src )) == INVALID_FILE_ATTRIBUTES ) {
+		fprintf( stderr, "Couldn't find %s\n", src );
+		return 2;
+	}
+
+	if ( attrs & FILE_ATTRIBUTE_DIRECTORY ) {
+		strncpy( top, src, sizeof top );
+		top[sizeof top -1] = 0;
+		if ( !FindFiles( top, "", match, files ) ) {
+			fprintf( stderr, "Out of memory listing %s\n", src );
+			FreeFiles( files );
+			return 2;
+		}
+	} else {
+		// Just the one, as a tree of one file.
+		const char * slash = max( strrchr( src, '\\' ), strrchr( src, '/' ) );
+		_snprintf( top, sizeof top, "%.*s", slash ? (int)(slash - src) : 0, src );
+		top[sizeof top -1] = 0;
+		if ( (files.name = (char **)malloc( sizeof *files.name )) == NULL ||
+			 (files.name[0] = _strdup( slash ? slash + 1 : src )) == NULL ) {
+			fprintf( stderr, "Out of memory\n" );
+			free( files.name );
+			return 2;
+		}
+		files.n = files.allocated = 1;
+	}
+	if ( files.n == 0 ) {
+		fprintf( stderr, "No recordings found in %s\n", src );
+		FreeFiles( files );
+		return 2;
+	}
+
+	// The output folders are made first, so the workers only have files to do.
+	job.src = top;
+	job.dst = dst ? dst : top;
+	job.files = &files;
+	if ( dst != NULL ) {
+		CreateDirectory( dst, NULL );
+		for ( i = 0; i < files.n; i++ ) {
+			for ( const char * p = files.name[i]; (p = strchr( p, '\\' )) != NULL; p++ ) {
+				_snprintf( path, sizeof path, "%s\\%.*s", dst, (int)(p - files.name[i]), files.name[i] );
+				path[sizeof path -1] = 0;
+				CreateDirectory( path, NULL );
+			}
+		}
+	}
+
+	InitializeCriticalSection( &job.print );
+	LONGLONG started = SessionClock();
+	workers = PoolRun( files.n, ConvertWork, &job );
+	double secs = (SessionClock() - started) / 1000000.0;
+	DeleteCriticalSection( &job.print );
+
+	for ( i = 0; i < workers; i++ ) {
+		if ( job.file[i] != NULL )
+			free( job.file[i]->text );
+		free( job.file[i] );
+	}
+	for ( i = 1; i < workers; i++ ) {
+		job.stats[0].files += job.stats[i].files;
+		job.stats[0].failed += job.stats[i].failed;
+		job.stats[0].bytes += job.stats[i].bytes;
+		job.stats[0].samples += job.stats[i].samples;
+		job.stats[0].malformed += job.stats[i].malformed;
+	}
+	printf( "Converted %lu files (%I64u samples, %.1f MB) in %.2f s on %d threads, %.1f MB/s\n",
+			job.stats[0].files - job.stats[0].failed, job.stats[0].samples, job.stats[0].bytes / 1048576.0,
+			secs, workers, secs > 0 ? job.stats[0].bytes / 1048576.0 / secs : 0.0 );
+	if ( job.stats[0].malformed > 0 || job.stats[0].failed > 0 )
+		printf( "%I64u malformed lines were left out; %lu files couldn't be converted\n",
+				job.stats[0].malformed, job.stats[0].failed );
+
+	FreeFiles( files );
+	return job.stats[0].malformed == 0 && job.stats[0].failed == 0 ? 0 : 1;
+}
+
+//-----------------------------------------------------------------------------
+// Name: VerifyText()
+// Desc: Check each block of a recording against its trailer. It's read as it
+//       is on disk, so the checksum, which was of the lines as written, skips
+//       the carriage returns that text mode added.
+//-----------------------------------------------------------------------------
+static void VerifyText( const char * p, const char * end, VERIFYFILE& v )
+{
+	const size_t taglen = sizeof BlockTrailer -1;
+	unsigned long crc = 0, lines = 0, number, wantlines, wantcrc;
+	bool pending = false;		// there's something since the last trailer
+	char trailer[96];
+
+	// Preallocated or crash-damaged files can end in a run of zeros.
+	while ( p < end && *p != 0 ) {
+		const char * nl = ScanNewline( p, end );
+		const char * eol = nl < end && nl > p && nl[-1] == '\r' ? nl -1 : nl;
+
+		if ( (size_t)(eol - p) > taglen && memcmp( p, BlockTrailer, taglen ) == 0 ) {
+			size_t len = min( (size_t)(eol - p), sizeof trailer -1 );
+			memcpy( trailer, p, len );
+			trailer[len] = 0;
+			if ( sscanf( trailer + taglen, " %lu, %lu lines, crc32c %lx", &number, &wantlines, &wantcrc ) == 3 &&
+				 wantlines == lines && wantcrc == crc )
+				v.good++;
+			else
+				v.bad++;
+			crc = lines = 0;
+			pending = false;
+		} else {
+			crc = Crc32c( crc, p, eol - p );
+			if ( nl < end ) {
+				crc = Crc32c( crc, "\n", 1 );
+				lines++;
+			}
+			pending = true;
+		}
+		p = nl < end ? nl + 1 : end;
+	}
+
+	if ( pending )
+		v.unfinished = max( lines, 1UL );
+}
+
+//-----------------------------------------------------------------------------
+// Name: VerifyColumns()
+// Desc: Check each block of a columnar file against its CRC. A block whose
+//       header is damaged can't be got past, as its size can't be trusted.
+//-----------------------------------------------------------------------------
+static void VerifyColumns( const char * p, const char * end, VERIFYFILE& v )
+{
+	JOYMON_COLHEADER header;
+	JOYMON_COLBLOCK block;
+
+	memcpy( &header, p, sizeof header );
+	if ( header.version != JOYMON_COL_VERSION ) {
+		v.lost = true;
+		return;
+	}
+
+	for ( p += sizeof header; p < end; p += block.size ) {
+		if ( (size_t)(end - p) < sizeof block ) {
+			v.unfinished = (unsigned long)(end - p);
+			break;
+		}
+		memcpy( &block, p, sizeof block );
+		p += sizeof block;
+		if ( block.magic != JOYMON_BLOCK_MAGIC || block.size > (size_t)(end - p) ) {
+			v.bad++;
+			v.lost = true;
+			break;
+		}
+		if ( Crc32c( 0, p, block.size ) == block.crc )
+			v.good++;
+		else
+			v.bad++;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Name: VerifyWork()
+// Desc: Check one file of a VerifyTree() job, on a pool thread.
+//-----------------------------------------------------------------------------
+static void VerifyWork( int item, int worker, void * context )
+{
+	VERIFYJOB& job = *(VERIFYJOB *)context;
+	const char * name = job.files->name[item];
+	char path[MAX_PATH];
+	MAPPEDFILE m;
+	VERIFYFILE v;
+
+	memset( &v, 0, sizeof v );
+	job.stats[worker].files++;
+	if ( !MapWhole( JoinPath( path, sizeof path, job.top, name ), m ) ) {
+		job.stats[worker].failed++;
+		EnterCriticalSection( &job.print );
+		printf( "%s: couldn't be read (error %lu)\n", name, GetLastError() );
+		LeaveCriticalSection( &job.print );
+		return;
+	}
+
+	DWORD magic = 0;
+	if ( m.size >= sizeof magic )
+		memcpy( &magic, m.data, sizeof magic );
+	if ( magic == JOYMON_COL_MAGIC && m.size >= sizeof(JOYMON_COLHEADER) )
+		VerifyColumns( m.data, m.data + m.size, v );
+	else
+		VerifyText( m.data, m.data + m.size, v );
+	job.stats[worker].bytes += m.size;
+	UnmapWhole( m );
+
+	// A recording made before block trailers, or by something else, has
+	// nothing to check it against, which isn't the same as it being damaged.
+	if ( magic != JOYMON_COL_MAGIC && v.good + v.bad == 0 ) {
+		job.stats[worker].unchecked++;
+		EnterCriticalSection( &job.print );
+		printf( "%s: no checksums to check it against\n", name );
+		LeaveCriticalSection( &job.print );
+		return;
+	}
+
+	job.stats[worker].good += v.good;
+	job.stats[worker].bad += v.bad;
+	if ( v.bad > 0 || v.unfinished > 0 || v.lost ) {
+		job.stats[worker].damaged++;
+		EnterCriticalSection( &job.print );
+		printf( "%s: %lu of %lu blocks damaged", name, v.bad, v.good + v.bad );
+		if ( v.lost )
+			printf( ", and the rest couldn't be followed" );
+		else if ( v.unfinished > 0 )
+			printf( ", and it ends in an incomplete block (%lu %s)", v.unfinished,
+					magic == JOYMON_COL_MAGIC ? "bytes" : "lines" );
+		printf( "\n" );
+		LeaveCriticalSection( &job.print );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Name: VerifyTree()
+// Desc: Check every block of a file, or of every recording in a folder and
+//       the folders below it, against its checksum, a file to each of a pool
+//       of threads. Damaged files, and any with no checksums, are reported.
+//       Returns 0 if all was well (files with no checksums are), 1 if anything
+//       was damaged, or 2 if nothing could be done.
+//-----------------------------------------------------------------------------
+int VerifyTree( const char * src, const char * match )
+{
+	VERIFYJOB job;
+	FILELIST files;
+	char top[MAX_PATH];
+	DWORD attrs;
+	int i, workers;
+
+	memset( &job, 0, sizeof job );
+	memset( &files, 0, sizeof files );
+	if ( (attrs = GetFileAttributes( src )) == INVALID_FILE_ATTRIBUTES ) {
+		fprintf( stderr, "Couldn't find %s\n", src );
+		return 2;
+	}
+
+	if ( attrs & FILE_ATTRIBUTE_DIRECTORY ) {
+		strncpy( top, src, sizeof top );
+		top[sizeof top -1] = 0;
+		if ( !FindFiles( top, "", match, files ) ) {
+			fprintf( stderr, "Out of memory listing %s\n", src );
+			FreeFiles( files );
+			return 2;
+		}
+	} else {
+		const char * slash = max( strrchr( src, '\\' ), strrchr( src, '/' ) );
+		_snprintf( top, sizeof top, "%.*s", slash ? (int)(slash - src) : 0, src );
+		top[sizeof top -1] = 0;
+		if ( (files.name = (char **)malloc( sizeof *files.name )) == NULL ||
+			 (files.name[0] = _strdup( slash ? slash + 1 : src )) == NULL ) {
+			fprintf( stderr, "Out of memory\n" );
+			free( files.name );
+			return 2;
+		}
+		files.n = files.allocated = 1;
+	}
+	if ( files.n == 0 ) {
+		fprintf( stderr, "No recordings found in %s\n", src );
+		FreeFiles( files );
+		return 2;
+	}
+
+	job.top = top;
+	job.files = &files;
+	InitializeCriticalSection( &job.print );
+	LONGLONG started = SessionClock();
+	workers = PoolRun( files.n, VerifyWork, &job );
+	double secs = (SessionClock() - started) / 1000000.0;
+	DeleteCriticalSection( &job.print );
+
+	for ( i = 1; i < workers; i++ ) {
+		job.stats[0].files += job.stats[i].files;
+		job.stats[0].damaged += job.stats[i].damaged;
+		job.stats[0].unchecked += job.stats[i].unchecked;
+		job.stats[0].failed += job.stats[i].failed;
+		job.stats[0].bytes += job.stats[i].bytes;
+		job.stats[0].good += job.stats[i].good;
+		job.stats[0].bad += job.stats[i].bad;
+	}
+	printf( "Verified %I64u blocks in %lu files (%.1f MB) in %.2f s on %d threads, %.1f MB/s, CRC32C in %s\n",
+			job.stats[0].good + job.stats[0].bad, job.stats[0].files - job.stats[0].failed - job.stats[0].unchecked,
+			job.stats[0].bytes / 1048576.0, secs, workers, secs > 0 ? job.stats[0].bytes / 1048576.0 / secs : 0.0,
+			Crc32cHardware() ? "hardware" : "software" );
+	if ( job.stats[0].damaged > 0 || job.stats[0].failed > 0 )
+		printf( "%lu files are damaged (%I64u blocks); %lu couldn't be read\n",
+				job.stats[0].damaged, job.stats[0].bad, job.stats[0].failed );
+	if ( job.stats[0].unchecked > 0 )
+		printf( "%lu files have no checksums, and weren't checked\n", job.stats[0].unchecked );
+
+	FreeFiles( files );
+	return job.stats[0].damaged == 0 && job.stats[0].failed == 0 ? 0 : 1;
+}
+
+//-----------------------------------------------------------------------------
+// Name: Octant()
+// Desc: Which octant a sample is in, as drawn: 0 to 7 for those centred on
+//       east, north-east, north, and so on round; -1 for the very centre.
+//-----------------------------------------------------------------------------
+int Octant( LONG x, LONG y )
+{
+	static const double tan22 = 0.41421356237309503;	// octant edges are 22.5 degrees off the axes
+	LONG ax = x < 0 ? -x : x, ay = y < 0 ? -y : y;
+
+	if ( x == 0 && y == 0 )
+		return -1;
+	if ( ay <= ax * tan22 )
+		return x > 0 ? 0 : 4;
+	if ( ax <= ay * tan22 )
+		return y > 0 ? 2 : 6;
+	return y > 0 ? (x > 0 ? 1 : 3) : (x > 0 ? 7 : 5);
+}
+
+//-----------------------------------------------------------------------------
+// Name: AggregateFile()
+// Desc: Work out a file's part of its group's results. Samples are taken as
+//       the axis maximum in the file's banner; a raw capture is scaled to it.
+//       Returns false if the file couldn't be read.
+//-----------------------------------------------------------------------------
+static bool AggregateFile( const char * name, AGGREGATE& a )
+{
+	MAPPEDFILE m;
+	const char * p, * end, * next, * err;
+	LONGLONG time, first = 0, last = 0;
+	LONG v[CONVERT_MAX_COLUMNS], lo[2], hi[2], range = 1000;
+	bool raw = false, origin = false;
+	int axis;
+
+	memset( &a, 0, sizeof a );
+	a.files = 1;
+	if ( !MapWhole( name, m ) ) {
+		a.failed = 1;
+		return false;
+	}
+
+	for ( p = m.data, end = m.data + m.size; p < end && *p != 0; p = next ) {
+		const char * eol = ScanNewline( p, end );
+		size_t len = eol - p;
+		next = eol < end ? eol + 1 : end;
+
+		if ( len > 0 && p[len -1] == '\r' )
+			len--;
+		if ( len == 0 )
+			continue;
+
+		if ( *p == '#' ) {
+			// Only the banner matters here.
+			char line[256];
+			len = min( len, sizeof line -1 );
+			memcpy( line, p, len );
+			line[len] = 0;
+			if ( strncmp( line, "# Axes maximum value:", 21 ) == 0 && atol( &line[21] ) > 0 )
+				range = atol( &line[21] );
+			else if ( RawHeader( line, lo, hi, origin ) )
+				raw = true;
+			continue;
+		}
+
+		int fields = ScanSample( p, p + len, time, v, CONVERT_MAX_COLUMNS, &err );
+		if ( fields < 0 ) {
+			a.malformed++;
+			continue;
+		}
+		if ( raw )
+			RawProject( v[0], v[1], lo, hi, origin, range );
+
+		if ( a.samples++ == 0 ) {
+			first = time;
+			for ( axis = 0; axis < 2; axis++ )
+				a.min[axis] = a.max[axis] = v[axis];
+		}
+		last = time;
+
+		for ( axis = 0; axis < 2; axis++ ) {
+			double d = v[axis] - a.mean[axis];
+			a.mean[axis] += d / (LONGLONG)a.samples;
+			a.m2[axis] += d * (v[axis] - a.mean[axis]);
+			a.min[axis] = min( a.min[axis], v[axis] );
+			a.max[axis] = max( a.max[axis], v[axis] );
+
+			LONG bin = (LONG)(((LONGLONG)v[axis] + range) * AGG_BINS / (2 * (LONGLONG)range + 1));
+			a.hist[axis][min( max( bin, 0 ), AGG_BINS -1 )]++;
+		}
+
+		int octant = Octant( v[0], v[1] );
+		if ( octant < 0 )
+			a.centre++;
+		else
+			a.octant[octant]++;
+
+		// A button column comes straight after y, making an odd number. It's
+		// whether the button went down since the line before, so each line
+		// with it set is a press of its own.
+		if ( fields % 2 && v[2] )
+			a.presses++;
+	}
+
+	a.secs = (last - first) / 1000000.0;
+	a.range = range;
+	UnmapWhole( m );
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Name: AggregateMerge()
+// Desc: Add one set of results into another. The means and spreads are
+//       combined exactly, as though all the samples had been taken together.
+//-----------------------------------------------------------------------------
+static void AggregateMerge( AGGREGATE& into, const AGGREGATE& a )
+{
+	int axis, i;
+
+	into.files += a.files;
+	into.failed += a.failed;
+	into.malformed += a.malformed;
+	if ( a.samples == 0 )
+		return;
+
+	ULONGLONG n = into.samples + a.samples;
+	for ( axis = 0; axis < 2; axis++ ) {
+		double d = a.mean[axis] - into.mean[axis];
+		into.mean[axis] += d * (LONGLONG)a.samples / (LONGLONG)n;
+		into.m2[axis] += a.m2[axis] + d * d * (LONGLONG)into.samples * (LONGLONG)a.samples / (LONGLONG)n;
+		into.min[axis] = into.samples ? min( into.min[axis], a.min[axis] ) : a.min[axis];
+		into.max[axis] = into.samples ? max( into.max[axis], a.max[axis] ) : a.max[axis];
+		for ( i = 0; i < AGG_BINS; i++ )
+			into.hist[axis][i] += a.hist[axis][i];
+	}
+	for ( i = 0; i < 8; i++ )
+		into.octant[i] += a.octant[i];
+	into.range = into.samples == 0 || into.range == a.range ? a.range : -1;
+	into.samples = n;
+	into.centre += a.centre;
+	into.presses += a.presses;
+	into.secs += a.secs;
+}
+
+//-----------------------------------------------------------------------------
+// Name: AggregateWork()
+// Desc: Work out one file's results, on one of the pool's threads, and add
+//       them to its group's.
+//-----------------------------------------------------------------------------
+static void AggregateWork( int item, int worker, void * context )
+{
+	AGGREGATEJOB& job = *(AGGREGATEJOB *)context;
+	char name[MAX_PATH];
+	AGGREGATE a;
+
+	if ( !AggregateFile( JoinPath( name, sizeof name, job.top, job.files->name[item] ), a ) ) {
+		EnterCriticalSection( &job.merge );
+		printf( "%s: couldn't be read\n", job.files->name[item] );
+		LeaveCriticalSection( &job.merge );
+	}
+
+	EnterCriticalSection( &job.merge );
+	AggregateMerge( job.total[job.group[item]], a );
+	LeaveCriticalSection( &job.merge );
+}
+
+static int CompareGroupKeys( const void * a, const void * b )
+{
+	return strcmp( ((const GROUPKEY *)a)->key, ((const GROUPKEY *)b)->key );
+}
+
+//-----------------------------------------------------------------------------
+// Name: Aggregate()
+// Desc: Work out results for groups of recordings: every recording in a
+//       folder and those below it, or those listed in a manifest, one to a
+//       line with its group after a comma. Groups not given in a manifest are
+//       by the file's folder, name (before the extension), the file itself, or
+//       all together, as by says. Written as CSV to outname, or the console.
+//       Returns 0 if all was well, 1 if some files or lines couldn't be read,
+//       or 2 if nothing could be done.
+//-----------------------------------------------------------------------------
+int Aggregate( const char * src, const char * outname, const char * by )
+{
+	AGGREGATEJOB job;
+	FILELIST files;
+	GROUPKEY * keys;
+	char top[MAX_PATH], line[1024], path[MAX_PATH];
+	DWORD attrs;
+	FILE * out = stdout;
+	int i, j, workers;
+
+	memset( &job, 0, sizeof job );
+	memset( &files, 0, sizeof files );
+	if ( (attrs = GetFileAttributes( src )) == INVALID_FILE_ATTRIBUTES ) {
+		fprintf( stderr, "Couldn't find %s\n", src );
+		return 2;
+	}
+	if ( by == NULL )
+		by = "folder";
+	if ( _stricmp( by, "folder" ) != 0 && _stricmp( by, "name" ) != 0 && _stricmp( by, "file" ) != 0 && _stricmp( by, "all" ) != 0 ) {
+		fprintf( stderr, "Groups can be by folder, name, file or all, not %s\n", by );
+		return 2;
+	}
+
+	if ( attrs & FILE_ATTRIBUTE_DIRECTORY ) {
+		strncpy( top, src, sizeof top );
+		top[sizeof top -1] = 0;
+		if ( !FindFiles( top, "", NULL, files ) ) {
+			fprintf( stderr, "Out of memory listing %s\n", src );
+			FreeFiles( files );
+			return 2;
+		}
+	} else {
+		// A manifest. Its names are relative to where it is, unless they're
+		// absolute; each is kept as the path to it, then its group after the
+		// path's terminating zero.
+		FILE * in = fopen( src, "r" );
+		const char * slash = max( strrchr( src, '\\' ), strrchr( src, '/' ) );
+		if ( in == NULL ) {
+			fprintf( stderr, "Couldn't open %s: %s\n", src, strerror(errno) );
+			return 2;
+		}
+		top[0] = 0;
+		while ( fgets( line, sizeof line, in ) != NULL ) {
+			char * name = line, * group = strchr( line, ',' ), * e;
+			line[strcspn( line, "\r\n" )] = 0;
+			while ( *name == ' ' || *name == '\t' )
+				name++;
+			if ( *name == 0 || *name == '#' )
+				continue;
+			if ( group != NULL ) {
+				*group++ = 0;
+				while ( *group == ' ' || *group == '\t' )
+					group++;
+			}
+			for ( e = name + strlen(name); e > name && (e[-1] == ' ' || e[-1] == '\t'); )
+				*--e = 0;
+
+			if ( slash != NULL && !(name[0] == '\\' || name[0] == '/' || (name[0] && name[1] == ':')) )
+				_snprintf( path, sizeof path, "%.*s\\%s", (int)(slash - src), src, name );
+			else
+				_snprintf( path, sizeof path, "%s", name );
+			path[sizeof path -1] = 0;
+			if ( group == NULL )
+				group = "";
+
+			if ( files.n == files.allocated ) {
+				int allocated = files.allocated ? files.allocated * 2 : 1024;
+				char ** names = (char **)realloc( files.name, allocated * sizeof *names );
+				if ( names == NULL )
+					break;
+				files.name = names;
+				files.allocated = allocated;
+			}
+			size_t len = strlen( path ) + 1;
+			if ( (files.name[files.n] = (char *)malloc( len + strlen( group ) + 1 )) == NULL )
+				break;
+			memcpy( files.name[files.n], path, len );
+			strcpy( files.name[files.n++] + len, group );
+		}
+		if ( !feof( in ) ) {
+			fprintf( stderr, "Couldn't read all of %s\n", src );
+			fclose( in );
+			FreeFiles( files );
+			return 2;
+		}
+		fclose( in );
+	}
+	if ( files.n == 0 ) {
+		fprintf( stderr, "No recordings found in %s\n", src );
+		FreeFiles( files );
+		return 2;
+	}
+
+	// Sort the files' group names, to number the groups in order.
+	if ( (keys = (GROUPKEY *)calloc( files.n, sizeof *keys )) == NULL ||
+		 (job.group = (int *)malloc( files.n * sizeof *job.group )) == NULL ) {
+		fprintf( stderr, "Out of memory\n" );
+		free( keys );
+		FreeFiles( files );
+		return 2;
+	}
+	for ( i = 0; i < files.n; i++ ) {
+		const char * name = files.name[i], * given = name + strlen(name) + 1;
+		const char * base = max( strrchr( name, '\\' ), strrchr( name, '/' ) );
+		const char * ext = strrchr( base ? base : name, '.' );
+		base = base ? base + 1 : name;
+
+		if ( top[0] == 0 && *given )
+			_snprintf( line, sizeof line, "%s", given );
+		else if ( _stricmp( by, "folder" ) == 0 )
+			_snprintf( line, sizeof line, "%.*s", base > name ? (int)(base - name - 1) : 1, base > name ? name : "." );
+		else if ( _stricmp( by, "name" ) == 0 )
+			_snprintf( line, sizeof line, "%.*s", ext ? (int)(ext - base) : (int)strlen(base), base );
+		else if ( _stricmp( by, "file" ) == 0 )
+			_snprintf( line, sizeof line, "%s", name );
+		else
+			strcpy( line, "all" );
+		line[sizeof line -1] = 0;
+
+		keys[i].file = i;
+		if ( (keys[i].key = _strdup( line )) == NULL ) {
+			fprintf( stderr, "Out of memory\n" );
+			for ( j = 0; j < i; j++ )
+				free( keys[j].key );
+			free( keys );
+			free( job.group );
+			FreeFiles( files );
+			return 2;
+		}
+	}
+	qsort( keys, files.n, sizeof *keys, CompareGroupKeys );
+
+	// Only the first of each group's names is kept.
+	for ( i = 0; i < files.n; i++ ) {
+		if ( i == 0 || strcmp( keys[i].key, keys[job.groups -1].key ) != 0 )
+			keys[job.groups++] = keys[i];
+		else
+			free( keys[i].key );
+		job.group[keys[i].file] = job.groups -1;
+	}
+	if ( (job.total = (AGGREGATE *)calloc( job.groups, sizeof *job.total )) == NULL ) {
+		fprintf( stderr, "Out of memory\n" );
+		for ( i = 0; i < job.groups; i++ )
+			free( keys[i].key );
+		free( keys );
+		free( job.group );
+		FreeFiles( files );
+		return 2;
+	}
+
+	job.top = top;
+	job.files = &files;
+	InitializeCriticalSection( &job.merge );
+	LONGLONG started = SessionClock();
+	workers = PoolRun( files.n, AggregateWork, &job );
+	double secs = (SessionClock() - started) / 1000000.0;
+	DeleteCriticalSection( &job.merge );
+
+	if ( outname != NULL && (out = fopen( outname, "w" )) == NULL ) {
+		fprintf( stderr, "Couldn't create %s: %s\n", outname, strerror(errno) );
+		out = stdout;
+	}
+
+	fprintf( out, "# Aggregated %d files from %s, in %d groups\n", files.n, src, job.groups );
+	fprintf( out, "# Octants are the fraction of samples in each, centred on east (E), north-east (NE) and so on;\n"
+				  "# x1..x%d and y1..y%d are the fraction in each of %d equal bins across each axis\n",
+				  AGG_BINS, AGG_BINS, AGG_BINS );
+	fprintf( out, "group,files,unread,samples,bad lines,seconds,axis max,mean x,sd x,mean y,sd y,"
+				  "min x,max x,min y,max y,centre" );
+	for ( i = 0; i < 8; i++ )
+		fprintf( out, ",%s", OctantNames[i] );
+	fprintf( out, ",presses,presses/min" );
+	for ( j = 0; j < 2; j++ )
+		for ( i = 0; i < AGG_BINS; i++ )
+			fprintf( out, ",%c%d", "xy"[j], i + 1 );
+	fputc( '\n', out );
+
+	AGGREGATE all;
+	memset( &all, 0, sizeof all );
+	for ( int g = 0; g < job.groups; g++ ) {
+		const AGGREGATE& a = job.total[g];
+		double n = (double)(LONGLONG)a.samples, frac = n > 0 ? 1.0 / n : 0;
+
+		AggregateMerge( all, a );
+		fprintf( out, "\"%s\",%lu,%lu,%I64u,%I64u,%.3f,%ld,%.3f,%.3f,%.3f,%.3f,%ld,%ld,%ld,%ld,%.5f",
+				 keys[g].key, a.files, a.failed, a.samples, a.malformed, a.secs, a.range,
+				 a.mean[0], n > 1 ? sqrt( a.m2[0] / (n - 1) ) : 0.0, a.mean[1], n > 1 ? sqrt( a.m2[1] / (n - 1) ) : 0.0,
+				 a.min[0], a.max[0], a.min[1], a.max[1], (LONGLONG)a.centre * frac );
+		for ( i = 0; i < 8; i++ )
+			fprintf( out, ",%.5f", (LONGLONG)a.octant[i] * frac );
+		fprintf( out, ",%I64u,%.3f", a.presses, a.secs > 0 ? a.presses * 60.0 / a.secs : 0.0 );
+		for ( j = 0; j < 2; j++ )
+			for ( i = 0; i < AGG_BINS; i++ )
+				fprintf( out, ",%.5f", (LONGLONG)a.hist[j][i] * frac );
+		fputc( '\n', out );
+		free( keys[g].key );
+	}
+	if ( out != stdout )
+		fclose( out );
+
+	fprintf( out == stdout ? stderr : stdout, "Aggregated %I64u samples from %lu files in %.2f s on %d threads\n",
+			 all.samples, all.files - all.failed, secs, workers );
+	if ( all.failed > 0 || all.malformed > 0 )
+		fprintf( out == stdout ? stderr : stdout, "%lu files couldn't be read; %I64u malformed lines were left out\n",
+				 all.failed, all.malformed );
+
+	free( keys );
+	free( job.group );
+	free( job.total );
+	FreeFiles( files );
+	return all.failed == 0 && all.malformed == 0 ? 0 : 1;
+}
+
+//-----------------------------------------------------------------------------
+// Name: SegmentsFind()
+// Desc: List the files of a split session holding samples between two times
+//       (secs), from its manifest, as paths that can be opened from here, so
+//       a reader need only open those. Returns 0 if any were found, 1 if none
+//       were, or 2 if the manifest couldn't be read.
+//-----------------------------------------------------------------------------
+int SegmentsFind( const char * manifest, double from, double to )
+{
+	FILE * in;
+	char line[1024], tag[32];
+	const char * slash = max( strrchr( manifest, '\\' ), strrchr( manifest, '/' ) );
+	double first = 0, last = -1;		// of the segment the next file line is
+	int found = 0;
+
+	if ( (in = fopen( manifest, "r" )) == NULL ) {
+		fprintf( stderr, "Couldn't open %s: %s\n", manifest, strerror(errno) );
+		return 2;
+	}
+
+	_snprintf( tag, sizeof tag, "%s segment,", EventRecord );
+	tag[sizeof tag -1] = 0;
+	while ( fgets( line, sizeof line, in ) != NULL ) {
+		char * name = line, * comma;
+		line[strcspn( line, "\r\n" )] = 0;
+
+		// A segment with no samples has no times, and never matches.
+		if ( strncmp( line, tag, strlen(tag) ) == 0 ) {
+			if ( sscanf( line + strlen(tag), "%lf,%lf", &first, &last ) != 2 ) {
+				first = 0;
+				last = -1;
+			}
+			continue;
+		}
+		if ( *name == 0 || *name == '#' )
+			continue;
+
+		if ( (comma = strchr( name, ',' )) != NULL )
+			*comma = 0;
+		if ( last >= first && last >= from && first <= to ) {
+			if ( slash != NULL && !(name[0] == '\\' || name[0] == '/' || (name[0] && name[1] == ':')) )
+				printf( "%.*s\\%s\n", (int)(slash - manifest), manifest, name );
+			else
+				printf( "%s\n", name );
+			found++;
+		}
+		first = 0;
+		last = -1;
+	}
+
+	bool ok = !ferror( in );
+	fclose( in );
+	if ( !ok ) {
+		fprintf( stderr, "Couldn't read all of %s\n", manifest );
+		return 2;
+	}
+	return found > 0 ? 0 : 1;
+}
+
+//-----------------------------------------------------------------------------
+// Name: ReplayParse()
+// Desc: Read the sample on the line at p, if it is one, and find the next line.
+//-----------------------------------------------------------------------------
+static bool ReplayParse( const char * p, const char ** next, JOYREC& rec )
+{
+	const char * end = g_Replay.data + g_Replay.size;
+	const char * eol = (const char *)memchr( p, '\n', end - p );
+	char line[128];
+	double secs;
+	long extra[7];
+	int button = 0;
+
+	if ( eol == NULL )
+		eol = end;
+	*next = eol < end ? eol + 1 : end;
+
+	// Comments, markers and such aren't samples.
+	if ( *p == '#' || eol - p >= (int)sizeof line )
+		return false;
+
+	memcpy( line, p, eol - p );
+	line[eol - p] = 0;
+	int fields = sscanf( line, "%lf,%ld,%ld,%ld,%ld,%ld,%ld,%ld,%ld,%ld", &secs, &rec.x, &rec.y,
+						 &extra[0], &extra[1], &extra[2], &extra[3], &extra[4], &extra[5], &extra[6] );
+	if ( fields < 3 )
+		return false;
+
+	// Min and max, and raw, columns come after the button, if it's there. They
+	// come in pairs, so there's a button if there's an even number of fields.
+	if ( fields % 2 == 0 )
+		button = (int)extra[0];
+
+	if ( g_Replay.raw )
+		RawProject( rec.x, rec.y, g_Replay.rawlo, g_Replay.rawhi, g_Replay.origin, g_Config.XYMinMax );
+
+	rec.time = (LONGLONG)floor( secs * 1000000.0 + 0.5 );
+	rec.type = JOYREC_SAMPLE;
+	rec.button = (WORD)button;
+	rec.flags = 0;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Name: ReplayOpen()
+// Desc: Map a recording and index it for replay. The index has the time and
+//       place of every REPLAY_STRIDE'th sample, so a seek is a binary search
+//       and a short read forward, wherever it lands in the file.
+//-----------------------------------------------------------------------------
+bool ReplayOpen( HWND hDlg, const char * name )
+{
+	LARGE_INTEGER size;
+	const char * p, * next;
+	JOYREC rec;
+	int allocated = 0, samples = 0;
+
+	ReplayClose( hDlg );
+
+	if ( (g_Replay.hFile = CreateFile( name, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+						OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL )) == INVALID_HANDLE_VALUE ) {
+		g_Replay.hFile = NULL;
+		return false;
+	}
+	if ( !GetFileSizeEx( g_Replay.hFile, &size ) || size.QuadPart == 0 || size.QuadPart > (SIZE_T)-1 / 2 ||
+		 (g_Replay.hMap = CreateFileMapping( g_Replay.hFile, NULL, PAGE_READONLY, 0, 0, NULL )) == NULL ||
+		 (g_Replay.data = (const char *)MapViewOfFile( g_Replay.hMap, FILE_MAP_READ, 0, 0, 0 )) == NULL ) {
+		ReplayClose( hDlg );
+		return false;
+	}
+	g_Replay.size = (size_t)size.QuadPart;
+
+	// A preallocated file left by a crash ends in zeros.
+	const char * nul = (const char *)memchr( g_Replay.data, 0, g_Replay.size );
+	if ( nul != NULL )
+		g_Replay.size = nul - g_Replay.data;
+
+	// A raw capture says so in its banner, and is scaled as it's read.
+	for ( p = g_Replay.data; p < g_Replay.data + g_Replay.size && *p == '#'; p = next ) {
+		char line[256];
+		const char * eol = (const char *)memchr( p, '\n', g_Replay.data + g_Replay.size - p );
+		next = eol != NULL ? eol + 1 : g_Replay.data + g_Replay.size;
+		size_t len = min( (size_t)(next - p), sizeof line -1 );
+		memcpy( line, p, len );
+		line[len] = 0;
+		if ( RawHeader( line, g_Replay.rawlo, g_Replay.rawhi, g_Replay.origin ) )
+			g_Replay.raw = true;
+	}
+
+	for ( p = g_Replay.data; p < g_Replay.data + g_Replay.size; p = next ) {
+		if ( !ReplayParse( p, &next, rec ) )
+			continue;
+		if ( samples++ % REPLAY_STRIDE != 0 ) {
+			g_Replay.last = rec.time;
+			continue;
+		}
+
+		if ( g_Replay.entries == allocated ) {
+			allocated = allocated ? allocated * 2 : 1024;
+			REPLAYINDEX * index = (REPLAYINDEX *)realloc( g_Replay.index, allocated * sizeof *index );
+			if ( index == NULL ) {
+				ReplayClose( hDlg );
+				return false;
+			}
+			g_Replay.index = index;
+		}
+		g_Replay.index[g_Replay.entries].time = rec.time;
+		g_Replay.index[g_Replay.entries].offset = p - g_Replay.data;
+		g_Replay.entries++;
+		g_Replay.last = rec.time;
+	}
+
+	if ( g_Replay.entries == 0 ) {
+		ReplayClose( hDlg );
+		return false;
+	}
+	g_Replay.first = g_Replay.index[0].time;
+	strncpy( g_Replay.name, name, sizeof g_Replay.name );
+	g_Replay.name[sizeof g_Replay.name -1] = 0;
+
+	// Set up the controls, and start playing from the beginning at normal speed.
+	HWND hPos = GetDlgItem( hDlg, IDC_REPLAY_POS );
+	HWND hSpeed = GetDlgItem( hDlg, IDC_REPLAY_SPEED );
+	SendMessage( hPos, TBM_SETRANGEMIN, FALSE, 0 );
+	SendMessage( hPos, TBM_SETRANGEMAX, FALSE, (LPARAM)((g_Replay.last - g_Replay.first) / 100000) );
+	SendMessage( hPos, TBM_SETPAGESIZE, 0, 100 );
+	SendMessage( hPos, TBM_SETPOS, TRUE, 0 );
+	SendMessage( hSpeed, CB_RESETCONTENT, 0, 0 );
+	for ( int i = 0; i < sizeof ReplaySpeeds / sizeof ReplaySpeeds[0]; i++ ) {
+		char text[16];
+		if ( ReplaySpeeds[i] == 0.0 )
+			strcpy( text, "Pause" );
+		else
+			_snprintf( text, sizeof text, "%gx", ReplaySpeeds[i] );
+		SendMessage( hSpeed, CB_ADDSTRING, 0, (LPARAM)text );
+		if ( ReplaySpeeds[i] == 1.0 )
+			SendMessage( hSpeed, CB_SETCURSEL, i, 0 );
+	}
+	g_Replay.speed = 1.0;
+	g_Replay.ticked = SessionClock();
+	ReplaySeek( g_Replay.first );
+
+	ShowWindow( hPos, SW_SHOW );
+	ShowWindow( hSpeed, SW_SHOW );
+	SetWindowText( GetDlgItem( hDlg, IDC_REPLAY ), "Live" );
+	SendMessage( hDlg, WM_SIZE, 0, 0 );
+	InvalidateRect( hDlg, NULL, TRUE );
+	SetTimer( hDlg, REPLAY_TIMER, REPLAY_PERIOD, NULL );
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Name: ReplayClose()
+// Desc: Stop replaying, and go back to showing the joystick.
+//-----------------------------------------------------------------------------
+void ReplayClose( HWND hDlg )
+{
+	bool wasactive = g_Replay.data != NULL;
+
+	KillTimer( hDlg, REPLAY_TIMER );
+	if ( g_Replay.data != NULL )
+		UnmapViewOfFile( g_Replay.data );
+	if ( g_Replay.hMap != NULL )
+		CloseHandle( g_Replay.hMap );
+	if ( g_Replay.hFile != NULL )
+		CloseHandle( g_Replay.hFile );
+	free( g_Replay.index );
+	memset( &g_Replay, 0, sizeof g_Replay );
+
+	if ( wasactive ) {
+		ShowWindow( GetDlgItem( hDlg, IDC_REPLAY_POS ), SW_HIDE );
+		ShowWindow( GetDlgItem( hDlg, IDC_REPLAY_SPEED ), SW_HIDE );
+		SetWindowText( GetDlgItem( hDlg, IDC_REPLAY ), "&Replay..." );
+		_snprintf( g_MsgText, sizeof g_MsgText, "Click button %u to start", g_Config.JoystickButton );
+		SendMessage( hDlg, WM_SIZE, 0, 0 );
+		InvalidateRect( hDlg, NULL, TRUE );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Name: ReplaySeek()
+// Desc: Move the replay to time t, showing the last sample at or before it.
+//-----------------------------------------------------------------------------
+void ReplaySeek( LONGLONG t )
+{
+	int lo = 0, hi = g_Replay.entries;
+	const char * p, * next, * end = g_Replay.data + g_Replay.size;
+	JOYREC rec;
+
+	if ( t < g_Replay.first )
+		t = g_Replay.first;
+	if ( t > g_Replay.last )
+		t = g_Replay.last;
+	g_Replay.now = t;
+
+	// Find the last index entry at or before t, then read forward from there.
+	while ( hi - lo > 1 ) {
+		int mid = (lo + hi) / 2;
+		if ( g_Replay.index[mid].time <= t )
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	for ( p = g_Replay.data + g_Replay.index[lo].offset; p < end; p = next ) {
+		if ( !ReplayParse( p, &next, rec ) )
+			continue;
+		if ( rec.time > t )
+			break;
+		g_Replay.rec = rec;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Name: ReplayTick()
+// Desc: Move the replay on by however much time has passed, and show it.
+//-----------------------------------------------------------------------------
+void ReplayTick( HWND hDlg )
+{
+	LONGLONG now = SessionClock();
+	DIJOYSTATE js;
+
+	if ( g_Replay.data == NULL )
+		return;
+
+	if ( g_Replay.speed > 0.0 && !g_Replay.dragging ) {
+		ReplaySeek( g_Replay.now + (LONGLONG)((now - g_Replay.ticked) * g_Replay.speed) );
+		SendMessage( GetDlgItem( hDlg, IDC_REPLAY_POS ), TBM_SETPOS, TRUE,
+			(LPARAM)((g_Replay.now - g_Replay.first) / 100000) );
+
+		// Stop at the end, rather than sit there "playing".
+		if ( g_Replay.now >= g_Replay.last ) {
+			g_Replay.speed = 0.0;
+			SendMessage( GetDlgItem( hDlg, IDC_REPLAY_SPEED ), CB_SETCURSEL, 0, 0 );
+		}
+	}
+	g_Replay.ticked = now;
+
+	_snprintf( g_MsgText, sizeof g_MsgText, "Replay %.1f of %.1f s: %s",
+		g_Replay.now / 1000000.0, g_Replay.last / 1000000.0, g_Replay.name );
+
+	// Back into device terms, so it's drawn exactly as it was live.
+	memset( &js, 0, sizeof js );
+	js.lX = g_Replay.rec.x;
+	js.lY = -g_Replay.rec.y;
+	DrawInputState( hDlg, js );
+}
+
+//-----------------------------------------------------------------------------
+// Name: VirtualLoad()
+// Desc: Read a script of virtual devices, one per sine, walk or file line,
+//       each followed by any button lines for it. Returns how many devices
+//       there are, or -1 with the reason in err.
+//
+//       sine <x amplitude> <x Hz> <y amplitude> <y Hz> [<y phase, degrees>]
+//       walk <seed> <largest step per millisec>
+//       file <recording to loop>
+//       button <number> <period ms> <held ms> [<first press, ms>]
+//-----------------------------------------------------------------------------
+int VirtualLoad( const char * name, VIRTUALDEVICE * devs, int max, char * err, size_t errlen )
+{
+	FILE * fp;
+	char line[MAX_PATH + 64], word[16], arg[MAX_PATH];
+	int n = 0, lineno = 0;
+
+	if ( (fp = fopen( name, "r" )) == NULL ) {
+		_snprintf( err, errlen, "Couldn't open %s: %s", name, strerror(errno) );
+		return -1;
+	}
+
+	memset( devs, 0, max * sizeof *devs );
+	while ( fgets( line, sizeof line, fp ) != NULL ) {
+		VIRTUALDEVICE& last = devs[n > 0 ? n - 1 : 0];	// buttons belong to the device before them
+		double a, b, c, d, e = 0;
+		bool ok = true;
+
+		lineno++;
+		if ( sscanf( line, "%15s", word ) != 1 || word[0] == '#' )
+			continue;
+
+		if ( _stricmp( word, "button" ) == 0 ) {
+			int count = sscanf( line, "%*s %lf %lf %lf %lf", &a, &b, &c, &d );
+			if ( n == 0 || last.buttons == MAX_VIRTUAL_BUTTONS || count < 3 ||
+				 a < 1 || a > 32 || b < 1 || c < 0 || c > b || (count > 3 && d < 0) ) {
+				ok = false;
+			} else {
+				VIRTUALBUTTON& button = last.button[last.buttons++];
+				button.number = (int)a;
+				button.period = (LONGLONG)(b * 1000);
+				button.held = (LONGLONG)(c * 1000);
+				button.delay = count > 3 ? (LONGLONG)(d * 1000) : 0;
+			}
+
+		} else if ( n == max ) {
+			_snprintf( err, errlen, "%s line %d: no more than %d devices", name, lineno, max );
+			fclose( fp );
+			VirtualUnload( devs, n );
+			return -1;
+
+		} else if ( _stricmp( word, "sine" ) == 0 ) {
+			VIRTUALDEVICE& dev = devs[n];
+			if ( sscanf( line, "%*s %lf %lf %lf %lf %lf", &a, &b, &c, &d, &e ) < 4 ) {
+				ok = false;
+			} else {
+				dev.kind = VIRTUAL_SINE;
+				dev.amp[0] = a;
+				dev.freq[0] = b;
+				dev.amp[1] = c;
+				dev.freq[1] = d;
+				dev.phase = e;
+				n++;
+			}
+
+		} else if ( _stricmp( word, "walk" ) == 0 ) {
+			VIRTUALDEVICE& dev = devs[n];
+			if ( sscanf( line, "%*s %lf %lf", &a, &b ) != 2 || b < 0 ) {
+				ok = false;
+			} else {
+				dev.kind = VIRTUAL_WALK;
+				dev.seed = (unsigned long)a;
+				dev.step = (long)b;
+				n++;
+			}
+
+		} else if ( _stricmp( word, "file" ) == 0 ) {
+			VIRTUALDEVICE& dev = devs[n];
+			FILE * rp;
+			char * p;
+			if ( sscanf( line, "%*s %[^\r\n]", arg ) != 1 || (rp = fopen( arg, "r" )) == NULL ) {
+				_snprintf( err, errlen, "%s line %d: couldn't open the recording", name, lineno );
+				fclose( fp );
+				VirtualUnload( devs, n );
+				return -1;
+			}
+
+			// Just the samples, times made relative to the first.
+			int allocated = 0;
+			dev.kind = VIRTUAL_FILE;
+			while ( (p = fgets( arg, sizeof arg, rp )) != NULL ) {
+				long x, y;
+				if ( *p == '#' || sscanf( p, "%lf,%ld,%ld", &a, &x, &y ) != 3 )
+					continue;
+				if ( dev.samples == allocated ) {
+					VIRTUALSAMPLE * more;
+					allocated = allocated ? allocated * 2 : 4096;
+					if ( (more = (VIRTUALSAMPLE *)realloc( dev.sample, allocated * sizeof *dev.sample )) == NULL ) {
+						free( dev.sample );
+						dev.sample = NULL;
+						break;
+					}
+					dev.sample = more;
+				}
+				dev.sample[dev.samples].time = (LONGLONG)floor( a * 1000000.0 + 0.5 );
+				dev.sample[dev.samples].x = x;
+				dev.sample[dev.samples].y = y;
+				if ( dev.samples > 0 && dev.sample[dev.samples].time < dev.sample[dev.samples -1].time )
+					continue;	// out of order; can't have come from us
+				dev.samples++;
+			}
+			fclose( rp );
+			n++;
+			if ( dev.sample == NULL || dev.samples == 0 ) {
+				_snprintf( err, errlen, "%s line %d: no samples in the recording", name, lineno );
+				fclose( fp );
+				VirtualUnload( devs, n );
+				return -1;
+			}
+			for ( int i = dev.samples -1; i >= 0; i-- )
+				dev.sample[i].time -= dev.sample[0].time;
+
+		} else {
+			ok = false;
+		}
+
+		if ( !ok ) {
+			_snprintf( err, errlen, "%s line %d: don't understand `%s'", name, lineno, word );
+			fclose( fp );
+			VirtualUnload( devs, n );
+			return -1;
+		}
+	}
+
+	fclose( fp );
+	if ( n == 0 ) {
+		_snprintf( err, errlen, "%s has no devices in it", name );
+		return -1;
+	}
+	return n;
+}
+
+//-----------------------------------------------------------------------------
+// Name: VirtualUnload()
+// Desc: Free what VirtualLoad() allocated.
+//-----------------------------------------------------------------------------
+void VirtualUnload( VIRTUALDEVICE * devs, int n )
+{
+	for ( int i = 0; i < n; i++ ) {
+		free( devs[i].sample );
+		devs[i].sample = NULL;
+		devs[i].samples = 0;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Name: VirtualReset()
+// Desc: Put a view of a device back to the start of time.
+//-----------------------------------------------------------------------------
+void VirtualReset( const VIRTUALDEVICE& dev, VIRTUALSTATE& st )
+{
+	st.time = -1;
+	st.steps = 0;
+	st.x = st.y = 0;
+	st.rng = dev.seed != 0 ? dev.seed : 1;
+	st.cursor = 0;
+}
+
+//-----------------------------------------------------------------------------
+// Name: VirtualPoll()
+// Desc: Get the state of a virtual device at time t (microsecs). Everything
+//       is worked out from t alone, or in fixed steps up to it, so the same
+//       script gives the same result however often it's polled. Returns the
+//       buttons pressed since the last poll, button n in bit n-1.
+//-----------------------------------------------------------------------------
+DWORD VirtualPoll( const VIRTUALDEVICE& dev, VIRTUALSTATE& st, LONGLONG t, DIJOYSTATE& js )
+{
+	static const double twopi = 6.283185307179586;
+	LONG range = g_Config.XYMinMax;
+	DWORD pressed = 0;
+	LONG x = 0, y = 0;
+	int i;
+
+	memset( &js, 0, sizeof js );
+	if ( t < st.time )
+		VirtualReset( dev, st );		// a new session
+
+	switch ( dev.kind ) {
+		case VIRTUAL_SINE:
+			x = (LONG)floor( dev.amp[0] * sin( twopi * dev.freq[0] * t / 1000000.0 ) + 0.5 );
+			y = (LONG)floor( dev.amp[1] * sin( twopi * dev.freq[1] * t / 1000000.0 + dev.phase * twopi / 360.0 ) + 0.5 );
+			break;
+
+		case VIRTUAL_WALK:
+			// A step every millisecond, bouncing off the edges.
+			for ( ; st.steps < t / 1000; st.steps++ ) {
+				for ( i = 0; i < 2; i++ ) {
+					LONG& pos = i == 0 ? st.x : st.y;
+					st.rng ^= st.rng << 13;
+					st.rng ^= st.rng >> 17;
+					st.rng ^= st.rng << 5;
+					st.rng &= 0xffffffffUL;
+					pos += (LONG)(st.rng % (2 * dev.step + 1)) - dev.step;
+					if ( pos > range )
+						pos = 2 * range - pos;
+					if ( pos < -range )
+						pos = -2 * range - pos;
+				}
+			}
+			x = st.x;
+			y = st.y;
+			break;
+
+		case VIRTUAL_FILE:
+			{
+				// Round and round the recording.
+				LONGLONG span = dev.sample[dev.samples -1].time + 1;
+				LONGLONG r = t % span;
+				if ( r < dev.sample[st.cursor].time )
+					st.cursor = 0;
+				while ( st.cursor + 1 < dev.samples && dev.sample[st.cursor +1].time <= r )
+					st.cursor++;
+				x = dev.sample[st.cursor].x;
+				y = dev.sample[st.cursor].y;
+			}
+			break;
+	}
+
+	// Scripts are in recorded terms, with Y up.
+	js.lX = max( -range, min( range, x ) );
+	js.lY = -max( -range, min( range, y ) );
+
+	for ( i = 0; i < dev.buttons; i++ ) {
+		const VIRTUALBUTTON& b = dev.button[i];
+		LONGLONG now = t < b.delay ? 0 : (t - b.delay) / b.period + 1;	// presses so far
+		LONGLONG then = st.time < b.delay ? 0 : (st.time - b.delay) / b.period + 1;
+
+		if ( t >= b.delay && (t - b.delay) % b.period < b.held )
+			js.rgbButtons[b.number -1] = 0x80;
+		if ( now > then )
+			pressed |= 1UL << (b.number -1);
+	}
+
+	st.time = t;
+	return pressed;
+}
+
+//-----------------------------------------------------------------------------
+// Name: VirtualStart()
+// Desc: Use a device from a script in place of the joystick.
+//-----------------------------------------------------------------------------
+bool VirtualStart( const char * script, int device )
+{
+	char err[MAX_PATH + 128];
+	int n = VirtualLoad( script, g_VirtualDevices, MAX_VIRTUAL, err, sizeof err );
+
+	if ( n >= 0 && (device < 0 || device >= n) ) {
+		_snprintf( err, sizeof err, "%s has no device %d", script, device );
+		VirtualUnload( g_VirtualDevices, n );
+		n = -1;
+	}
+	if ( n < 0 ) {
+		err[sizeof err -1] = 0;
+		MessageBox( NULL, err, Title, MB_ICONERROR | MB_OK );
+		return false;
+	}
+
+	g_pVirtual = &g_VirtualDevices[device];
+	VirtualReset( *g_pVirtual, g_VirtualGui );
+	VirtualReset( *g_pVirtual, g_VirtualSampler );
+	return true;
 }
 
 //-----------------------------------------------------------------------------
-// Name: StopWriting()
-// Desc: Close the output file.
+// Name: BenchTick()
+// Desc: Note when a benchmark tick came, numbering ticks the way the sampler
+//       does.
 //-----------------------------------------------------------------------------
-void StopWriting( void )
+static struct {
+	LONGLONG	start, period, called;	// as in g_Ticks, with the period in microsecs
+	LONG *		late;					// microsecs, for each tick that came
+	int			n, max;
+	LONGLONG	missed;
+} g_Bench;
+
+static void BenchTick( void )
 {
-	fclose(fp);
-	g_MsgText[0] = 0;
-	g_bWriting = false;
+	LONGLONG now = SessionClock();
+
+	if ( g_Bench.n >= g_Bench.max )
+		return;
+	if ( g_Bench.n == 0 && g_Bench.called == 0 )
+		g_Bench.start = now;
+	LONGLONG tick = max( g_Bench.called, (now - g_Bench.start) / g_Bench.period );
+	g_Bench.missed += tick - g_Bench.called;
+	g_Bench.called = tick + 1;
+	g_Bench.late[g_Bench.n++] = (LONG)min( now - g_Bench.start - tick * g_Bench.period, (LONGLONG)MAXLONG );
+}
+
+static VOID CALLBACK BenchCallback( PVOID lpParameter, BOOLEAN TimerOrWaitFired )
+{
+	BenchTick();
+}
+
+static int CompareLongs( const void * a, const void * b )
+{
+	LONG x = *(const LONG *)a, y = *(const LONG *)b;
+	return x < y ? -1 : x > y;
+}
+
+static LONGLONG ProcessCpu( void )
+{
+	FILETIME created, exited, kernel, user;
+	GetProcessTimes( GetCurrentProcess(), &created, &exited, &kernel, &user );
+	return (((LONGLONG)kernel.dwHighDateTime << 32 | kernel.dwLowDateTime) +
+			((LONGLONG)user.dwHighDateTime << 32 | user.dwLowDateTime)) / 10;
 }
 
 //-----------------------------------------------------------------------------
-// Name: WriteToFile()
-// Desc: Write data to the output file.
+// Name: TimerBench()
+// Desc: Tick for a while each way the sampler can be timed, and a couple of
+//       others, and say how late the ticks came and how much of a core it
+//       took. The ways that run on a thread of our own get the sampler's
+//       configured priority and processor. Returns 0 if it could be done.
 //-----------------------------------------------------------------------------
-bool WriteToFile( void )
+int TimerBench( int secs, UINT period )
 {
-    DIJOYSTATE js;           // DInput joystick state 
-    HRESULT hr;
-	bool retcode;
+	static const char * const ways[] = { "Timer queue", "Sleep", "Sleep, then spin", "Spin" };
+	TIMECAPS tc;
+	UINT resolution;
+	SPINWAIT w;
+
+	if ( timeGetDevCaps( &tc, sizeof tc ) != TIMERR_NOERROR ||
+		 timeBeginPeriod( resolution = min( max( tc.wPeriodMin, 1 ), tc.wPeriodMax ) ) != TIMERR_NOERROR ) {
+		fprintf( stderr, "Couldn't set the timer resolution\n" );
+		return 2;
+	}
+	g_Bench.period = period * 1000;
+	g_Bench.max = (int)((LONGLONG)secs * 1000000 / g_Bench.period) + 1;
+	if ( (g_Bench.late = (LONG *)malloc( g_Bench.max * sizeof(LONG) )) == NULL ) {
+		timeEndPeriod( resolution );
+		fprintf( stderr, "Out of memory\n" );
+		return 2;
+	}
 
-    // Get the input's device state
-    if( FAILED( hr = PollJoystick( js ) ) )
-        return false;
+	char tuning[sizeof g_Sampler.tuning];
+	SamplerTune( GetCurrentThread(), tuning, sizeof tuning );
+	printf( "%u ms ticks for %d s each way, timer resolution %u ms, own thread at %s\n", period, secs, resolution, tuning );
+	printf( "%-18s %8s %8s %8s %8s %7s %6s\n", "Late by (ms):", "50%", "99%", "99.9%", "max", "missed", "CPU" );
+
+	for ( int way = 0; way < sizeof ways / sizeof ways[0]; way++ ) {
+		g_Bench.n = 0;
+		g_Bench.called = g_Bench.missed = 0;
+		LONGLONG cpu = ProcessCpu(), began = SessionClock(), end = began + (LONGLONG)secs * 1000000;
+
+		if ( way == 0 ) {
+			HANDLE hTimer;
+			if ( !CreateTimerQueueTimer( &hTimer, NULL, BenchCallback, NULL, 0, period, WT_EXECUTEDEFAULT ) ) {
+				printf( "%-18s couldn't create a timer\n", ways[way] );
+				continue;
+			}
+			Sleep( secs * 1000 );
+			DeleteTimerQueueTimer( NULL, hTimer, INVALID_HANDLE_VALUE );
 
-	DWORD timernow = GetTickCount();
-	float elapsed = (float)(timernow - g_timerstart) / 1000.0f;
+		} else {
+			SpinWaitInit( w );
+			for ( LONGLONG next = began; next < end; next += g_Bench.period ) {
+				LONGLONG now = SessionClock();
+				if ( way == 1 ) {
+					if ( next > now )
+						Sleep( (DWORD)((next - now + 999) / 1000) );
+				} else if ( way == 2 ) {
+					SpinWaitUntil( w, next );
+				} else {
+					while ( SessionClock() < next )
+						YieldProcessor();
+				}
+				BenchTick();
+				if ( (now = SessionClock()) - next >= 2 * g_Bench.period )
+					next += (now - next) / g_Bench.period * g_Bench.period - g_Bench.period;
+			}
+		}
 
-	// Constrain the axes if we're not going negative
-	if (g_Config.OriginLowerLeft == true) {
-		if (js.lX < 0) js.lX = 0;
-		if (js.lY > 0) js.lY = 0;	// will flip the sign below
+		double wall = (double)(SessionClock() - began);
+		double used = 100.0 * (ProcessCpu() - cpu) / wall;
+		if ( g_Bench.n == 0 ) {
+			printf( "%-18s no ticks\n", ways[way] );
+			continue;
+		}
+		qsort( g_Bench.late, g_Bench.n, sizeof(LONG), CompareLongs );
+		printf( "%-18s %8.3f %8.3f %8.3f %8.3f %7I64d %5.1f%%", ways[way],
+			g_Bench.late[(int)(0.5 * (g_Bench.n - 1))] / 1000.0, g_Bench.late[(int)(0.99 * (g_Bench.n - 1))] / 1000.0,
+			g_Bench.late[(int)(0.999 * (g_Bench.n - 1))] / 1000.0, g_Bench.late[g_Bench.n - 1] / 1000.0,
+			g_Bench.missed, used );
+		if ( way == 2 )
+			printf( "  (spin margin %.3f ms)", w.margin / 1000.0 );
+		printf( "\n" );
 	}
 
-	// Report state of extra button if we're watching it.
-	if ( g_Config.Button2 ) {
-		retcode = (fprintf(fp, "%6.3f,%5ld,%5ld,%2i\n", elapsed, js.lX, -js.lY, g_Button2 ) > 0 );	// flip Y axis
-		g_Button2 = false;
-	} else {
-		retcode = (fprintf(fp, "%6.3f,%5ld,%5ld\n", elapsed, js.lX, -js.lY ) > 0 );
+	free( g_Bench.late );
+	timeEndPeriod( resolution );
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// Name: StressTest()
+// Desc: Run every device in a script at once, at the given rate, through the
+//       writer for a while, and report whether it kept up. Returns 0 if it
+//       did, 1 if anything was dropped or went wrong, or 2 if it couldn't run.
+//-----------------------------------------------------------------------------
+int StressTest( const char * script, double rate, int secs, const char * pattern )
+{
+	static VIRTUALSTATE states[MAX_VIRTUAL];
+	char err[MAX_PATH + 128];
+	LONGLONG n, t, records = 0, dropped = 0, late = 0;
+	DIJOYSTATE js;
+	TIMECAPS tc;
+	UINT resolution = 0;
+	SPINWAIT w;
+	int d, ndevs;
+
+	if ( (ndevs = VirtualLoad( script, g_VirtualDevices, MAX_VIRTUAL, err, sizeof err )) < 0 ) {
+		fprintf( stderr, "%s\n", err );
+		return 2;
+	}
+	for ( d = 0; d < ndevs; d++ )
+		VirtualReset( g_VirtualDevices[d], states[d] );
+
+	LoadConfig();
+	strncpy( g_Config.FilePattern, pattern, sizeof g_Config.FilePattern );
+	g_Config.FilePattern[sizeof g_Config.FilePattern -1] = 0;
+	g_Config.TicksPerSec = rate;
+	g_Config.OversampleRate = 0;		// the records go straight to the writer, not through
+	g_Config.EnvelopeColumns = false;	// the sampler's filter
+	g_Config.Conditioning[0] = 0;
+	g_bDeviceColumn = true;
+	if ( !StartWriting() ) {
+		fprintf( stderr, "Couldn't create an output file from %s: %s\n", pattern, strerror(errno) );
+		g_bDeviceColumn = false;
+		VirtualUnload( g_VirtualDevices, ndevs );
+		return 2;
+	}
+	printf( "%s\n", g_MsgText );
+	SessionInfoSave( false );
+
+	// Keep to the schedule, sleeping if we're early, so the writer has the
+	// processor to itself; if we're late, catch up flat out. Every device's
+	// sample for a tick goes in together.
+	if ( timeGetDevCaps( &tc, sizeof tc ) != TIMERR_NOERROR ||
+		 timeBeginPeriod( resolution = min( max( tc.wPeriodMin, 1 ), tc.wPeriodMax ) ) != TIMERR_NOERROR )
+		resolution = 0;		// the sleeps are just longer
+	SpinWaitInit( w );
+	w.sleeponly = true;
+	for ( n = 0; (t = (LONGLONG)floor( n * 1000000.0 / rate + 0.5 )) < (LONGLONG)secs * 1000000; n++ ) {
+		if ( SessionClock() > t + 1000 )
+			late++;
+		SpinWaitUntil( w, t );
+
+		for ( d = 0; d < ndevs; d++ ) {
+			JOYREC rec;
+			DWORD pressed = VirtualPoll( g_VirtualDevices[d], states[d], t, js );
+			rec.time = t;
+			rec.x = js.lX;
+			rec.y = -js.lY;
+			rec.type = JOYREC_SAMPLE;
+			rec.button = g_Config.Button2 ? (WORD)((pressed >> (g_Config.Button2 -1)) & 1) : 0;
+			rec.flags = (DWORD)d << JOYREC_DEVICESHIFT;
+			records++;
+			if ( !QueuePut( g_WriteQueue, rec ) )
+				dropped++;
+		}
 	}
 
-	return retcode;
+	double elapsed = SessionClock() / 1000000.0;
+	if ( resolution )
+		timeEndPeriod( resolution );
+	StopWriting();
+	g_bDeviceColumn = false;
+	VirtualUnload( g_VirtualDevices, ndevs );
+
+	printf( "%I64d records from %d device%s in %.2f s: %.0f records/s (asked for %.0f)\n",
+		records, ndevs, ndevs == 1 ? "" : "s", elapsed, records / elapsed, rate * ndevs );
+	printf( "%I64d dropped because the writer fell behind, %I64d ticks more than 1 ms late%s\n",
+		dropped, late, g_Health.writeerrors > 0 ? ", and there were write errors" : "" );
+	printf( "Write latency (ms): 50%% %.3f, 99%% %.3f, max %.3f\n", HealthPercentile( g_Health.latency, 0.5 ) / 1000.0,
+		HealthPercentile( g_Health.latency, 0.99 ) / 1000.0, HealthPercentile( g_Health.latency, 1.0 ) / 1000.0 );
+
+	return (dropped > 0 || g_Health.writeerrors > 0) ? 1 : 0;
 }
 
 //-----------------------------------------------------------------------------
@@ -1639,18 +8765,13 @@ HRESULT InitDirectInput( HWND hDlg )
 {
     HRESULT hr;
 
-    // Register with the DirectInput subsystem and get a pointer
-    // to a IDirectInput interface we can use.
-    // Create a DInput object
-    if( FAILED( hr = DirectInput8Create( GetModuleHandle(NULL), DIRECTINPUT_VERSION, 
-                                         IID_IDirectInput8, (VOID**)&g_pDI, NULL ) ) )
-        return hr;
-
-    // Look for a simple joystick we can use for this program.
-    if( FAILED( hr = g_pDI->EnumDevices( DI8DEVCLASS_GAMECTRL, 
-                                         EnumJoysticksCallback,
-                                         NULL, DIEDFL_ATTACHEDONLY ) ) )
-        return hr;
+	// Take over what DeviceThreadProc() found.
+	g_pDI = g_Device.pDI;
+	g_pJoystick = g_Device.pDevice;
+	g_Device.pDI = NULL;
+	g_Device.pDevice = NULL;
+	if( FAILED( hr = g_Device.hr ) )
+		return hr;
 
     // Make sure we got a joystick
     if( NULL == g_pJoystick )
@@ -1660,6 +8781,11 @@ HRESULT InitDirectInput( HWND hDlg )
         return S_OK;
     }
 
+	// Remember which it was, for its calibration.
+	g_DeviceGuid = g_Device.guid;
+	strcpy( g_DeviceName, g_Device.name );
+	g_bHaveDevice = true;
+
     // Set the cooperative level to let DInput know how this device should
     // interact with the system and with other DInput applications.
     if( FAILED( hr = g_pJoystick->SetCooperativeLevel( hDlg, DISCL_NONEXCLUSIVE |
@@ -1691,9 +8817,88 @@ HRESULT InitDirectInput( HWND hDlg )
     if( FAILED( hr = g_pJoystick->SetProperty( DIPROP_BUFFERSIZE, &dipwd.diph ) ) ) 
 	    return hr;
 
+	// Have it tell us when it changes, so it needn't be polled when idle. That
+	// has to be set up before it's acquired. Without it, it's polled.
+	if ( (g_Idle.hEvent = CreateEvent( NULL, FALSE, FALSE, NULL )) != NULL &&
+		 FAILED( g_pJoystick->SetEventNotification( g_Idle.hEvent ) ) ) {
+		CloseHandle( g_Idle.hEvent );
+		g_Idle.hEvent = NULL;
+	}
+
+	CalibrationLoad();
+
 	return S_OK;
 }
 
+//-----------------------------------------------------------------------------
+// Name: DeviceThreadProc()
+// Desc: Find the joystick, trying the one used last time first, and tell the
+//       window when it's done. InitDirectInput() then sets it up.
+//-----------------------------------------------------------------------------
+DWORD WINAPI DeviceThreadProc( LPVOID lpParameter )
+{
+	HWND hDlg = (HWND)lpParameter;
+	GUID guid;
+
+    // Register with the DirectInput subsystem and get a pointer
+    // to a IDirectInput interface we can use.
+	g_Device.hr = DirectInput8Create( GetModuleHandle(NULL), DIRECTINPUT_VERSION,
+									  IID_IDirectInput8, (VOID**)&g_Device.pDI, NULL );
+
+	// Asking after one device is quick; it's looking through them all that isn't.
+	if ( SUCCEEDED( g_Device.hr ) && DeviceRecall( guid ) &&
+		 g_Device.pDI->GetDeviceStatus( guid ) == DI_OK &&
+		 SUCCEEDED( g_Device.pDI->CreateDevice( guid, &g_Device.pDevice, NULL ) ) ) {
+		DIDEVICEINSTANCE ddi;
+		ddi.dwSize = sizeof ddi;
+		g_Device.guid = guid;
+		g_Device.cached = true;
+		if ( SUCCEEDED( g_Device.pDevice->GetDeviceInfo( &ddi ) ) )
+			strncpy( g_Device.name, ddi.tszProductName, sizeof g_Device.name );
+		g_Device.name[sizeof g_Device.name -1] = 0;
+
+	} else if ( SUCCEEDED( g_Device.hr ) ) {
+	    // Look for a simple joystick we can use for this program.
+		g_Device.hr = g_Device.pDI->EnumDevices( DI8DEVCLASS_GAMECTRL, EnumJoysticksCallback,
+												 NULL, DIEDFL_ATTACHEDONLY );
+	}
+
+	PostMessage( hDlg, WM_DEVICE_FOUND, 0, 0 );
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// Name: DeviceRecall()
+// Desc: Get the joystick used last time. Returns false if there wasn't one.
+//-----------------------------------------------------------------------------
+bool DeviceRecall( GUID& guid )
+{
+	HKEY hRegKey;
+	DWORD dwType, reglen = sizeof guid;
+
+	if ( RegOpenKeyEx( HKEY_CURRENT_USER, "SOFTWARE\\JoystickMonitor", 0, KEY_QUERY_VALUE, &hRegKey ) != 0 )
+		return false;
+	bool ok = RegQueryValueEx( hRegKey, "DeviceGuid", 0, &dwType, (unsigned char*)&guid, &reglen ) == 0 &&
+			  dwType == REG_BINARY && reglen == sizeof guid;
+	RegCloseKey( hRegKey );
+	return ok;
+}
+
+//-----------------------------------------------------------------------------
+// Name: DeviceRemember()
+// Desc: Note the joystick, to be tried first next time.
+//-----------------------------------------------------------------------------
+bool DeviceRemember( const GUID& guid )
+{
+	HKEY hRegKey;
+
+	if ( RegCreateKeyEx( HKEY_CURRENT_USER, "SOFTWARE\\JoystickMonitor", 0, "", 0, KEY_WRITE, NULL, &hRegKey, NULL ) != 0 )
+		return false;
+	bool ok = RegSetValueEx( hRegKey, "DeviceGuid", 0, REG_BINARY, (const unsigned char*)&guid, sizeof guid ) == 0;
+	RegCloseKey( hRegKey );
+	return ok;
+}
+
 //-----------------------------------------------------------------------------
 // Name: EnumJoysticksCallback()
 // Desc: Called once for each enumerated joystick. If we find one, create a
@@ -1705,13 +8910,18 @@ BOOL CALLBACK EnumJoysticksCallback( const DIDEVICEINSTANCE* pdidInstance,
     HRESULT hr;
 
     // Obtain an interface to the enumerated joystick.
-    hr = g_pDI->CreateDevice( pdidInstance->guidInstance, &g_pJoystick, NULL );
+    hr = g_Device.pDI->CreateDevice( pdidInstance->guidInstance, &g_Device.pDevice, NULL );
 
     // If it failed, then we can't use this joystick. (Maybe the user unplugged
     // it while we were in the middle of enumerating it.)
     if( FAILED(hr) ) 
         return DIENUM_CONTINUE;
 
+	// Remember which it was.
+	g_Device.guid = pdidInstance->guidInstance;
+	strncpy( g_Device.name, pdidInstance->tszProductName, sizeof g_Device.name );
+	g_Device.name[sizeof g_Device.name -1] = 0;
+
     // Stop enumeration. Note: we're just taking the first joystick we get. You
     // could store all the enumerated joysticks and let the user pick.
     return DIENUM_STOP;
@@ -1721,17 +8931,61 @@ BOOL CALLBACK EnumJoysticksCallback( const DIDEVICEINSTANCE* pdidInstance,
 // Name: EnumObjectsCallback()
 // Desc: Callback function for enumerating objects (axes, buttons, POVs) on a 
 //       joystick. This function enables user interface elements for objects
-//       that are found to exist, and scales axes min/max values.
+//       that are found to exist, and scales axes min/max values, or for a raw
+//       capture leaves them be.
 //-----------------------------------------------------------------------------
 BOOL CALLBACK EnumObjectsCallback( const DIDEVICEOBJECTINSTANCE* pdidoi,
                                    VOID* pContext )
 {
     HWND hDlg = (HWND)pContext;
 
+	// Raw capture: leave the axes in the device's units, and find out their range.
+	if( (pdidoi->dwType & DIDFT_AXIS) && g_Config.RawAxes )
+	{
+		DIPROPDWORD dipdw;
+		dipdw.diph.dwSize		= sizeof(DIPROPDWORD);
+		dipdw.diph.dwHeaderSize	= sizeof(DIPROPHEADER);
+		dipdw.diph.dwHow		= DIPH_BYID;
+		dipdw.diph.dwObj		= pdidoi->dwType;
+		dipdw.dwData			= DIPROPCALIBRATIONMODE_RAW;
+		if( FAILED( g_pJoystick->SetProperty( DIPROP_CALIBRATIONMODE, &dipdw.diph ) ) )
+			return DIENUM_STOP;
+
+		int axis = pdidoi->guidType == GUID_XAxis ? 0 : pdidoi->guidType == GUID_YAxis ? 1 : -1;
+		if ( axis >= 0 ) {
+			DIPROPRANGE diprg;
+			diprg.diph.dwSize		= sizeof(DIPROPRANGE);
+			diprg.diph.dwHeaderSize	= sizeof(DIPROPHEADER);
+			diprg.diph.dwHow		= DIPH_BYID;
+			diprg.diph.dwObj		= pdidoi->dwType;
+
+			// Older drivers don't say; HID reports are 16 bits at most.
+			if( FAILED( g_pJoystick->GetProperty( DIPROP_LOGICALRANGE, &diprg.diph ) ) ||
+				diprg.lMax <= diprg.lMin ) {
+				diprg.lMin = 0;
+				diprg.lMax = 65535;
+			}
+			g_RawMin[axis] = diprg.lMin;
+			g_RawMax[axis] = diprg.lMax;
+			g_bRawAxes = true;
+		}
+		return DIENUM_CONTINUE;
+	}
+
     // For axes that are returned, set the DIPROP_RANGE property for the
     // enumerated axis in order to scale min/max values.
     if( pdidoi->dwType & DIDFT_AXIS )
     {
+		// In case it was raw before.
+		DIPROPDWORD dipdw;
+		dipdw.diph.dwSize		= sizeof(DIPROPDWORD);
+		dipdw.diph.dwHeaderSize	= sizeof(DIPROPHEADER);
+		dipdw.diph.dwHow		= DIPH_BYID;
+		dipdw.diph.dwObj		= pdidoi->dwType;
+		dipdw.dwData			= DIPROPCALIBRATIONMODE_COOKED;
+		g_pJoystick->SetProperty( DIPROP_CALIBRATIONMODE, &dipdw.diph );
+		g_bRawAxes = false;
+
         DIPROPRANGE diprg; 
         diprg.diph.dwSize       = sizeof(DIPROPRANGE); 
         diprg.diph.dwHeaderSize = sizeof(DIPROPHEADER); 
@@ -1749,6 +9003,356 @@ BOOL CALLBACK EnumObjectsCallback( const DIDEVICEOBJECTINSTANCE* pdidoi,
 }
 
 
+//-----------------------------------------------------------------------------
+// Name: StatsShow()
+// Desc: Fill in the running statistics panel.
+//-----------------------------------------------------------------------------
+static void StatsShow( HWND hDlg )
+{
+	RUNNINGSTATS s;
+	char text[1024];
+
+	StatsCopy( s );
+	if ( s.lines == 0 ) {
+		SetDlgItemText( hDlg, IDC_STATS_TEXT, g_bWriting ? "Waiting for the first line..." :
+			"Not recording. These are the statistics of the lines written while recording." );
+		return;
+	}
+
+	double n = (double)(LONGLONG)s.lines, secs = (s.last - s.first) / 1000000.0;
+	#define PERCENT(c) (100.0 * (LONGLONG)(c) / n)
+	_snprintf( text, sizeof text,
+		"%s: %I64u lines, %.1f s\n\n"
+		"Mean: x %.1f, y %.1f\n"
+		"Standard deviation: x %.1f, y %.1f\n"
+		"Range: x %ld..%ld, y %ld..%ld\n"
+		"Distance travelled: %.0f (%.0f a second)\n"
+		"Button presses: %I64u\n\n"
+		"Time in each octant:\n"
+		"NW %.1f%%\tN %.1f%%\tNE %.1f%%\n"
+		"W %.1f%%\tCentre %.1f%%\tE %.1f%%\n"
+		"SW %.1f%%\tS %.1f%%\tSE %.1f%%",
+		g_bWriting ? "Recording" : "Last recording", s.lines, secs,
+		s.mean[0], s.mean[1],
+		n > 1 ? sqrt( s.m2[0] / (n - 1) ) : 0.0, n > 1 ? sqrt( s.m2[1] / (n - 1) ) : 0.0,
+		s.min[0], s.max[0], s.min[1], s.max[1],
+		s.distance, secs > 0 ? s.distance / secs : 0.0,
+		s.presses,
+		PERCENT(s.octant[3]), PERCENT(s.octant[2]), PERCENT(s.octant[1]),
+		PERCENT(s.octant[4]), PERCENT(s.centre), PERCENT(s.octant[0]),
+		PERCENT(s.octant[5]), PERCENT(s.octant[6]), PERCENT(s.octant[7]) );
+	#undef PERCENT
+	text[sizeof text -1] = 0;
+	SetDlgItemText( hDlg, IDC_STATS_TEXT, text );
+}
+
+//-----------------------------------------------------------------------------
+// Name: StatsDlgProc
+// Desc: Handles the running statistics panel. It's modeless, so it can stay
+//       open while recording, and refreshes itself on a timer.
+//-----------------------------------------------------------------------------
+INT_PTR CALLBACK StatsDlgProc( HWND hDlg, UINT msg, WPARAM wParam, LPARAM lParam )
+{
+    switch( msg )
+    {
+        case WM_INITDIALOG:
+			StatsShow( hDlg );
+			SetTimer( hDlg, STATS_TIMER, STATS_PERIOD, NULL );
+			break;
+
+		case WM_TIMER:
+			if ( wParam == STATS_TIMER )
+				StatsShow( hDlg );
+			break;
+
+		case WM_COMMAND:
+			if ( LOWORD(wParam) != IDCANCEL )
+				return FALSE;
+			// Fall through
+		case WM_CLOSE:
+			DestroyWindow( hDlg );
+			break;
+
+		case WM_DESTROY:
+			KillTimer( hDlg, STATS_TIMER );
+			CheckMenuItem( GetSystemMenu( GetWindow( hDlg, GW_OWNER ), FALSE ), IDM_STATS, MF_UNCHECKED );
+			g_hStatsDlg = NULL;
+			break;
+
+		default:
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+//-----------------------------------------------------------------------------
+// Name: CalibrationKey()
+// Desc: Where a device's calibration lives, under the program's own key.
+//-----------------------------------------------------------------------------
+static void CalibrationKey( char * buf, size_t len, const GUID& guid )
+{
+	_snprintf( buf, len, "SOFTWARE\\JoystickMonitor\\Calibration\\{%08lX-%04X-%04X-%02X%02X-%02X%02X%02X%02X%02X%02X}",
+		guid.Data1, guid.Data2, guid.Data3, guid.Data4[0], guid.Data4[1], guid.Data4[2],
+		guid.Data4[3], guid.Data4[4], guid.Data4[5], guid.Data4[6], guid.Data4[7] );
+	buf[len -1] = 0;
+}
+
+//-----------------------------------------------------------------------------
+// Name: CalibrationLoad()
+// Desc: Read the joystick's calibration, if it has one, and build the tables
+//       that apply it. Call again whenever the axis maximum changes.
+//-----------------------------------------------------------------------------
+bool CalibrationLoad( void )
+{
+	char key[MAX_PATH];
+	HKEY hRegKey;
+	CALIBRATION cal;
+	LONG * field = (LONG *)&cal;
+
+	for ( int axis = 0; axis < 2; axis++ ) {
+		free( g_Calibration.lut[axis] );
+		g_Calibration.lut[axis] = NULL;
+	}
+
+	if ( !g_bHaveDevice )
+		return false;
+
+	CalibrationKey( key, sizeof key, g_DeviceGuid );
+	if ( RegOpenKeyEx( HKEY_CURRENT_USER, key, 0, KEY_QUERY_VALUE, &hRegKey ) != 0 )
+		return false;
+
+	bool ok = true;
+	for ( int i = 0; i < CAL_VALUES; i++ ) {
+		DWORD dwType, reglen = sizeof(LONG);
+		if ( RegQueryValueEx( hRegKey, CalibrationValues[i], 0, &dwType,
+							  (unsigned char*)&field[i], &reglen ) != 0 )
+			ok = false;
+	}
+	RegCloseKey( hRegKey );
+
+	if ( !ok || cal.range <= 0 )
+		return false;
+
+	// It was taken with whatever the axis maximum was then.
+	LONG R = g_Config.XYMinMax;
+	for ( int i = 1; i < CAL_VALUES; i++ )
+		field[i] = MulDiv( field[i], R, cal.range );
+	cal.range = R;
+
+	if ( R > CAL_MAX_RANGE )
+		return false;
+	for ( int axis = 0; axis < 2; axis++ ) {
+		if ( (g_Calibration.lut[axis] = (LONG *)malloc( (2 * R + 1) * sizeof(LONG) )) == NULL ) {
+			free( g_Calibration.lut[0] );
+			g_Calibration.lut[0] = NULL;
+			return false;
+		}
+		CalibrationTable( cal, axis, g_Calibration.lut[axis] );
+	}
+
+	g_Calibration.cal = cal;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Name: CalibrationTable()
+// Desc: Fill in the table for an axis, mapping every value the axis can read to
+//       its corrected value. Readings within the rest band are the centre; each
+//       side of it is stretched separately to reach its end.
+//-----------------------------------------------------------------------------
+void CalibrationTable( const CALIBRATION& cal, int axis, LONG * lut )
+{
+	LONG R = cal.range;
+	LONG centre = cal.centre[axis], rest = cal.rest[axis];
+	LONGLONG up = max( 1, cal.highest[axis] - centre - rest );		// travel each side
+	LONGLONG down = max( 1, centre - cal.lowest[axis] - rest );
+
+	for ( LONG v = -R; v <= R; v++ ) {
+		LONGLONG d = v - centre, out = 0;
+		if ( d > rest )
+			out = min( (LONGLONG)R, ((d - rest) * R + up / 2) / up );
+		else if ( d < -rest )
+			out = max( -(LONGLONG)R, -((-d - rest) * R + down / 2) / down );
+		lut[v + R] = (LONG)out;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Name: CalibrationSave()
+// Desc: Store a calibration for the joystick, and start using it.
+//-----------------------------------------------------------------------------
+bool CalibrationSave( const CALIBRATION& cal )
+{
+	char key[MAX_PATH];
+	HKEY hRegKey;
+	long lResult;
+	const LONG * field = (const LONG *)&cal;
+
+	CalibrationKey( key, sizeof key, g_DeviceGuid );
+	if ( (lResult = RegCreateKeyEx( HKEY_CURRENT_USER, key, 0, "", 0, KEY_WRITE, NULL, &hRegKey, NULL )) != 0 ) {
+		SetLastError( lResult );
+		return false;
+	}
+
+	lResult = RegSetValueEx( hRegKey, "Name", 0, REG_SZ, (const unsigned char*)g_DeviceName, strlen(g_DeviceName) +1 );
+	for ( int i = 0; lResult == 0 && i < CAL_VALUES; i++ )
+		lResult = RegSetValueEx( hRegKey, CalibrationValues[i], 0, REG_DWORD,
+								 (const unsigned char*)&field[i], sizeof(LONG) );
+	RegCloseKey( hRegKey );
+
+	if ( lResult != 0 ) {
+		SetLastError( lResult );
+		return false;
+	}
+	return CalibrationLoad();
+}
+
+//-----------------------------------------------------------------------------
+// Name: CalibrationForget()
+// Desc: Drop the joystick's calibration, and stop using it.
+//-----------------------------------------------------------------------------
+void CalibrationForget( void )
+{
+	char key[MAX_PATH];
+
+	CalibrationKey( key, sizeof key, g_DeviceGuid );
+	RegDeleteKey( HKEY_CURRENT_USER, key );
+	CalibrationLoad();
+}
+
+//-----------------------------------------------------------------------------
+// Name: CalibrateDlgProc
+// Desc: Handles the `Calibrate' dialog: the stick is left alone to find its
+//       centre and how much it wanders there, then moved round to find its ends.
+//-----------------------------------------------------------------------------
+INT_PTR CALLBACK CalibrateDlgProc( HWND hDlg, UINT msg, WPARAM wParam, LPARAM lParam )
+{
+	static enum { Ready, Centring, Sweeping } step;
+	static DWORD started;
+	static LONGLONG sum[2];
+	static LONG lo[2], hi[2], samples;
+	static CALIBRATION cal;
+	char text[256];
+	DIJOYSTATE js;
+	int axis;
+
+    switch( msg )
+    {
+        case WM_INITDIALOG:
+		    EnableWindow( GetWindow( hDlg, GW_OWNER ), FALSE );
+			step = Ready;
+			g_bCalibrating = true;		// PollJoystick() gives the readings as they are
+			_snprintf( text, sizeof text, "Calibrating %s.\n\nLet go of the stick, so it's resting in the middle, "
+				"then click Start and leave it for a couple of seconds.", g_DeviceName );
+			SetDlgItemText( hDlg, IDC_CAL_TEXT, text );
+			SetDlgItemText( hDlg, IDC_CAL_READING, g_Calibration.lut[0] ? "It's calibrated now." : "It isn't calibrated now." );
+			SetDlgItemText( hDlg, IDC_CAL_NEXT, "&Start" );
+			EnableWindow( GetDlgItem( hDlg, IDC_CAL_FORGET ), g_Calibration.lut[0] != NULL );
+			SetTimer( hDlg, CAL_TIMER, CAL_PERIOD, NULL );
+			break;
+
+		case WM_TIMER:
+			if ( wParam != CAL_TIMER || step == Ready || PollJoystick( js ) != S_OK )
+				break;
+
+			for ( axis = 0; axis < 2; axis++ ) {
+				LONG v = axis == 0 ? js.lX : js.lY;
+				sum[axis] += v;
+				lo[axis] = min( lo[axis], v );
+				hi[axis] = max( hi[axis], v );
+			}
+			samples++;
+
+			if ( step == Centring && GetTickCount() - started >= CAL_CENTRE_TIME ) {
+				memset( &cal, 0, sizeof cal );
+				cal.range = g_Config.XYMinMax;
+				for ( axis = 0; axis < 2; axis++ ) {
+					cal.centre[axis] = (LONG)(sum[axis] >= 0 ? (sum[axis] + samples / 2) / samples : -((-sum[axis] + samples / 2) / samples));
+					cal.rest[axis] = max( cal.centre[axis] - lo[axis], hi[axis] - cal.centre[axis] );
+					lo[axis] = hi[axis] = cal.centre[axis];
+				}
+				step = Sweeping;
+				SetDlgItemText( hDlg, IDC_CAL_TEXT, "Now move the stick slowly all the way round its range, "
+					"two or three times, pushing it firmly into the corners. Then click Done." );
+				SetDlgItemText( hDlg, IDC_CAL_NEXT, "&Done" );
+				EnableWindow( GetDlgItem( hDlg, IDC_CAL_NEXT ), TRUE );
+			}
+
+			if ( step == Sweeping ) {
+				_snprintf( text, sizeof text, "Centre %ld, %ld (wanders by %ld, %ld)\nX from %ld to %ld, Y from %ld to %ld",
+					cal.centre[0], cal.centre[1], cal.rest[0], cal.rest[1], lo[0], hi[0], lo[1], hi[1] );
+				SetDlgItemText( hDlg, IDC_CAL_READING, text );
+			}
+			break;
+
+		case WM_CLOSE:
+			wParam = IDCANCEL;
+			// Fall through
+		case WM_COMMAND:
+            switch( LOWORD(wParam) )
+			{
+				case IDC_CAL_NEXT:
+					if ( step == Ready ) {
+						step = Centring;
+						started = GetTickCount();
+						samples = 0;
+						for ( axis = 0; axis < 2; axis++ ) {
+							sum[axis] = 0;
+							lo[axis] = MAXLONG;
+							hi[axis] = MINLONG;
+						}
+						SetDlgItemText( hDlg, IDC_CAL_TEXT, "Keep still..." );
+						EnableWindow( GetDlgItem( hDlg, IDC_CAL_NEXT ), FALSE );
+						break;
+					}
+
+					// Each side must have moved well clear of the rest band, or
+					// the stretch would be huge.
+					for ( axis = 0; axis < 2; axis++ ) {
+						if ( hi[axis] - cal.centre[axis] - cal.rest[axis] < g_Config.XYMinMax / 4 ||
+							 cal.centre[axis] - lo[axis] - cal.rest[axis] < g_Config.XYMinMax / 4 )
+							break;
+					}
+					if ( axis < 2 ) {
+						MessageBox( hDlg, "The stick didn't go far enough both ways on both axes. Keep going, "
+							"or cancel.", Title, MB_OK | MB_ICONEXCLAMATION );
+						break;
+					}
+					for ( axis = 0; axis < 2; axis++ ) {
+						cal.lowest[axis] = lo[axis];
+						cal.highest[axis] = hi[axis];
+					}
+					if ( !CalibrationSave( cal ) ) {
+						MessageBox( hDlg, "Couldn't save the calibration.", Title, MB_OK | MB_ICONERROR );
+						break;
+					}
+					// Fall through
+
+				case IDC_CAL_FORGET:
+					if ( LOWORD(wParam) == IDC_CAL_FORGET )
+						CalibrationForget();
+					// Fall through
+
+				case IDCANCEL:
+					KillTimer( hDlg, CAL_TIMER );
+					g_bCalibrating = false;
+				    EnableWindow( GetWindow( hDlg, GW_OWNER ), TRUE );
+                    EndDialog( hDlg, LOWORD(wParam) == IDC_CAL_NEXT );
+					break;
+
+				default:
+					return FALSE;
+			}
+			break;
+
+		default:
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
 //-----------------------------------------------------------------------------
 // Name: PollJoystick()
 // Desc: Return the current state of the joystick.
@@ -1759,9 +9363,43 @@ HRESULT PollJoystick( DIJOYSTATE& js )
 {
     HRESULT     hr;
 
+	if ( g_pVirtual != NULL ) {
+		// On the real clock, for the display. The sampler has its own view.
+		DWORD pressed = VirtualPoll( *g_pVirtual, g_VirtualGui, SessionClock(), js );
+		if ( g_Config.SuppressX == true ) {
+			js.lX = 0;
+		} else if ( g_Config.SuppressY == true ) {
+			js.lY = 0;
+		}
+
+		for ( int i = 0; i < 32; i++ ) {
+			if ( !(pressed & (1UL << i)) )
+				continue;
+			if ( g_pFeed != NULL ) {
+				JOYREC rec;
+				rec.time = SessionClock();
+				rec.x = js.lX;
+				rec.y = -js.lY;
+				rec.type = JOYREC_BUTTON;
+				rec.button = (WORD)(i + 1);
+				rec.flags = JOYREC_PRESSED;
+				FeedPost( rec );
+			}
+			if ( i + 1 == g_Config.JoystickButton )
+				g_JoystickButton = true;
+			else if ( i + 1 == g_Config.Button2 && g_Config.SoundFeedback )
+				MessageBeep(-1);
+		}
+		return S_OK;
+	}
+
 	if ( ! g_pJoystick )
 		return -1;
 
+	// While it's lost, the recovery thread has it.
+	if ( g_Recovery.lost )
+		return DIERR_UNPLUGGED;
+
 	// Poll the device to read the current state. Not always necessary, in which
 	// case it returns an error. Just ignore that.
     g_pJoystick->Poll(); 
@@ -1774,27 +9412,48 @@ HRESULT PollJoystick( DIJOYSTATE& js )
         // DInput is telling us that the input stream has been
         // interrupted. We aren't tracking any state between polls, so
         // we don't have any special reset that needs to be done. We
-        // just re-acquire and try again.
-		hr = g_pJoystick->Acquire();
-        while( hr == DIERR_INPUTLOST ) 
-            hr = g_pJoystick->Acquire();
-
-		// Try one more time
-	    if( FAILED( hr = g_pJoystick->GetDeviceState( sizeof js, &js ) ) )
+        // re-acquire and try again, once; if that doesn't do, it's most
+        // likely been unplugged, and the recovery thread takes over.
+		if ( SUCCEEDED( hr = g_pJoystick->Acquire() ) ) {
+			InterlockedIncrement( &g_Health.reacquires );
+			hr = g_pJoystick->GetDeviceState( sizeof js, &js );
+		}
+	    if( FAILED( hr ) ) {
+			RecoveryLost();
 	        return hr;
+		}
     }
 
+	// Correct for the stick's wear, if it's been calibrated.
+	if ( g_Calibration.lut[0] != NULL && !g_bCalibrating && !g_bRawAxes ) {
+		LONG R = g_Calibration.cal.range;
+		js.lX = g_Calibration.lut[0][min( max( js.lX, -R ), R ) + R];
+		js.lY = g_Calibration.lut[1][min( max( js.lY, -R ), R ) + R];
+	}
+
 	// If we're suppressing motion, just clear the coords
 	if ( g_Config.SuppressX == true ) {
-		js.lX = 0;
+		js.lX = g_bRawAxes ? (g_RawMin[0] + g_RawMax[0]) / 2 : 0;
 	} else if ( g_Config.SuppressY == true ) {
-		js.lY = 0;
+		js.lY = g_bRawAxes ? (g_RawMin[1] + g_RawMax[1]) / 2 : 0;
 	}
 
 	// Loop through all events, looking just for button presses since the last check
 	DIDEVICEOBJECTDATA rgdod;
 	DWORD dwInOut = 1;
 	while ( g_pJoystick->GetDeviceData( sizeof rgdod, &rgdod, &dwInOut, 0 ) == DI_OK &&	dwInOut == 1 ) {
+		if ( g_pFeed != NULL && rgdod.dwOfs >= DIJOFS_BUTTON(0) &&
+			 rgdod.dwOfs < DIJOFS_BUTTON(sizeof js.rgbButtons / sizeof js.rgbButtons[0]) ) {
+			JOYREC rec;
+			rec.time = SessionClock();
+			rec.x = js.lX;
+			rec.y = g_bRawAxes ? js.lY : -js.lY;
+			rec.type = JOYREC_BUTTON;
+			rec.button = (WORD)(rgdod.dwOfs - DIJOFS_BUTTON(0) + 1);
+			rec.flags = ((rgdod.dwData & 0x80) ? JOYREC_PRESSED : 0) | (g_bRawAxes ? JOYREC_RAWUNITS : 0);
+			FeedPost( rec );
+		}
+
 		if ( rgdod.dwOfs == DIJOFS_BUTTON(g_Config.JoystickButton -1) && (rgdod.dwData & 0x80) )
 			g_JoystickButton = true;
 		else if (g_Config.Button2)
@@ -1814,18 +9473,76 @@ HRESULT PollJoystick( DIJOYSTATE& js )
 //-----------------------------------------------------------------------------
 HRESULT UpdateInputState( HWND hDlg )
 {
-    TCHAR       strText[512]; // Device state text
     DIJOYSTATE	js;           // DInput joystick state 
+	static DIJOYSTATE last;		// where it was when last read
+
+	// Get the input's device state. If it's unplugged, it's left where it was
+	// and the status line says so.
+    if( PollJoystick( js ) != S_OK ) {
+		js = last;
+
+	} else {
+		if ( !g_bWriting && (g_pFeed != NULL || g_bPublishing) ) {
+			// The sampler isn't running, so keep the feed and stream up to date from here.
+			JOYREC rec;
+			rec.time = SessionClock();
+			rec.x = js.lX;
+			rec.y = g_bRawAxes ? js.lY : -js.lY;
+			rec.type = JOYREC_SAMPLE;
+			rec.button = 0;
+			rec.flags = g_bRawAxes ? JOYREC_RAWUNITS : 0;
+			FeedPost( rec );
+			Publish( rec );
+		}
+
+		// The crosshair is drawn to the axis maximum, whatever's recorded.
+		if ( g_bRawAxes ) {
+			js.lX = RawToRange( js.lX, g_RawMin[0], g_RawMax[0], g_Config.XYMinMax );
+			js.lY = RawToRange( js.lY, g_RawMin[1], g_RawMax[1], g_Config.XYMinMax );
+		}
+	}
+
+	if ( g_Recovery.lost == 0 )
+		last = js;
+
+	// Button 2 shows or hides the coordinates.
+	static bool button2 = false;
+	if ( (js.rgbButtons[1] & 0x80) && !button2 )
+		g_Config.ShowAxes = !g_Config.ShowAxes;
+	button2 = (js.rgbButtons[1] & 0x80) != 0;
+
+	// A replay has the display to itself.
+	if ( g_Replay.data != NULL )
+		return S_OK;
+
+	// Leave the display be if nothing on it has changed. While recording the
+	// status line always has.
+	bool lost = g_Recovery.lost != 0;
+	if ( !g_bWriting && !g_Idle.redraw && js.lX == g_Idle.x && js.lY == g_Idle.y &&
+		 g_Config.ShowAxes == g_Idle.showaxes && lost == g_Idle.lost )
+		return S_OK;
+	g_Idle.redraw = false;
+	g_Idle.x = js.lX;
+	g_Idle.y = js.lY;
+	g_Idle.showaxes = g_Config.ShowAxes;
+	g_Idle.lost = lost;
+
+	return DrawInputState( hDlg, js );
+}
+
+//-----------------------------------------------------------------------------
+// Name: DrawInputState()
+// Desc: Display a joystick state, live or replayed.
+//-----------------------------------------------------------------------------
+HRESULT DrawInputState( HWND hDlg, const DIJOYSTATE& js )
+{
+    TCHAR       strText[512]; // Device state text
     HDC         hDC;
     INT         x, y, radius, xsize, ysize;
 	RECT		rctWinSize;
 
 	static const float deg2rad = 0.0174532925f;
 
-	// Get the input's device state
-    if( PollJoystick( js ) != S_OK )
-		memset( &js, 0, sizeof js);	// it may be unplugged.
-
 	// Display joystick state to dialog
 	HWND hXhair = GetDlgItem( hDlg, IDC_CROSSHAIR );
 
@@ -2020,8 +9737,20 @@ HRESULT UpdateInputState( HWND hDlg )
 	}
 	SetTextAlign( hDC, oldalign );
 
-	// Display any msgs
-	SetWindowText( GetDlgItem( hDlg, IDC_MSGS ), g_MsgText );
+	// Display any msgs, whether the joystick's there, and how recording's going.
+	{
+		char status[sizeof g_MsgText + 160];
+		size_t len = 0;
+		status[0] = 0;
+		if ( g_Recovery.lost && g_Replay.data == NULL )
+			len = _snprintf( status, sizeof status, "JOYSTICK DISCONNECTED; " );
+		if ( g_MsgText[0] != 0 )
+			len += _snprintf( &status[len], sizeof status - len, g_bWriting ? "%s; " : "%s", g_MsgText );
+		if ( g_bWriting )
+			HealthSummary( &status[len], sizeof status - len );
+		status[sizeof status -1] = 0;
+		SetWindowText( GetDlgItem( hDlg, IDC_MSGS ), status );
+	}
 
 	// Erase old ellipse
 	SelectPen( hDC, GetStockPen(WHITE_PEN) );
@@ -2144,7 +9873,7 @@ HRESULT UpdateInputState( HWND hDlg )
 	oldx = x, oldy = y;
 
     SelectBrush( hDC, GetStockBrush(DC_BRUSH) );
-	SetDCBrushColor( hDC, g_bWriting ? RGB(0xff,0,0) : RGB(0xf0,0xf0,0xf0) );
+	SetDCBrushColor( hDC, g_bWriting ? RGB(0xff,0,0) : g_Replay.data != NULL ? RGB(0x40,0x80,0xff) : RGB(0xf0,0xf0,0xf0) );
     Ellipse( hDC, x-radius, y-radius, x+radius, y+radius );
 
     ReleaseDC( hXhair, hDC );
@@ -2163,7 +9892,14 @@ VOID FreeDirectInput()
     if( g_pJoystick ) 
         g_pJoystick->Unacquire();
     
-    // Release any DirectInput objects.
+    // Release any DirectInput objects, including any not yet taken over.
     SAFE_RELEASE( g_pJoystick );
     SAFE_RELEASE( g_pDI );
+    SAFE_RELEASE( g_Device.pDevice );
+    SAFE_RELEASE( g_Device.pDI );
+
+	if ( g_Idle.hEvent != NULL ) {
+		CloseHandle( g_Idle.hEvent );
+		g_Idle.hEvent = NULL;
+	}
 }
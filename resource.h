@@ -10,6 +10,9 @@
 #define ID_EDIT_CONFIG                  106
 #define ID_HELP_ABOUT                   107
 #define IDD_ABOUT                       108
+#define IDD_ADVANCED                    109
+#define IDD_CALIBRATE                   110
+#define IDD_STATS                       111
 #define IDC_CLOSE                       1001
 #define IDC_X_AXIS                      1010
 #define IDC_Y_AXIS                      1011
@@ -78,14 +81,41 @@
 #define IDC_EDIT1                       1081
 #define IDC_GRID_COUNT                  1081
 #define IDC_TICK_COUNT                  1082
+#define IDC_CONFIG_ADVANCED             1083
+#define IDC_FLUSH_INTERVAL              1084
+#define IDC_MAX_SESSION                 1085
+#define IDC_MAPPED_OUTPUT               1086
+#define IDC_SHARED_FEED                 1087
+#define IDC_STREAM_PORT                 1088
+#define IDC_MARKER_PORT                 1089
+#define IDC_REPLAY                      1090
+#define IDC_REPLAY_POS                  1091
+#define IDC_REPLAY_SPEED                1092
+#define IDC_OVERSAMPLE_RATE             1093
+#define IDC_DECIMATION_FILTER           1094
+#define IDC_ENVELOPE                    1095
+#define IDC_CONDITIONING                1096
+#define IDC_CALIBRATE                   1097
+#define IDC_CAL_TEXT                    1098
+#define IDC_CAL_READING                 1099
+#define IDC_CAL_NEXT                    1100
+#define IDC_CAL_FORGET                  1101
+#define IDC_RAW_AXES                    1102
+#define IDC_STATS_TEXT                  1103
+#define IDC_TIMING                      1104
+#define IDC_SAMPLER_PRIORITY            1105
+#define IDC_SAMPLER_CORE                1106
+#define IDC_LOCK_MEMORY                 1107
+#define IDC_SEGMENT_MINS                1108
+#define IDC_SEGMENT_MB                  1109
 
 // Next default values for new objects
 // 
 #ifdef APSTUDIO_INVOKED
 #ifndef APSTUDIO_READONLY_SYMBOLS
-#define _APS_NEXT_RESOURCE_VALUE        109
+#define _APS_NEXT_RESOURCE_VALUE        112
 #define _APS_NEXT_COMMAND_VALUE         40001
-#define _APS_NEXT_CONTROL_VALUE         1083
+#define _APS_NEXT_CONTROL_VALUE         1110
 #define _APS_NEXT_SYMED_VALUE           101
 #endif
 #endif